@@ -0,0 +1,1848 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Offline benchmarks against gsv_mockserver. Every result is printed as one JSON object per line so runs can be diffed across releases.
+ */
+
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+#include "../cstreetview_private.h"
+#include "../cstreetview.hpp"
+#include "gsv_mockserver.h"
+#include <jpeglib.h>
+
+typedef struct gsvBenchConfig_S {
+	gsvMockConfig mock;
+	// Multiplies the default iteration counts
+	double scale;
+	int crawlCount;
+	int crawlZoom;
+	// Only run the benchmark with this name
+	const char* only;
+	// Dump gsv_stats to stderr in Prometheus text format at the end
+	int prometheus;
+	// Chrome trace-event output of the whole run
+	const char* tracePath;
+	// Workers and connections for the async benchmarks, 0 for the loop's defaults
+	int loopWorkers;
+	int loopConnections;
+	// A recorded tile for the decode benchmarks instead of the mock's synthetic one
+	const char* decodeFile;
+	// Decode threads, 0 for one per core
+	int decodeThreads;
+} gsvBenchConfig;
+
+typedef struct gsvBenchSamples_S {
+	double* milliseconds;
+	int numSamples;
+	int numErrors;
+	double startTime;
+	double endTime;
+} gsvBenchSamples;
+
+// Async completions land on the loop's workers, samples are taken under the lock
+typedef struct gsvBenchAsync_S {
+	gsvBenchSamples* samples;
+	pthread_mutex_t mutex;
+	double submitTime;
+} gsvBenchAsync;
+
+/*
+ * Measurement
+ */
+
+static double gsv_bench_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return now.tv_sec*1000.0+now.tv_nsec/1000000.0;
+}
+
+// VmHWM so the peak can be reset between benchmarks, ru_maxrss where /proc is missing
+static long gsv_bench_peak_rss()
+{
+	long peak = -1;
+	FILE* status = fopen("/proc/self/status","r");
+	if(status != NULL)
+	{
+		char line[256];
+		while(peak < 0 && fgets(line,sizeof(line),status) != NULL)
+		{
+			if(strncmp(line,"VmHWM:",6) == 0)
+				peak = atol(line+6);
+		}
+		fclose(status);
+	}
+	if(peak >= 0)
+		return peak;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+	return usage.ru_maxrss;
+}
+
+// Brings the peak back down to the current RSS, no effect without /proc
+static void gsv_bench_reset_peak_rss()
+{
+	FILE* clearRefs = fopen("/proc/self/clear_refs","w");
+	if(clearRefs == NULL)
+		return;
+	fputs("5",clearRefs);
+	fclose(clearRefs);
+}
+
+static int gsv_bench_iterations(const gsvBenchConfig* config,int iterations)
+{
+	int scaled = (int)(iterations*config->scale);
+	return (scaled < 1) ? 1 : scaled;
+}
+
+static void gsv_bench_begin(gsvBenchSamples* samples,int iterations)
+{
+	samples->milliseconds = (double*) malloc(sizeof(double)*iterations);
+	samples->numSamples = 0;
+	samples->numErrors = 0;
+	samples->startTime = gsv_bench_now();
+	samples->endTime = samples->startTime;
+}
+
+static void gsv_bench_sample(gsvBenchSamples* samples,double startTime,int failed)
+{
+	samples->milliseconds[samples->numSamples++] = gsv_bench_now()-startTime;
+	if(failed)
+		samples->numErrors++;
+}
+
+static int gsv_bench_compare(const void* a,const void* b)
+{
+	double difference = *(const double*)a-*(const double*)b;
+	return (difference > 0.0) - (difference < 0.0);
+}
+
+static double gsv_bench_percentile(const gsvBenchSamples* samples,double percentile)
+{
+	if(samples->numSamples == 0)
+		return 0.0;
+	int index = (int)(percentile*(samples->numSamples-1)+0.5);
+	return samples->milliseconds[index];
+}
+
+// units is what one iteration produces, e.g. the number of panoramas in a crawl
+static void gsv_bench_report(const gsvBenchConfig* config,const char* name,int zoomLevel,gsvBenchSamples* samples,int unitsPerSample)
+{
+	samples->endTime = gsv_bench_now();
+	qsort(samples->milliseconds,samples->numSamples,sizeof(double),gsv_bench_compare);
+
+	double seconds = (samples->endTime-samples->startTime)/1000.0;
+	double throughput = (seconds > 0.0) ? (samples->numSamples*unitsPerSample)/seconds : 0.0;
+
+	printf("{\"benchmark\":\"%s\",\"zoom\":%d,\"iterations\":%d,\"errors\":%d,\"seconds\":%.3f,\"throughput_per_sec\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"peak_rss_kb\":%ld,\"latency_ms\":%d,\"bandwidth_kbps\":%d,\"error_rate\":%.3f}\n",
+		name,zoomLevel,samples->numSamples,samples->numErrors,seconds,throughput,gsv_bench_percentile(samples,0.5),gsv_bench_percentile(samples,0.99),gsv_bench_peak_rss(),
+		config->mock.latencyMs,config->mock.bandwidthKBps,config->mock.errorRate);
+	fflush(stdout);
+
+	free(samples->milliseconds);
+	samples->milliseconds = NULL;
+}
+
+static int gsv_bench_selected(const gsvBenchConfig* config,const char* name)
+{
+	return config->only == NULL || strcmp(config->only,name) == 0;
+}
+
+/*
+ * Benchmarks
+ */
+
+static void gsv_bench_open(const gsvBenchConfig* config)
+{
+	int iterations = gsv_bench_iterations(config,200);
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,iterations);
+
+	for(int i=0;i<iterations;i++)
+	{
+		char panoramaId[GSV_PANORAMA_ID_LENGTH];
+		gsv_mock_panorama_id(i,0,panoramaId);
+
+		double startTime = gsv_bench_now();
+		GSV* panorama = gsv_open(panoramaId);
+		gsv_bench_sample(&samples,startTime,panorama == NULL);
+		gsv_close(&panorama);
+	}
+
+	gsv_bench_report(config,"gsv_open",-1,&samples,1);
+}
+
+// One sample is a BFS level of 16 ids, comparable with 16 consecutive gsv_open samples
+static void gsv_bench_open_many(const gsvBenchConfig* config)
+{
+	const int batchSize = 16;
+	int iterations = gsv_bench_iterations(config,50);
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,iterations);
+
+	char panoramaIds[batchSize][GSV_PANORAMA_ID_LENGTH];
+	const char* batchIds[batchSize];
+	GSV* panoramas[batchSize];
+	gsvStatus statuses[batchSize];
+
+	for(int i=0;i<iterations;i++)
+	{
+		for(int j=0;j<batchSize;j++)
+		{
+			gsv_mock_panorama_id(j,i,panoramaIds[j]);
+			batchIds[j] = panoramaIds[j];
+		}
+
+		double startTime = gsv_bench_now();
+		gsvStatus status = gsv_open_many(batchIds,batchSize,panoramas,statuses);
+		gsv_bench_sample(&samples,startTime,status != GSV_OK);
+		for(int j=0;j<batchSize;j++)
+			gsv_close(&panoramas[j]);
+	}
+
+	gsv_bench_report(config,"gsv_open_many",-1,&samples,batchSize);
+}
+
+static void gsv_bench_tile(const gsvBenchConfig* config,GSV* panorama)
+{
+	int iterations = gsv_bench_iterations(config,200);
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,iterations);
+
+	for(int i=0;i<iterations;i++)
+	{
+		double startTime = gsv_bench_now();
+		IplImage* tileImage = gsv_tile(panorama,3,i%6,(i/6)%3);
+		gsv_bench_sample(&samples,startTime,tileImage == NULL);
+		if(tileImage != NULL)
+			cvReleaseImage(&tileImage);
+	}
+
+	gsv_bench_report(config,"gsv_tile",3,&samples,1);
+}
+
+static void gsv_bench_panorama(const gsvBenchConfig* config,GSV* panorama)
+{
+	// Fewer runs as the tile count grows, zoom 5 is 338 tiles a time
+	const int iterationsPerZoom[] = { 50, 30, 20, 10, 4, 2 };
+
+	for(int zoomLevel=0;zoomLevel<=5;zoomLevel++)
+	{
+		int iterations = gsv_bench_iterations(config,iterationsPerZoom[zoomLevel]);
+		gsvBenchSamples samples;
+		gsv_bench_begin(&samples,iterations);
+
+		for(int i=0;i<iterations;i++)
+		{
+			double startTime = gsv_bench_now();
+			IplImage* panoramaImage = gsv_panorama(panorama,zoomLevel);
+			gsv_bench_sample(&samples,startTime,panoramaImage == NULL);
+			if(panoramaImage != NULL)
+				cvReleaseImage(&panoramaImage);
+		}
+
+		gsv_bench_report(config,"gsv_panorama",zoomLevel,&samples,1);
+	}
+}
+
+// Peak memory of writing a panorama to disk, streamed a tile row at a time against the whole image encoded at once
+static void gsv_bench_panorama_write(const gsvBenchConfig* config,GSV* panorama)
+{
+	const int iterationsPerZoom[] = { 50, 30, 20, 10, 4, 2 };
+	const int encodeParameters[] = { CV_IMWRITE_JPEG_QUALITY, 90, 0 };
+	char path[] = "/tmp/gsv_bench_XXXXXX";
+	int descriptor = mkstemp(path);
+	if(descriptor < 0)
+		return;
+	close(descriptor);
+
+	for(int zoomLevel=3;zoomLevel<=5;zoomLevel++)
+	{
+		int iterations = gsv_bench_iterations(config,iterationsPerZoom[zoomLevel]);
+		gsvBenchSamples samples;
+
+		gsv_bench_reset_peak_rss();
+		gsv_bench_begin(&samples,iterations);
+		for(int i=0;i<iterations;i++)
+		{
+			double startTime = gsv_bench_now();
+			gsvStatus status = gsv_panorama_write(panorama,zoomLevel,path,0);
+			gsv_bench_sample(&samples,startTime,status != GSV_OK);
+		}
+		gsv_bench_report(config,"panorama_write_stream",zoomLevel,&samples,1);
+
+		gsv_bench_reset_peak_rss();
+		gsv_bench_begin(&samples,iterations);
+		for(int i=0;i<iterations;i++)
+		{
+			double startTime = gsv_bench_now();
+			IplImage* panoramaImage = gsv_panorama(panorama,zoomLevel);
+			CvMat* encoded = cvEncodeImage(".jpg",panoramaImage,encodeParameters);
+			FILE* file = fopen(path,"wb");
+			int failed = (encoded == NULL || file == NULL);
+			if(file != NULL)
+			{
+				if(encoded != NULL)
+					fwrite(encoded->data.ptr,1,encoded->rows*encoded->cols,file);
+				fclose(file);
+			}
+			gsv_bench_sample(&samples,startTime,failed);
+			if(encoded != NULL)
+				cvReleaseMat(&encoded);
+			cvReleaseImage(&panoramaImage);
+		}
+		gsv_bench_report(config,"panorama_write_whole",zoomLevel,&samples,1);
+	}
+
+	unlink(path);
+}
+
+// The same breadth first walk as the example, encoding to memory rather than disk
+static void gsv_bench_crawl(const gsvBenchConfig* config)
+{
+	int maxCount = config->crawlCount;
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,maxCount);
+
+	char (*completedPanoramaIds)[GSV_PANORAMA_ID_LENGTH] = (char (*)[GSV_PANORAMA_ID_LENGTH]) calloc(maxCount,GSV_PANORAMA_ID_LENGTH);
+	char (*queuedPanoramaIds)[GSV_PANORAMA_ID_LENGTH] = (char (*)[GSV_PANORAMA_ID_LENGTH]) calloc(maxCount*4+1,GSV_PANORAMA_ID_LENGTH);
+	int numberCompleted = 0;
+	int numberQueued = 1;
+	gsv_mock_panorama_id(0,0,queuedPanoramaIds[0]);
+
+	const int encodeParameters[] = { CV_IMWRITE_JPEG_QUALITY, 95, 0 };
+
+	for(int i=0;i<numberQueued && numberCompleted<maxCount;i++)
+	{
+		int found = 0;
+		for(int j=0;j<numberCompleted && found==0;j++)
+			found = (memcmp(completedPanoramaIds[j],queuedPanoramaIds[i],GSV_PANORAMA_ID_LENGTH) == 0);
+		if(found)
+			continue;
+
+		double startTime = gsv_bench_now();
+		GSV* panorama = gsv_open(queuedPanoramaIds[i]);
+		if(panorama == NULL)
+		{
+			gsv_bench_sample(&samples,startTime,1);
+			memcpy(completedPanoramaIds[numberCompleted++],queuedPanoramaIds[i],GSV_PANORAMA_ID_LENGTH);
+			continue;
+		}
+
+		IplImage* panoramaImage = gsv_panorama(panorama,config->crawlZoom);
+		unsigned long long encodeStart = gsv_stats_clock();
+		CvMat* encoded = cvEncodeImage(".jpg",panoramaImage,encodeParameters);
+		gsv_stats_record(GSV_STAGE_ENCODE,gsv_stats_clock()-encodeStart);
+		cvReleaseMat(&encoded);
+		cvReleaseImage(&panoramaImage);
+		memcpy(completedPanoramaIds[numberCompleted++],panorama->dataProperties.panoramaId,GSV_PANORAMA_ID_LENGTH);
+
+		for(int j=0;j<panorama->annotationProperties.numLinks && numberQueued<maxCount*4+1;j++)
+			memcpy(queuedPanoramaIds[numberQueued++],panorama->annotationProperties.links[j].panoramaId,GSV_PANORAMA_ID_LENGTH);
+
+		gsv_close(&panorama);
+		gsv_bench_sample(&samples,startTime,0);
+	}
+
+	gsv_bench_report(config,"crawl",config->crawlZoom,&samples,1);
+
+	free(completedPanoramaIds);
+	free(queuedPanoramaIds);
+}
+
+static void gsv_bench_async_image(gsvStatus status,IplImage* image,void* userData)
+{
+	gsvBenchAsync* async = (gsvBenchAsync*)userData;
+	if(image != NULL)
+		cvReleaseImage(&image);
+
+	pthread_mutex_lock(&async->mutex);
+	gsv_bench_sample(async->samples,async->submitTime,status != GSV_OK);
+	pthread_mutex_unlock(&async->mutex);
+}
+
+// Every tile is submitted up front, a sample is the time from submission to its callback
+static void gsv_bench_tile_async(const gsvBenchConfig* config,GSV* panorama)
+{
+	int iterations = gsv_bench_iterations(config,2000);
+	gsvLoop* loop = gsv_loop_create(config->loopWorkers,config->loopConnections);
+	if(loop == NULL)
+		return;
+
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,iterations);
+	gsvBenchAsync async;
+	async.samples = &samples;
+	pthread_mutex_init(&async.mutex,NULL);
+	async.submitTime = gsv_bench_now();
+
+	for(int i=0;i<iterations;i++)
+	{
+		if(gsv_tile_async(loop,panorama,3,i%6,(i/6)%3,gsv_bench_async_image,&async) != GSV_OK)
+		{
+			pthread_mutex_lock(&async.mutex);
+			gsv_bench_sample(&samples,async.submitTime,1);
+			pthread_mutex_unlock(&async.mutex);
+		}
+	}
+	gsv_loop_wait(loop);
+
+	gsv_bench_report(config,"gsv_tile_async",3,&samples,1);
+	gsv_loop_destroy(&loop);
+	pthread_mutex_destroy(&async.mutex);
+}
+
+// Panoramas are assembled one after another, the parallelism is across the tiles of each
+static void gsv_bench_panorama_async(const gsvBenchConfig* config,GSV* panorama)
+{
+	const int iterationsPerZoom[] = { 50, 30, 20, 10, 4, 2 };
+	gsvLoop* loop = gsv_loop_create(config->loopWorkers,config->loopConnections);
+	if(loop == NULL)
+		return;
+
+	for(int zoomLevel=0;zoomLevel<=5;zoomLevel++)
+	{
+		int iterations = gsv_bench_iterations(config,iterationsPerZoom[zoomLevel]);
+		gsvBenchSamples samples;
+		gsv_bench_begin(&samples,iterations);
+		gsvBenchAsync async;
+		async.samples = &samples;
+		pthread_mutex_init(&async.mutex,NULL);
+
+		for(int i=0;i<iterations;i++)
+		{
+			async.submitTime = gsv_bench_now();
+			if(gsv_panorama_async(loop,panorama,zoomLevel,gsv_bench_async_image,&async) != GSV_OK)
+				gsv_bench_sample(&samples,async.submitTime,1);
+			gsv_loop_wait(loop);
+		}
+
+		gsv_bench_report(config,"gsv_panorama_async",zoomLevel,&samples,1);
+		pthread_mutex_destroy(&async.mutex);
+	}
+
+	gsv_loop_destroy(&loop);
+}
+
+// Opens a panorama, then all of its links and their zoom 1 panoramas along with its own horizon tiles at zoom 3, everything issued before it is awaited. Returns the number of requests that failed
+static gsv::Task<int> gsv_bench_coroutine_expand(gsv::Loop& loop,const char* panoramaId)
+{
+	gsv::Result<gsv::Panorama> root = co_await gsv::open(loop,panoramaId);
+	if(!root)
+		co_return 1;
+
+	std::vector<gsv::Operation<gsv::Panorama>> links;
+	for(int i=0;i<root.value->annotationProperties.numLinks;i++)
+		links.push_back(gsv::open(loop,root.value->annotationProperties.links[i].panoramaId));
+	std::vector<gsv::Operation<gsv::Image>> tiles;
+	for(int x=0;x<6;x++)
+		tiles.push_back(gsv::tile(loop,root.value,3,x,1));
+
+	int errors = 0;
+	std::vector<gsv::Panorama> opened;
+	std::vector<gsv::Operation<gsv::Image>> images;
+	for(gsv::Operation<gsv::Panorama>& link : links)
+	{
+		gsv::Result<gsv::Panorama> next = co_await link;
+		if(!next)
+		{
+			errors++;
+			continue;
+		}
+		images.push_back(gsv::panorama(loop,next.value,1));
+		opened.push_back(std::move(next.value));
+	}
+	for(gsv::Operation<gsv::Image>& image : images)
+		errors += !(co_await image);
+	for(gsv::Operation<gsv::Image>& tile : tiles)
+		errors += !(co_await tile);
+	co_return errors;
+}
+
+// The same requests one after another with the blocking calls
+static int gsv_bench_blocking_expand(char* panoramaId)
+{
+	GSV* root = gsv_open(panoramaId);
+	if(root == NULL)
+		return 1;
+
+	int errors = 0;
+	for(int i=0;i<root->annotationProperties.numLinks;i++)
+	{
+		GSV* next = gsv_open(root->annotationProperties.links[i].panoramaId);
+		IplImage* image = (next != NULL) ? gsv_panorama(next,1) : NULL;
+		errors += (image == NULL);
+		if(image != NULL)
+			cvReleaseImage(&image);
+		gsv_close(&next);
+	}
+	for(int x=0;x<6;x++)
+	{
+		IplImage* tile = gsv_tile(root,3,x,1);
+		errors += (tile == NULL);
+		if(tile != NULL)
+			cvReleaseImage(&tile);
+	}
+	gsv_close(&root);
+	return errors;
+}
+
+// cstreetview.hpp against the blocking calls, each iteration expanding the next panorama along a column of the mock's grid
+static void gsv_bench_coroutines(const gsvBenchConfig* config)
+{
+	int iterations = gsv_bench_iterations(config,20);
+	gsv::Loop loop(config->loopWorkers,config->loopConnections);
+	if(loop.get() == NULL)
+		return;
+
+	for(int coroutines=1;coroutines>=0;coroutines--)
+	{
+		gsvBenchSamples samples;
+		gsv_bench_begin(&samples,iterations);
+		for(int i=0;i<iterations;i++)
+		{
+			char panoramaId[GSV_PANORAMA_ID_LENGTH];
+			gsv_mock_panorama_id(5000+coroutines,i,panoramaId);
+			double startTime = gsv_bench_now();
+			int errors = coroutines ? gsv::sync_wait(gsv_bench_coroutine_expand(loop,panoramaId)) : gsv_bench_blocking_expand(panoramaId);
+			gsv_bench_sample(&samples,startTime,errors != 0);
+		}
+		gsv_bench_report(config,coroutines ? "coroutine_expand" : "blocking_expand",1,&samples,1);
+	}
+}
+
+// A viewer stepping along a street, opening each neighbour and showing it at zoom 1. Run cold and then with prefetching
+static void gsv_bench_prefetch_walk(const gsvBenchConfig* config)
+{
+	int iterations = gsv_bench_iterations(config,40);
+	// Shown long enough for the prefetch of the next step to land, as it would be in a viewer
+	const int dwellMs = 100;
+
+	for(int prefetch=0;prefetch<=1;prefetch++)
+	{
+		gsvPrefetchConfig prefetchConfig = gsvPrefetchConfigDefault;
+		prefetchConfig.linkZoom = 1;
+		if(prefetch)
+			gsv_prefetch_enable(&prefetchConfig);
+
+		gsvBenchSamples samples;
+		gsv_bench_begin(&samples,iterations);
+
+		// Each run walks its own column of the mock's grid
+		char panoramaId[GSV_PANORAMA_ID_LENGTH];
+		gsv_mock_panorama_id(1000*(prefetch+1),0,panoramaId);
+		for(int i=0;i<iterations;i++)
+		{
+			double startTime = gsv_bench_now();
+			GSV* panorama = gsv_open(panoramaId);
+			IplImage* panoramaImage = (panorama != NULL) ? gsv_panorama(panorama,1) : NULL;
+			gsv_bench_sample(&samples,startTime,panoramaImage == NULL);
+			if(panoramaImage != NULL)
+				cvReleaseImage(&panoramaImage);
+			if(panorama == NULL)
+				break;
+
+			// Always north, the mock's links step to the neighbouring grid cell
+			int next = 0;
+			for(int j=0;j<panorama->annotationProperties.numLinks;j++)
+			{
+				double yaw = panorama->annotationProperties.links[j].yaw;
+				if(yaw < 45.0 || yaw >= 315.0)
+					next = j;
+			}
+			if(panorama->annotationProperties.numLinks > 0)
+				memcpy(panoramaId,panorama->annotationProperties.links[next].panoramaId,GSV_PANORAMA_ID_LENGTH);
+			gsv_close(&panorama);
+			usleep(dwellMs*1000);
+		}
+
+		gsv_bench_report(config,prefetch ? "prefetch_walk_warm" : "prefetch_walk_cold",1,&samples,1);
+		if(prefetch)
+		{
+			gsvPrefetchStats stats;
+			gsv_prefetch_stats(&stats);
+			gsv_prefetch_disable();
+			printf("{\"benchmark\":\"prefetch_walk\",\"zoom\":1,\"issued\":%llu,\"hits\":%llu,\"lookups\":%llu,\"wasted\":%llu,\"skipped\":%llu,\"hit_rate\":%.3f,\"bytes_fetched\":%llu,\"bytes_used\":%llu}\n",
+				stats.issued,stats.hits,stats.lookups,stats.wasted,stats.skipped,(stats.issued > 0) ? (double)stats.hits/stats.issued : 0.0,stats.bytesFetched,stats.bytesUsed);
+			fflush(stdout);
+		}
+	}
+}
+
+typedef struct gsvBenchRecrawl_S {
+	int panoramas;
+	int refetched;
+	int tiles;
+	int errors;
+	double seconds;
+	unsigned long long bytes;
+} gsvBenchRecrawl;
+
+// Walks count panoramas breadth first from the origin through gsv_refresh_many, downloading the tiles of each new or changed one
+static void gsv_bench_recrawl_walk(const gsvBenchConfig* config,gsvManifest* manifest,int count,gsvBenchRecrawl* result)
+{
+	const int batchSize = 16;
+	int maxQueued = count*4+1;
+	char (*queuedPanoramaIds)[GSV_PANORAMA_ID_LENGTH] = (char (*)[GSV_PANORAMA_ID_LENGTH]) calloc(maxQueued,GSV_PANORAMA_ID_LENGTH);
+	int numberQueued = 1;
+	int next = 0;
+	gsv_mock_panorama_id(0,0,queuedPanoramaIds[0]);
+
+	int maxX = 1;
+	int maxY = 1;
+	gsv_tile_grid(config->crawlZoom,&maxX,&maxY);
+	memset(result,0,sizeof(*result));
+	gsvStats before;
+	gsv_stats_snapshot(&before);
+	double startTime = gsv_bench_now();
+
+	while(next < numberQueued && result->panoramas < count)
+	{
+		const char* panoramaIds[batchSize];
+		GSV* panoramas[batchSize];
+		gsvChange changes[batchSize];
+		gsvStatus statuses[batchSize];
+		int numPanoramas = 0;
+		while(next < numberQueued && numPanoramas < batchSize && result->panoramas+numPanoramas < count)
+			panoramaIds[numPanoramas++] = queuedPanoramaIds[next++];
+		gsv_refresh_many(manifest,panoramaIds,numPanoramas,panoramas,changes,statuses);
+
+		for(int i=0;i<numPanoramas;i++)
+		{
+			result->panoramas++;
+			if(statuses[i] != GSV_OK)
+			{
+				result->errors++;
+				continue;
+			}
+			if(changes[i] != GSV_UNCHANGED)
+			{
+				IplImage* panoramaImage = gsv_panorama(panoramas[i],config->crawlZoom);
+				cvReleaseImage(&panoramaImage);
+				result->refetched++;
+				result->tiles += maxX*maxY;
+			}
+
+			const gsvManifestEntry* entry = (panoramas[i] == NULL) ? gsv_manifest_find(manifest,panoramaIds[i]) : NULL;
+			int numLinks = (panoramas[i] != NULL) ? panoramas[i]->annotationProperties.numLinks : (entry != NULL) ? entry->numLinks : 0;
+			for(int j=0;j<numLinks && numberQueued<maxQueued;j++)
+			{
+				const char* linkPanoramaId = (panoramas[i] != NULL) ? panoramas[i]->annotationProperties.links[j].panoramaId : entry->links[j];
+				int found = 0;
+				for(int k=0;k<numberQueued && found==0;k++)
+					found = (strncmp(queuedPanoramaIds[k],linkPanoramaId,GSV_PANORAMA_ID_LENGTH) == 0);
+				if(found == 0)
+					memcpy(queuedPanoramaIds[numberQueued++],linkPanoramaId,GSV_PANORAMA_ID_LENGTH);
+			}
+			gsv_close(&panoramas[i]);
+		}
+	}
+
+	result->seconds = (gsv_bench_now()-startTime)/1000.0;
+	gsvStats after;
+	gsv_stats_snapshot(&after);
+	result->bytes = after.bytesDownloaded-before.bytesDownloaded;
+	free(queuedPanoramaIds);
+}
+
+// A full crawl records a manifest, then recrawls against mock servers where a growing fraction of the grid has new imagery. The cost should follow the fraction, not the crawl size
+static void gsv_bench_recrawl(const gsvBenchConfig* config,const char* serverUrl)
+{
+	const double changedFractions[] = { 0.0, 0.1, 0.25, 0.5, 1.0 };
+	const int numFractions = sizeof(changedFractions)/sizeof(changedFractions[0]);
+	char manifestPath[] = "/tmp/gsv_bench_manifest_XXXXXX";
+	int descriptor = mkstemp(manifestPath);
+	if(descriptor < 0)
+		return;
+	close(descriptor);
+
+	gsvMockServer server;
+	gsvMockConfig mockConfig = config->mock;
+	if(gsv_mock_start(&mockConfig,&server) != 0)
+		return;
+	gsv_set_server(server.url);
+	gsvManifest* manifest = gsv_manifest_create();
+	gsvBenchRecrawl full;
+	gsv_bench_recrawl_walk(config,manifest,config->crawlCount,&full);
+	gsv_manifest_save(manifest,manifestPath);
+	gsv_manifest_destroy(&manifest);
+	gsv_mock_stop(&server);
+	printf("{\"benchmark\":\"recrawl_full\",\"zoom\":%d,\"panoramas\":%d,\"refetched\":%d,\"tiles\":%d,\"errors\":%d,\"seconds\":%.3f,\"bytes_downloaded\":%llu}\n",
+		config->crawlZoom,full.panoramas,full.refetched,full.tiles,full.errors,full.seconds,full.bytes);
+	fflush(stdout);
+
+	// Without validators every metadata document comes back in full and only the image date saves the tiles
+	for(int conditional=1;conditional>=0;conditional--)
+	{
+		for(int i=0;i<numFractions;i++)
+		{
+			mockConfig.generation = 1;
+			mockConfig.changedFraction = changedFractions[i];
+			mockConfig.conditional = conditional;
+			if(gsv_mock_start(&mockConfig,&server) != 0)
+				continue;
+			gsv_set_server(server.url);
+
+			manifest = gsv_manifest_load(manifestPath);
+			gsvBenchRecrawl recrawl;
+			gsv_bench_recrawl_walk(config,manifest,config->crawlCount,&recrawl);
+			gsv_manifest_destroy(&manifest);
+			gsv_mock_stop(&server);
+
+			printf("{\"benchmark\":\"recrawl\",\"zoom\":%d,\"conditional\":%d,\"changed_fraction\":%.2f,\"panoramas\":%d,\"refetched\":%d,\"tiles\":%d,\"errors\":%d,\"seconds\":%.3f,\"bytes_downloaded\":%llu,\"relative_seconds\":%.3f,\"relative_bytes\":%.3f}\n",
+				config->crawlZoom,conditional,changedFractions[i],recrawl.panoramas,recrawl.refetched,recrawl.tiles,recrawl.errors,recrawl.seconds,recrawl.bytes,
+				(full.seconds > 0.0) ? recrawl.seconds/full.seconds : 0.0,(full.bytes > 0) ? (double)recrawl.bytes/full.bytes : 0.0);
+			fflush(stdout);
+		}
+	}
+
+	unlink(manifestPath);
+	gsv_set_server(serverUrl);
+}
+
+typedef struct gsvBenchDedupe_S {
+	int panoramas;
+	int downloaded;
+	int skipped;
+	// Against the mock's ground truth: skips of the same scene, skips of a different one, and recaptures of a scene already downloaded that were not caught
+	int correctSkips;
+	int falseSkips;
+	int missed;
+	int errors;
+	double seconds;
+	unsigned long long bytes;
+} gsvBenchDedupe;
+
+// Walks count panoramas breadth first from the origin, downloading each one's tiles unless duplicates is given and finds it a near duplicate
+static void gsv_bench_dedupe_walk(const gsvBenchConfig* config,const gsvMockConfig* mockConfig,gsvDuplicateIndex* duplicates,int count,gsvBenchDedupe* result)
+{
+	const int batchSize = 16;
+	int maxQueued = count*4+1;
+	char (*queuedPanoramaIds)[GSV_PANORAMA_ID_LENGTH] = (char (*)[GSV_PANORAMA_ID_LENGTH]) calloc(maxQueued,GSV_PANORAMA_ID_LENGTH);
+	int* keptScenes = (int*) malloc(sizeof(int)*2*count);
+	int numKept = 0;
+	int numberQueued = 1;
+	int next = 0;
+	gsv_mock_panorama_id(0,0,queuedPanoramaIds[0]);
+
+	memset(result,0,sizeof(*result));
+	gsvStats before;
+	gsv_stats_snapshot(&before);
+	double startTime = gsv_bench_now();
+
+	while(next < numberQueued && result->panoramas < count)
+	{
+		const char* panoramaIds[batchSize];
+		GSV* panoramas[batchSize];
+		gsvStatus statuses[batchSize];
+		int numPanoramas = 0;
+		while(next < numberQueued && numPanoramas < batchSize && result->panoramas+numPanoramas < count)
+			panoramaIds[numPanoramas++] = queuedPanoramaIds[next++];
+		gsv_open_many(panoramaIds,numPanoramas,panoramas,statuses);
+
+		for(int i=0;i<numPanoramas;i++)
+		{
+			result->panoramas++;
+			if(statuses[i] != GSV_OK)
+			{
+				result->errors++;
+				continue;
+			}
+
+			int x = 0;
+			int y = 0;
+			int sceneX = 0;
+			int sceneY = 0;
+			gsv_mock_grid_position(panoramaIds[i],&x,&y);
+			gsv_mock_scene(mockConfig,x,y,&sceneX,&sceneY);
+			int sceneKept = 0;
+			for(int k=0;k<numKept && sceneKept==0;k++)
+				sceneKept = (keptScenes[k*2] == sceneX && keptScenes[k*2+1] == sceneY);
+
+			gsvFingerprint fingerprint;
+			gsvFingerprint duplicate;
+			int fingerprinted = (duplicates != NULL && gsv_fingerprint(panoramas[i],&fingerprint) == GSV_OK);
+			if(fingerprinted && gsv_duplicate_find(duplicates,&fingerprint,&duplicate))
+			{
+				int duplicateX = 0;
+				int duplicateY = 0;
+				int duplicateSceneX = 0;
+				int duplicateSceneY = 0;
+				gsv_mock_grid_position(duplicate.panoramaId,&duplicateX,&duplicateY);
+				gsv_mock_scene(mockConfig,duplicateX,duplicateY,&duplicateSceneX,&duplicateSceneY);
+				result->skipped++;
+				if(duplicateSceneX == sceneX && duplicateSceneY == sceneY)
+					result->correctSkips++;
+				else
+					result->falseSkips++;
+			}
+			else
+			{
+				IplImage* panoramaImage = gsv_panorama(panoramas[i],config->crawlZoom);
+				cvReleaseImage(&panoramaImage);
+				// Indexed once downloaded, like the example crawler does once it has written the panorama
+				if(fingerprinted)
+					gsv_duplicate_add(duplicates,&fingerprint);
+				result->downloaded++;
+				if(sceneKept)
+					result->missed++;
+				else
+				{
+					keptScenes[numKept*2] = sceneX;
+					keptScenes[numKept*2+1] = sceneY;
+					numKept++;
+				}
+			}
+
+			for(int j=0;j<panoramas[i]->annotationProperties.numLinks && numberQueued<maxQueued;j++)
+			{
+				const char* linkPanoramaId = panoramas[i]->annotationProperties.links[j].panoramaId;
+				int found = 0;
+				for(int k=0;k<numberQueued && found==0;k++)
+					found = (strncmp(queuedPanoramaIds[k],linkPanoramaId,GSV_PANORAMA_ID_LENGTH) == 0);
+				if(found == 0)
+					memcpy(queuedPanoramaIds[numberQueued++],linkPanoramaId,GSV_PANORAMA_ID_LENGTH);
+			}
+			gsv_close(&panoramas[i]);
+		}
+	}
+
+	result->seconds = (gsv_bench_now()-startTime)/1000.0;
+	gsvStats after;
+	gsv_stats_snapshot(&after);
+	result->bytes = after.bytesDownloaded-before.bytesDownloaded;
+	free(keptScenes);
+	free(queuedPanoramaIds);
+}
+
+// Crawls mock servers where a growing fraction of panoramas are recaptures half a metre from another, once downloading everything and once skipping what gsv_duplicate_find flags. Bytes with dedupe include every zoom 0 tile fingerprinted
+static void gsv_bench_dedupe(const gsvBenchConfig* config,const char* serverUrl)
+{
+	const double duplicateFractions[] = { 0.1, 0.3, 0.5 };
+	const int numFractions = sizeof(duplicateFractions)/sizeof(duplicateFractions[0]);
+
+	for(int i=0;i<numFractions;i++)
+	{
+		gsvMockServer server;
+		gsvMockConfig mockConfig = config->mock;
+		mockConfig.duplicateFraction = duplicateFractions[i];
+		if(gsv_mock_start(&mockConfig,&server) != 0)
+			continue;
+		gsv_set_server(server.url);
+
+		gsvBenchDedupe full;
+		gsv_bench_dedupe_walk(config,&mockConfig,NULL,config->crawlCount,&full);
+		gsvDuplicateIndex* duplicates = gsv_duplicate_index_create(NULL);
+		gsvBenchDedupe dedupe;
+		gsv_bench_dedupe_walk(config,&mockConfig,duplicates,config->crawlCount,&dedupe);
+		gsv_duplicate_index_destroy(&duplicates);
+		gsv_mock_stop(&server);
+
+		printf("{\"benchmark\":\"dedupe\",\"zoom\":%d,\"duplicate_fraction\":%.2f,\"panoramas\":%d,\"downloaded\":%d,\"skipped\":%d,\"correct_skips\":%d,\"false_skips\":%d,\"missed\":%d,\"errors\":%d,\"bytes_full\":%llu,\"bytes_dedupe\":%llu,\"bytes_saved\":%.3f,\"seconds_full\":%.3f,\"seconds_dedupe\":%.3f}\n",
+			config->crawlZoom,duplicateFractions[i],dedupe.panoramas,dedupe.downloaded,dedupe.skipped,dedupe.correctSkips,dedupe.falseSkips,dedupe.missed,full.errors+dedupe.errors,full.bytes,dedupe.bytes,
+			(full.bytes > 0) ? 1.0-(double)dedupe.bytes/full.bytes : 0.0,full.seconds,dedupe.seconds);
+		fflush(stdout);
+	}
+
+	gsv_set_server(serverUrl);
+}
+
+typedef struct gsvBenchShard_S {
+	int zoomLevel;
+	int crawled;
+	int errors;
+} gsvBenchShard;
+
+static void gsv_bench_shard_panorama(GSV* panorama,void* userData)
+{
+	gsvBenchShard* shard = (gsvBenchShard*)userData;
+	IplImage* panoramaImage = gsv_panorama(panorama,shard->zoomLevel);
+	if(panoramaImage == NULL)
+		shard->errors++;
+	else
+		cvReleaseImage(&panoramaImage);
+}
+
+// One shard of shard_scaling, run as a fresh process: gsv_bench --shard-worker server spool shard shards count zoom fd
+static int gsv_bench_shard_worker(int argc,char* argv[])
+{
+	if(argc != 9)
+		return EXIT_FAILURE;
+	gsv_set_server(argv[2]);
+	int shard = atoi(argv[4]);
+	int numShards = atoi(argv[5]);
+	int resultDescriptor = atoi(argv[8]);
+	gsvShardRing* ring = gsv_shard_ring_create(numShards,0);
+	gsvSpool* spool = gsv_spool_open(argv[3],shard,numShards);
+	gsvBenchShard result = { atoi(argv[7]), 0, 0 };
+	gsvStatus status = GSV_ERROR_MEMORY;
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	gsv_mock_panorama_id(0,0,panoramaId);
+	if(ring != NULL && spool != NULL)
+		status = gsv_shard_crawl(spool,ring,panoramaId,atoi(argv[6]),gsv_bench_shard_panorama,&result,&result.crawled);
+	if(status != GSV_OK)
+		result.errors++;
+	gsv_spool_close(&spool);
+	gsv_shard_ring_destroy(&ring);
+
+	char line[64];
+	int length = snprintf(line,sizeof(line),"%d %d\n",result.crawled,result.errors);
+	return (write(resultDescriptor,line,length) == length) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The crawl split across 1, 2 and 4 worker processes. Each is exec'd rather than forked as is, this process already has loop and mock server threads
+static void gsv_bench_shard_scaling(const gsvBenchConfig* config,const char* serverUrl)
+{
+	char spoolDirectory[] = "/tmp/gsv_bench_spool_XXXXXX";
+	if(mkdtemp(spoolDirectory) == NULL)
+		return;
+
+	const int shardCounts[] = { 1, 2, 4 };
+	double baseline = 0.0;
+	for(int i=0;i<(int)(sizeof(shardCounts)/sizeof(shardCounts[0]));i++)
+	{
+		int numShards = shardCounts[i];
+		int descriptors[2];
+		if(gsv_spool_reset(spoolDirectory,numShards) != GSV_OK || pipe(descriptors) != 0)
+			break;
+
+		char arguments[6][32];
+		snprintf(arguments[0],sizeof(arguments[0]),"%d",numShards);
+		snprintf(arguments[1],sizeof(arguments[1]),"%d",(config->crawlCount+numShards-1)/numShards);
+		snprintf(arguments[2],sizeof(arguments[2]),"%d",config->crawlZoom);
+		snprintf(arguments[3],sizeof(arguments[3]),"%d",descriptors[1]);
+		fflush(stdout);
+		double startTime = gsv_bench_now();
+		pid_t workers[4];
+		int started = 0;
+		for(int shard=0;shard<numShards;shard++)
+		{
+			snprintf(arguments[4],sizeof(arguments[4]),"%d",shard);
+			pid_t pid = fork();
+			if(pid == 0)
+			{
+				close(descriptors[0]);
+				execl("/proc/self/exe","gsv_bench","--shard-worker",serverUrl,spoolDirectory,arguments[4],arguments[0],arguments[1],arguments[2],arguments[3],(char*)NULL);
+				_exit(EXIT_FAILURE);
+			}
+			if(pid > 0)
+				workers[started++] = pid;
+		}
+		close(descriptors[1]);
+		// Not wait(), the mock server is a child too
+		for(int worker=0;worker<started;worker++)
+			waitpid(workers[worker],NULL,0);
+		double seconds = (gsv_bench_now()-startTime)/1000.0;
+
+		int crawled = 0;
+		int errors = numShards-started;
+		FILE* results = fdopen(descriptors[0],"r");
+		int shardCrawled = 0;
+		int shardErrors = 0;
+		int reported = 0;
+		while(results != NULL && fscanf(results,"%d %d",&shardCrawled,&shardErrors) == 2)
+		{
+			crawled += shardCrawled;
+			errors += shardErrors;
+			reported++;
+		}
+		if(results != NULL)
+			fclose(results);
+		else
+			close(descriptors[0]);
+		errors += started-reported;
+
+		double throughput = (seconds > 0.0) ? crawled/seconds : 0.0;
+		if(numShards == 1)
+			baseline = throughput;
+		printf("{\"benchmark\":\"shard_scaling\",\"zoom\":%d,\"shards\":%d,\"panoramas\":%d,\"errors\":%d,\"seconds\":%.3f,\"throughput_per_sec\":%.3f,\"speedup\":%.3f,\"latency_ms\":%d}\n",
+			config->crawlZoom,numShards,crawled,errors,seconds,throughput,(baseline > 0.0) ? throughput/baseline : 0.0,config->mock.latencyMs);
+		fflush(stdout);
+	}
+
+	// Every batch was received, so the inboxes are empty
+	gsv_spool_reset(spoolDirectory,4);
+	for(int shard=0;shard<4;shard++)
+	{
+		char path[sizeof(spoolDirectory)+32];
+		snprintf(path,sizeof(path),"%s/status-%d",spoolDirectory,shard);
+		unlink(path);
+		snprintf(path,sizeof(path),"%s/inbox-%d",spoolDirectory,shard);
+		rmdir(path);
+	}
+	rmdir(spoolDirectory);
+}
+
+typedef enum gsvBenchDecoder_E {
+	GSV_BENCH_DECODE_LIBJPEG = 0,
+	GSV_BENCH_DECODE_TILE,
+	GSV_BENCH_DECODE_INTO
+} gsvBenchDecoder;
+
+typedef struct gsvBenchDecode_S {
+	gsvBenchDecoder decoder;
+	const CURLBuffer* jpeg;
+	int iterations;
+	int errors;
+	pthread_t thread;
+} gsvBenchDecode;
+
+// What gsv_decode_tile did before TurboJPEG: a fresh libjpeg decompressor, a row at a time, then an RGB to BGR pass
+static IplImage* gsv_bench_decode_libjpeg(const CURLBuffer* jpeg)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo,(unsigned char*)jpeg->buffer,jpeg->bufferSize);
+	jpeg_read_header(&cinfo,1);
+	jpeg_start_decompress(&cinfo);
+
+	IplImage* tileImage = cvCreateImage(cvSize(cinfo.output_width,cinfo.output_height),IPL_DEPTH_8U,cinfo.num_components);
+	JSAMPROW rowPointer[1] = { (unsigned char*) malloc(cinfo.output_width*cinfo.num_components) };
+	while(cinfo.output_scanline < cinfo.output_height)
+	{
+		jpeg_read_scanlines(&cinfo,rowPointer,1);
+		memcpy(&tileImage->imageData[(cinfo.output_scanline-1)*tileImage->widthStep],rowPointer[0],cinfo.output_width*cinfo.num_components);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(rowPointer[0]);
+
+	cvCvtColor(tileImage,tileImage,CV_RGB2BGR);
+	return tileImage;
+}
+
+static void* gsv_bench_decode_thread(void* data)
+{
+	gsvBenchDecode* decode = (gsvBenchDecode*)data;
+	// Large enough for a zoom 3 panorama of 512 pixel tiles, the tile moves around it like a real assembly
+	IplImage* panoramaImage = (decode->decoder == GSV_BENCH_DECODE_INTO) ? cvCreateImage(cvSize(512*7,512*4),IPL_DEPTH_8U,3) : NULL;
+
+	for(int i=0;i<decode->iterations;i++)
+	{
+		if(decode->decoder == GSV_BENCH_DECODE_INTO)
+		{
+			if(gsv_decode_tile_into(panoramaImage,(i%7)*512,((i/7)%4)*512,decode->jpeg->buffer,decode->jpeg->bufferSize) != 0)
+				decode->errors++;
+			continue;
+		}
+
+		IplImage* tileImage = (decode->decoder == GSV_BENCH_DECODE_TILE) ? gsv_decode_tile(decode->jpeg->buffer,decode->jpeg->bufferSize) : gsv_bench_decode_libjpeg(decode->jpeg);
+		if(tileImage == NULL)
+			decode->errors++;
+		else
+			cvReleaseImage(&tileImage);
+	}
+
+	if(panoramaImage != NULL)
+		cvReleaseImage(&panoramaImage);
+	return NULL;
+}
+
+// Decode throughput with every core busy, reported per core so machines compare
+static void gsv_bench_decode(const gsvBenchConfig* config)
+{
+	CURLBuffer jpeg = CURLBufferDefault;
+	if(config->decodeFile != NULL)
+	{
+		FILE* file = fopen(config->decodeFile,"rb");
+		if(file != NULL)
+		{
+			fseek(file,0,SEEK_END);
+			jpeg.bufferSize = ftell(file);
+			fseek(file,0,SEEK_SET);
+			jpeg.buffer = malloc(jpeg.bufferSize);
+			if(fread(jpeg.buffer,1,jpeg.bufferSize,file) != jpeg.bufferSize)
+			{
+				free(jpeg.buffer);
+				jpeg = CURLBufferDefault;
+			}
+			fclose(file);
+		}
+	}
+	else
+	{
+		char urlString[GSV_MAX_URL_LENGTH];
+		gsv_tile_url("MOCK500000000500000000",3,0,0,urlString,sizeof(urlString));
+		gsv_fetch(urlString,&jpeg);
+	}
+	if(jpeg.buffer == NULL)
+	{
+		printf("Unable to load a tile for the decode benchmarks\n");
+		return;
+	}
+
+	int numThreads = config->decodeThreads;
+	if(numThreads <= 0)
+		numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(numThreads <= 0)
+		numThreads = 1;
+	int iterations = gsv_bench_iterations(config,500);
+
+	const char* names[] = { "decode_libjpeg", "decode_tile", "decode_into" };
+	for(int decoder=GSV_BENCH_DECODE_LIBJPEG;decoder<=GSV_BENCH_DECODE_INTO;decoder++)
+	{
+		gsvBenchDecode* decodes = (gsvBenchDecode*) calloc(numThreads,sizeof(gsvBenchDecode));
+		double startTime = gsv_bench_now();
+		for(int i=0;i<numThreads;i++)
+		{
+			decodes[i].decoder = (gsvBenchDecoder)decoder;
+			decodes[i].jpeg = &jpeg;
+			decodes[i].iterations = iterations;
+			pthread_create(&decodes[i].thread,NULL,gsv_bench_decode_thread,&decodes[i]);
+		}
+		int errors = 0;
+		for(int i=0;i<numThreads;i++)
+		{
+			pthread_join(decodes[i].thread,NULL);
+			errors += decodes[i].errors;
+		}
+		double seconds = (gsv_bench_now()-startTime)/1000.0;
+		double tilesPerSecond = (seconds > 0.0) ? numThreads*iterations/seconds : 0.0;
+
+		printf("{\"benchmark\":\"%s\",\"jpeg_bytes\":%zu,\"threads\":%d,\"tiles\":%d,\"errors\":%d,\"seconds\":%.3f,\"tiles_per_sec\":%.1f,\"tiles_per_sec_per_core\":%.1f,\"peak_rss_kb\":%ld}\n",
+			names[decoder],jpeg.bufferSize,numThreads,numThreads*iterations,errors,seconds,tilesPerSecond,tilesPerSecond/numThreads,gsv_bench_peak_rss());
+		fflush(stdout);
+		free(decodes);
+	}
+
+	free(jpeg.buffer);
+}
+
+typedef struct gsvBenchStress_S {
+	int index;
+	int iterations;
+	int zoomLevel;
+	// This thread's slice of the shared samples
+	double* milliseconds;
+	int errors;
+	pthread_t thread;
+} gsvBenchStress;
+
+static void* gsv_bench_stress_thread(void* data)
+{
+	gsvBenchStress* stress = (gsvBenchStress*)data;
+	for(int i=0;i<stress->iterations;i++)
+	{
+		double startTime = gsv_bench_now();
+		char panoramaId[GSV_PANORAMA_ID_LENGTH];
+		gsv_mock_panorama_id(stress->index,i,panoramaId);
+		GSV* panorama = gsv_open(panoramaId);
+		IplImage* tileImage = (panorama != NULL) ? gsv_tile(panorama,0,0,0) : NULL;
+		IplImage* panoramaImage = (panorama != NULL) ? gsv_panorama(panorama,stress->zoomLevel) : NULL;
+		if(tileImage == NULL || panoramaImage == NULL)
+			stress->errors++;
+		if(tileImage != NULL)
+			cvReleaseImage(&tileImage);
+		if(panoramaImage != NULL)
+			cvReleaseImage(&panoramaImage);
+		gsv_close(&panorama);
+		stress->milliseconds[i] = gsv_bench_now()-startTime;
+	}
+	return NULL;
+}
+
+// The blocking API from 1 to 64 threads at once with no locking of its own, each round opening a panorama and fetching its zoom 0 tile and zoom 1 panorama
+static void gsv_bench_stress(const gsvBenchConfig* config)
+{
+	const int threadCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+	const int zoomLevel = 1;
+	int maxX = 1;
+	int maxY = 1;
+	gsv_tile_grid(zoomLevel,&maxX,&maxY);
+	int requestsPerRound = 2+maxX*maxY;
+	int iterations = gsv_bench_iterations(config,20);
+	double baseline = 0.0;
+
+	for(int i=0;i<(int)(sizeof(threadCounts)/sizeof(threadCounts[0]));i++)
+	{
+		int numThreads = threadCounts[i];
+		gsvBenchSamples samples;
+		gsv_bench_begin(&samples,numThreads*iterations);
+		gsvBenchStress* stresses = (gsvBenchStress*) calloc(numThreads,sizeof(gsvBenchStress));
+		int started = 0;
+		for(int j=0;j<numThreads;j++)
+		{
+			stresses[j].index = j;
+			stresses[j].iterations = iterations;
+			stresses[j].zoomLevel = zoomLevel;
+			stresses[j].milliseconds = &samples.milliseconds[j*iterations];
+			if(pthread_create(&stresses[j].thread,NULL,gsv_bench_stress_thread,&stresses[j]) != 0)
+				break;
+			started++;
+		}
+		for(int j=0;j<started;j++)
+		{
+			pthread_join(stresses[j].thread,NULL);
+			samples.numErrors += stresses[j].errors;
+		}
+		samples.numSamples = started*iterations;
+		samples.endTime = gsv_bench_now();
+		qsort(samples.milliseconds,samples.numSamples,sizeof(double),gsv_bench_compare);
+
+		double seconds = (samples.endTime-samples.startTime)/1000.0;
+		double throughput = (seconds > 0.0) ? samples.numSamples/seconds : 0.0;
+		if(numThreads == 1)
+			baseline = throughput;
+		printf("{\"benchmark\":\"stress\",\"zoom\":%d,\"threads\":%d,\"rounds\":%d,\"requests\":%d,\"errors\":%d,\"seconds\":%.3f,\"rounds_per_sec\":%.3f,\"requests_per_sec\":%.1f,\"speedup\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"peak_rss_kb\":%ld,\"latency_ms\":%d}\n",
+			zoomLevel,started,samples.numSamples,samples.numSamples*requestsPerRound,samples.numErrors,seconds,throughput,throughput*requestsPerRound,(baseline > 0.0) ? throughput/baseline : 0.0,
+			gsv_bench_percentile(&samples,0.5),gsv_bench_percentile(&samples,0.99),gsv_bench_peak_rss(),config->mock.latencyMs);
+		fflush(stdout);
+
+		free(stresses);
+		free(samples.milliseconds);
+	}
+}
+
+// Decoding the fixture's <model>, then per pixel depth for whole panoramas at each zoom's size and for a perspective view
+typedef struct gsvBenchArchive_S {
+	gsvArchive* archive;
+	const GSV* panorama;
+	const void* image;
+	size_t imageSize;
+	int first;
+	int count;
+	int errors;
+	pthread_t thread;
+} gsvBenchArchive;
+
+static void gsv_bench_archive_id(int index,char* panoramaId)
+{
+	snprintf(panoramaId,GSV_PANORAMA_ID_LENGTH,"ARCHIVE%015d",index);
+}
+
+static void* gsv_bench_archive_append(void* data)
+{
+	gsvBenchArchive* appender = (gsvBenchArchive*)data;
+	// Shares the fixture's strings, only the id differs
+	GSV copy = *appender->panorama;
+	for(int i=appender->first;i<appender->first+appender->count;i++)
+	{
+		gsv_bench_archive_id(i,copy.dataProperties.panoramaId);
+		if(gsv_archive_append(appender->archive,&copy,appender->image,appender->imageSize) != GSV_OK)
+			appender->errors++;
+	}
+	return NULL;
+}
+
+// Panoramas written as one file each, as the example did, against one archive with 1 and 8 appenders, then read back by id and scanned. Everything stays in the page cache, so this is the metadata and syscall cost rather than the disk's
+static void gsv_bench_archive(const gsvBenchConfig* config,GSV* panorama)
+{
+	const size_t imageSize = 256*1024;
+	int count = gsv_bench_iterations(config,2000);
+	char directory[] = "/tmp/gsv_bench_archive_XXXXXX";
+	if(mkdtemp(directory) == NULL)
+		return;
+	unsigned char* image = (unsigned char*) malloc(imageSize);
+	for(size_t i=0;i<imageSize;i++)
+		image[i] = (unsigned char)(i*2654435761u>>24);
+	char path[sizeof(directory)+64];
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,count);
+	for(int i=0;i<count;i++)
+	{
+		gsv_bench_archive_id(i,panoramaId);
+		snprintf(path,sizeof(path),"%s/%s.jpg",directory,panoramaId);
+		double startTime = gsv_bench_now();
+		int descriptor = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+		int failed = (descriptor < 0 || write(descriptor,image,imageSize) != (ssize_t)imageSize);
+		if(descriptor >= 0)
+			close(descriptor);
+		gsv_bench_sample(&samples,startTime,failed);
+	}
+	gsv_bench_report(config,"archive_loose_write",-1,&samples,1);
+
+	unsigned char* readBuffer = (unsigned char*) malloc(imageSize);
+	gsv_bench_begin(&samples,count);
+	for(int i=0;i<count;i++)
+	{
+		gsv_bench_archive_id((int)((i*7919ull)%count),panoramaId);
+		snprintf(path,sizeof(path),"%s/%s.jpg",directory,panoramaId);
+		double startTime = gsv_bench_now();
+		int descriptor = open(path,O_RDONLY);
+		int failed = (descriptor < 0 || read(descriptor,readBuffer,imageSize) != (ssize_t)imageSize);
+		if(descriptor >= 0)
+			close(descriptor);
+		gsv_bench_sample(&samples,startTime,failed);
+	}
+	gsv_bench_report(config,"archive_loose_read",-1,&samples,1);
+	free(readBuffer);
+	for(int i=0;i<count;i++)
+	{
+		gsv_bench_archive_id(i,panoramaId);
+		snprintf(path,sizeof(path),"%s/%s.jpg",directory,panoramaId);
+		unlink(path);
+	}
+
+	snprintf(path,sizeof(path),"%s/city.gsva",directory);
+	const int appenderCounts[] = { 1, 8 };
+	for(int run=0;run<2;run++)
+	{
+		unlink(path);
+		int numAppenders = appenderCounts[run];
+		gsvBenchArchive appenders[8];
+		gsvArchive* archive = gsv_archive_create(path);
+		if(archive == NULL)
+			break;
+		double startTime = gsv_bench_now();
+		for(int i=0;i<numAppenders;i++)
+		{
+			appenders[i].archive = archive;
+			appenders[i].panorama = panorama;
+			appenders[i].image = image;
+			appenders[i].imageSize = imageSize;
+			appenders[i].first = i*count/numAppenders;
+			appenders[i].count = (i+1)*count/numAppenders-appenders[i].first;
+			appenders[i].errors = 0;
+			pthread_create(&appenders[i].thread,NULL,gsv_bench_archive_append,&appenders[i]);
+		}
+		int errors = 0;
+		for(int i=0;i<numAppenders;i++)
+		{
+			pthread_join(appenders[i].thread,NULL);
+			errors += appenders[i].errors;
+		}
+		errors += (gsv_archive_close(&archive) != GSV_OK);
+		double seconds = (gsv_bench_now()-startTime)/1000.0;
+		printf("{\"benchmark\":\"archive_append\",\"appenders\":%d,\"records\":%d,\"errors\":%d,\"seconds\":%.3f,\"throughput_per_sec\":%.3f,\"mb_per_sec\":%.1f}\n",
+			numAppenders,count,errors,seconds,(seconds > 0.0) ? count/seconds : 0.0,(seconds > 0.0) ? count*(imageSize/1048576.0)/seconds : 0.0);
+		fflush(stdout);
+	}
+
+	gsvArchive* archive = gsv_archive_open(path);
+	if(archive != NULL)
+	{
+		gsvArchiveRecord record;
+		gsv_bench_begin(&samples,count);
+		for(int i=0;i<count;i++)
+		{
+			gsv_bench_archive_id((int)((i*7919ull)%count),panoramaId);
+			double startTime = gsv_bench_now();
+			int failed = (gsv_archive_find(archive,panoramaId,&record) != GSV_OK || record.imageSize != imageSize);
+			// Touches the image as the loose read copies it
+			volatile unsigned char checksum = 0;
+			for(size_t j=0;!failed && j<record.imageSize;j+=4096)
+				checksum = checksum^((const unsigned char*)record.image)[j];
+			gsv_bench_sample(&samples,startTime,failed);
+		}
+		gsv_bench_report(config,"archive_find",-1,&samples,1);
+
+		int iterations = gsv_bench_iterations(config,5);
+		gsv_bench_begin(&samples,iterations);
+		unsigned long long bytes = 0;
+		for(int i=0;i<iterations;i++)
+		{
+			double startTime = gsv_bench_now();
+			int failed = (gsv_archive_size(archive) != count);
+			unsigned long long checksum = 0;
+			for(int j=0;j<gsv_archive_size(archive);j++)
+			{
+				if(gsv_archive_record(archive,j,&record) != GSV_OK)
+				{
+					failed = 1;
+					continue;
+				}
+				const unsigned long long* words = (const unsigned long long*)record.image;
+				for(size_t k=0;k<record.imageSize/sizeof(unsigned long long);k++)
+					checksum += words[k];
+				bytes += record.metadataSize+record.imageSize;
+			}
+			gsv_bench_sample(&samples,startTime,failed || checksum == 0);
+		}
+		double seconds = (gsv_bench_now()-samples.startTime)/1000.0;
+		gsv_bench_report(config,"archive_scan",-1,&samples,count);
+		printf("{\"benchmark\":\"archive_scan\",\"mb_per_sec\":%.1f}\n",(seconds > 0.0) ? bytes/1048576.0/seconds : 0.0);
+		fflush(stdout);
+		gsv_archive_close(&archive);
+	}
+
+	unlink(path);
+	rmdir(directory);
+	free(image);
+}
+
+static void gsv_bench_depth(const gsvBenchConfig* config,GSV* panorama)
+{
+	if(panorama->modelProperties.depthMapData == NULL || panorama->modelProperties.panoMapData == NULL)
+	{
+		printf("The fixture has no depth or pano map\n");
+		return;
+	}
+
+	int iterations = gsv_bench_iterations(config,200);
+	gsvBenchSamples samples;
+	gsv_bench_begin(&samples,iterations);
+	for(int i=0;i<iterations;i++)
+	{
+		GSV* copy = (GSV*) malloc(sizeof(GSV));
+		*copy = GSVDefault;
+		copy->modelProperties.depthMapData = strdup(panorama->modelProperties.depthMapData);
+		copy->modelProperties.panoMapData = strdup(panorama->modelProperties.panoMapData);
+		double startTime = gsv_bench_now();
+		int failed = (gsv_depth_map(copy) == NULL || gsv_pano_map(copy) == NULL);
+		gsv_bench_sample(&samples,startTime,failed);
+		gsv_close(&copy);
+	}
+	gsv_bench_report(config,"depth_decode",-1,&samples,1);
+
+	for(int zoomLevel=1;zoomLevel<=4;zoomLevel++)
+	{
+		int maxX = 0;
+		int maxY = 0;
+		gsv_tile_grid(zoomLevel,&maxX,&maxY);
+		int width = maxX*512;
+		int height = maxY*512;
+		float* depths = (float*) malloc((size_t)width*height*sizeof(float));
+		iterations = gsv_bench_iterations(config,(zoomLevel < 4) ? 20 : 5);
+		gsv_bench_reset_peak_rss();
+		gsv_bench_begin(&samples,iterations);
+		for(int i=0;i<iterations;i++)
+		{
+			double startTime = gsv_bench_now();
+			gsv_bench_sample(&samples,startTime,gsv_depth_panorama(panorama,width,height,depths) != GSV_OK);
+		}
+		gsv_bench_report(config,"depth_panorama",zoomLevel,&samples,1);
+		free(depths);
+	}
+
+	const int width = 640;
+	const int height = 480;
+	float* depths = (float*) malloc((size_t)width*height*sizeof(float));
+	iterations = gsv_bench_iterations(config,100);
+	gsv_bench_begin(&samples,iterations);
+	for(int i=0;i<iterations;i++)
+	{
+		double startTime = gsv_bench_now();
+		gsv_bench_sample(&samples,startTime,gsv_depth_view(panorama,i*36.0/10.0,0.0,90.0,width,height,depths) != GSV_OK);
+	}
+	gsv_bench_report(config,"depth_view",-1,&samples,1);
+	free(depths);
+}
+
+typedef struct gsvBenchSequence_S {
+	gsvBenchSamples* samples;
+	double frameTime;
+} gsvBenchSequence;
+
+static int gsv_bench_sequence_frame(int frameNumber,const GSV* panorama,double heading,IplImage* frame,void* userData)
+{
+	gsvBenchSequence* sequence = (gsvBenchSequence*)userData;
+	gsv_bench_sample(sequence->samples,sequence->frameTime,0);
+	sequence->frameTime = gsv_bench_now();
+	return 0;
+}
+
+// The direct way to render a frame, the view's maps into a whole panorama image of width by height pixels
+static void gsv_bench_sequence_maps(const gsvSequenceConfig* sequenceConfig,double width,double height,double yaw,CvMat* mapX,CvMat* mapY)
+{
+	double focalLength = (sequenceConfig->width/2.0)/tan(sequenceConfig->fieldOfView*M_PI/360.0);
+	for(int y=0;y<sequenceConfig->height;y++)
+	{
+		for(int x=0;x<sequenceConfig->width;x++)
+		{
+			double rayX = (x+0.5)-sequenceConfig->width/2.0;
+			double rayZ = sequenceConfig->height/2.0-(y+0.5);
+			double u = (atan2(rayX,focalLength)*180.0/M_PI+yaw)/360.0+0.5;
+			double v = 0.5-atan2(rayZ,sqrt(rayX*rayX+focalLength*focalLength))/M_PI;
+			CV_MAT_ELEM(*mapX,float,y,x) = (float)fmin(fmax((u-floor(u))*width-0.5,0.0),width-1.0);
+			CV_MAT_ELEM(*mapY,float,y,x) = (float)fmin(fmax(v*height-0.5,0.0),height-1.0);
+		}
+	}
+}
+
+typedef struct gsvBenchSequenceCheck_S {
+	const gsvSequenceConfig* sequenceConfig;
+	// The whole sphere of the panorama the current frames are checked against
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	IplImage* panoramaImage;
+	CvMat* mapX;
+	CvMat* mapY;
+	IplImage* expected;
+	IplImage* difference;
+	int frames;
+	int mismatched;
+	double maxError;
+} gsvBenchSequenceCheck;
+
+// Compares a frame with the same view remapped from the whole panorama, mean absolute difference per channel
+static int gsv_bench_sequence_check_frame(int frameNumber,const GSV* panorama,double heading,IplImage* frame,void* userData)
+{
+	gsvBenchSequenceCheck* check = (gsvBenchSequenceCheck*)userData;
+	const gsvDataProperties* data = &panorama->dataProperties;
+	int zoomLevel = check->sequenceConfig->zoomLevel;
+	// The sphere at this zoom, which gsv_panorama crops to its tile grid
+	int sphereWidth = data->imageWidth>>(5-zoomLevel);
+	int sphereHeight = data->imageHeight>>(5-zoomLevel);
+	if(check->panoramaImage == NULL || strcmp(check->panoramaId,data->panoramaId) != 0)
+	{
+		if(check->panoramaImage != NULL)
+			cvReleaseImage(&check->panoramaImage);
+		int columns = (sphereWidth+data->tileWidth-1)/data->tileWidth;
+		int rows = (sphereHeight+data->tileHeight-1)/data->tileHeight;
+		check->panoramaImage = cvCreateImage(cvSize(columns*data->tileWidth,rows*data->tileHeight),IPL_DEPTH_8U,3);
+		for(int i=0;i<columns*rows && check->panoramaImage != NULL;i++)
+		{
+			IplImage* tile = gsv_tile((GSV*)panorama,zoomLevel,i%columns,i/columns);
+			if(tile == NULL)
+			{
+				cvReleaseImage(&check->panoramaImage);
+				break;
+			}
+			cvSetImageROI(check->panoramaImage,cvRect((i%columns)*data->tileWidth,(i/columns)*data->tileHeight,tile->width,tile->height));
+			cvCopy(tile,check->panoramaImage);
+			cvResetImageROI(check->panoramaImage);
+			cvReleaseImage(&tile);
+		}
+		strcpy(check->panoramaId,data->panoramaId);
+	}
+
+	check->frames++;
+	if(check->panoramaImage == NULL)
+	{
+		check->mismatched++;
+		return 0;
+	}
+	gsv_bench_sequence_maps(check->sequenceConfig,sphereWidth,sphereHeight,heading-panorama->projectionProperties.panoramaYaw,check->mapX,check->mapY);
+	cvRemap(check->panoramaImage,check->expected,check->mapX,check->mapY,CV_INTER_LINEAR+CV_WARP_FILL_OUTLIERS,cvScalarAll(0));
+	cvAbsDiff(frame,check->expected,check->difference);
+	CvScalar mean = cvAvg(check->difference);
+	double error = (mean.val[0]+mean.val[1]+mean.val[2])/3.0;
+	if(error > check->maxError)
+		check->maxError = error;
+	// Tiles from the wrong panorama are off by tens, resampling the same ones by about 1
+	if(error > 4.0)
+		check->mismatched++;
+	return 0;
+}
+
+// Renders a route that turns in place right after each move, against a mock whose panoramas only link east and each have their own tiles, and checks every frame against the whole panorama
+static void gsv_bench_sequence_check(const gsvBenchConfig* config,const gsvSequenceConfig* sequenceConfig,const char* serverUrl)
+{
+	gsvMockServer server;
+	gsvMockConfig mockConfig = config->mock;
+	mockConfig.fixture = "bench/fixtures/dead_end.xml";
+	// Any fraction above 0 gives every panorama its own tiles, this one makes about one in 10000 a recapture
+	mockConfig.duplicateFraction = 0.000001;
+	if(gsv_mock_start(&mockConfig,&server) != 0)
+		return;
+	gsv_set_server(server.url);
+
+	// East moves on, west has no link and turns around where the route is
+	const int numSteps = 8;
+	double yaws[numSteps];
+	for(int i=0;i<numSteps;i++)
+		yaws[i] = (i%2 == 0) ? 82.5 : 262.5;
+
+	gsvBenchSequenceCheck check;
+	memset(&check,0,sizeof(check));
+	check.sequenceConfig = sequenceConfig;
+	check.mapX = cvCreateMat(sequenceConfig->height,sequenceConfig->width,CV_32FC1);
+	check.mapY = cvCreateMat(sequenceConfig->height,sequenceConfig->width,CV_32FC1);
+	check.expected = cvCreateImage(cvSize(sequenceConfig->width,sequenceConfig->height),IPL_DEPTH_8U,3);
+	check.difference = cvCreateImage(cvSize(sequenceConfig->width,sequenceConfig->height),IPL_DEPTH_8U,3);
+
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	gsv_mock_panorama_id(0,3000,panoramaId);
+	GSV* start = gsv_open(panoramaId);
+	gsvStatus status = GSV_ERROR_NETWORK;
+	if(start != NULL)
+	{
+		status = gsv_sequence_render(start,yaws,numSteps,sequenceConfig,gsv_bench_sequence_check_frame,&check);
+		gsv_close(&start);
+	}
+	gsv_mock_stop(&server);
+	gsv_set_server(serverUrl);
+
+	printf("{\"benchmark\":\"sequence_frames\",\"zoom\":%d,\"frames\":%d,\"expected_frames\":%d,\"mismatched\":%d,\"max_error\":%.2f,\"status\":%d}\n",
+		sequenceConfig->zoomLevel,check.frames,numSteps*sequenceConfig->framesPerStep,check.mismatched,check.maxError,status);
+	fflush(stdout);
+
+	if(check.panoramaImage != NULL)
+		cvReleaseImage(&check.panoramaImage);
+	cvReleaseImage(&check.expected);
+	cvReleaseImage(&check.difference);
+	cvReleaseMat(&check.mapX);
+	cvReleaseMat(&check.mapY);
+}
+
+// A walk east then north through the mock's grid, rendered from only the tiles each view needs against whole panoramas, then checks what the frames show
+static void gsv_bench_sequence(const gsvBenchConfig* config,const char* serverUrl)
+{
+	const int zoomLevel = 3;
+	int numSteps = gsv_bench_iterations(config,20);
+	double* yaws = (double*) malloc(sizeof(double)*numSteps);
+	for(int i=0;i<numSteps;i++)
+		yaws[i] = (i < numSteps/2) ? 82.5 : 352.6;
+	gsvSequenceConfig sequenceConfig = gsvSequenceConfigDefault;
+	sequenceConfig.width = 640;
+	sequenceConfig.height = 360;
+	sequenceConfig.zoomLevel = zoomLevel;
+	sequenceConfig.framesPerStep = 4;
+	int numFrames = numSteps*sequenceConfig.framesPerStep;
+
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	gsv_mock_panorama_id(3000,0,panoramaId);
+	GSV* start = gsv_open(panoramaId);
+	if(start == NULL)
+	{
+		free(yaws);
+		return;
+	}
+
+	gsvStats before;
+	gsvStats after;
+	gsvBenchSamples samples;
+	gsvBenchSequence sequence;
+	sequence.samples = &samples;
+	gsv_stats_snapshot(&before);
+	gsv_bench_reset_peak_rss();
+	gsv_bench_begin(&samples,numFrames);
+	sequence.frameTime = gsv_bench_now();
+	gsvStatus status = gsv_sequence_render(start,yaws,numSteps,&sequenceConfig,gsv_bench_sequence_frame,&sequence);
+	samples.numErrors = numFrames-samples.numSamples+(status != GSV_OK);
+	gsv_bench_report(config,"sequence_visible_tiles",zoomLevel,&samples,1);
+	gsv_stats_snapshot(&after);
+	unsigned long long visibleBytes = after.bytesDownloaded-before.bytesDownloaded;
+
+	// Opens every panorama on the route and downloads all of it
+	CvMat* mapX = cvCreateMat(sequenceConfig.height,sequenceConfig.width,CV_32FC1);
+	CvMat* mapY = cvCreateMat(sequenceConfig.height,sequenceConfig.width,CV_32FC1);
+	IplImage* frame = cvCreateImage(cvSize(sequenceConfig.width,sequenceConfig.height),IPL_DEPTH_8U,3);
+	gsv_stats_snapshot(&before);
+	gsv_bench_reset_peak_rss();
+	gsv_bench_begin(&samples,numFrames);
+	GSV* panorama = start;
+	double frameTime = gsv_bench_now();
+	for(int i=0;i<numSteps && panorama != NULL;i++)
+	{
+		int link = -1;
+		for(int j=0;j<panorama->annotationProperties.numLinks;j++)
+		{
+			if(fabs(fmod(panorama->annotationProperties.links[j].yaw-yaws[i]+540.0,360.0)-180.0) < 45.0)
+				link = j;
+		}
+		double heading = (link >= 0) ? panorama->annotationProperties.links[link].yaw : yaws[i];
+		IplImage* panoramaImage = gsv_panorama(panorama,zoomLevel);
+		for(int j=0;j<sequenceConfig.framesPerStep;j++)
+		{
+			if(panoramaImage != NULL)
+			{
+				gsv_bench_sequence_maps(&sequenceConfig,panoramaImage->width,panoramaImage->height,heading-panorama->projectionProperties.panoramaYaw,mapX,mapY);
+				cvRemap(panoramaImage,frame,mapX,mapY,CV_INTER_LINEAR+CV_WARP_FILL_OUTLIERS,cvScalarAll(0));
+			}
+			gsv_bench_sample(&samples,frameTime,panoramaImage == NULL);
+			frameTime = gsv_bench_now();
+		}
+		if(panoramaImage != NULL)
+			cvReleaseImage(&panoramaImage);
+
+		GSV* next = (link >= 0 && i+1 < numSteps) ? gsv_open(panorama->annotationProperties.links[link].panoramaId) : NULL;
+		if(panorama != start)
+			gsv_close(&panorama);
+		panorama = next;
+	}
+	if(panorama != NULL && panorama != start)
+		gsv_close(&panorama);
+	gsv_bench_report(config,"sequence_whole_panoramas",zoomLevel,&samples,1);
+	gsv_stats_snapshot(&after);
+	unsigned long long wholeBytes = after.bytesDownloaded-before.bytesDownloaded;
+
+	printf("{\"benchmark\":\"sequence\",\"zoom\":%d,\"frames\":%d,\"bytes_visible_tiles\":%llu,\"bytes_whole_panoramas\":%llu,\"bytes_saved\":%.3f}\n",
+		zoomLevel,numFrames,visibleBytes,wholeBytes,(wholeBytes > 0) ? 1.0-(double)visibleBytes/wholeBytes : 0.0);
+	fflush(stdout);
+
+	cvReleaseImage(&frame);
+	cvReleaseMat(&mapX);
+	cvReleaseMat(&mapY);
+	gsv_close(&start);
+	free(yaws);
+
+	gsv_bench_sequence_check(config,&sequenceConfig,serverUrl);
+}
+
+// Interleaves runs with the stage counters on and off so drift in the mock affects both equally
+static void gsv_bench_stats_overhead(const gsvBenchConfig* config,GSV* panorama)
+{
+	int iterations = gsv_bench_iterations(config,40);
+	gsvBenchSamples samples[2];
+	gsv_bench_begin(&samples[0],iterations);
+	gsv_bench_begin(&samples[1],iterations);
+	double elapsed[2] = { 0.0, 0.0 };
+
+	for(int i=0;i<iterations*2;i++)
+	{
+		int enabled = i&1;
+		gsv_stats_enable(enabled);
+
+		double startTime = gsv_bench_now();
+		IplImage* panoramaImage = gsv_panorama(panorama,2);
+		gsv_bench_sample(&samples[enabled],startTime,panoramaImage == NULL);
+		elapsed[enabled] += gsv_bench_now()-startTime;
+		if(panoramaImage != NULL)
+			cvReleaseImage(&panoramaImage);
+	}
+	gsv_stats_enable(1);
+
+	gsv_bench_report(config,"stats_disabled",2,&samples[0],1);
+	gsv_bench_report(config,"stats_enabled",2,&samples[1],1);
+	printf("{\"benchmark\":\"stats_overhead\",\"zoom\":2,\"overhead_pct\":%.3f}\n",(elapsed[0] > 0.0) ? (elapsed[1]-elapsed[0])*100.0/elapsed[0] : 0.0);
+	fflush(stdout);
+}
+
+int main(int argc,char* argv[])
+{
+	gsvBenchConfig config;
+	config.mock = gsvMockConfigDefault;
+	config.scale = 1.0;
+	config.crawlCount = 50;
+	config.crawlZoom = 3;
+	config.only = NULL;
+	config.prometheus = 0;
+	config.tracePath = NULL;
+	config.loopWorkers = 0;
+	config.loopConnections = 0;
+	config.decodeFile = NULL;
+	config.decodeThreads = 0;
+
+	if(argc > 1 && strcmp(argv[1],"--shard-worker") == 0)
+		return gsv_bench_shard_worker(argc,argv);
+
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"--latency-ms") == 0 && i+1 < argc)
+			config.mock.latencyMs = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--bandwidth-kbps") == 0 && i+1 < argc)
+			config.mock.bandwidthKBps = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--error-rate") == 0 && i+1 < argc)
+			config.mock.errorRate = atof(argv[++i]);
+		else if(strcmp(argv[i],"--fixture") == 0 && i+1 < argc)
+			config.mock.fixture = argv[++i];
+		else if(strcmp(argv[i],"--scale") == 0 && i+1 < argc)
+			config.scale = atof(argv[++i]);
+		else if(strcmp(argv[i],"--crawl-count") == 0 && i+1 < argc)
+			config.crawlCount = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--crawl-zoom") == 0 && i+1 < argc)
+			config.crawlZoom = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--only") == 0 && i+1 < argc)
+			config.only = argv[++i];
+		else if(strcmp(argv[i],"--prometheus") == 0)
+			config.prometheus = 1;
+		else if(strcmp(argv[i],"--trace") == 0 && i+1 < argc)
+			config.tracePath = argv[++i];
+		else if(strcmp(argv[i],"--loop-workers") == 0 && i+1 < argc)
+			config.loopWorkers = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--loop-connections") == 0 && i+1 < argc)
+			config.loopConnections = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--decode-file") == 0 && i+1 < argc)
+			config.decodeFile = argv[++i];
+		else if(strcmp(argv[i],"--decode-threads") == 0 && i+1 < argc)
+			config.decodeThreads = atoi(argv[++i]);
+		else
+		{
+			printf("Invalid arguments: gsv_bench [--latency-ms n] [--bandwidth-kbps n] [--error-rate f] [--fixture path] [--scale f] [--crawl-count n] [--crawl-zoom n] [--only name] [--prometheus] [--trace file.json] [--loop-workers n] [--loop-connections n] [--decode-file tile.jpg] [--decode-threads n]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(gsv_global_init() != GSV_OK)
+	{
+		printf("Unable to initialise curl\n");
+		return EXIT_FAILURE;
+	}
+
+	gsvMockServer server;
+	if(gsv_mock_start(&config.mock,&server) != 0)
+	{
+		printf("Unable to start the mock server\n");
+		return EXIT_FAILURE;
+	}
+	gsv_set_server(server.url);
+	if(config.tracePath != NULL)
+		gsv_trace_start(0);
+
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	gsv_mock_panorama_id(0,0,panoramaId);
+	// Retried, the mock may be configured to fail some requests
+	GSV* panorama = NULL;
+	for(int attempt=0;attempt<10 && panorama==NULL;attempt++)
+		panorama = gsv_open(panoramaId);
+	if(panorama == NULL)
+	{
+		printf("Unable to open a panorama from %s\n",server.url);
+		gsv_mock_stop(&server);
+		return EXIT_FAILURE;
+	}
+
+	if(gsv_bench_selected(&config,"gsv_open"))
+		gsv_bench_open(&config);
+	if(gsv_bench_selected(&config,"gsv_open_many"))
+		gsv_bench_open_many(&config);
+	if(gsv_bench_selected(&config,"gsv_tile"))
+		gsv_bench_tile(&config,panorama);
+	if(gsv_bench_selected(&config,"gsv_panorama"))
+		gsv_bench_panorama(&config,panorama);
+	if(gsv_bench_selected(&config,"panorama_write"))
+		gsv_bench_panorama_write(&config,panorama);
+	if(gsv_bench_selected(&config,"gsv_tile_async"))
+		gsv_bench_tile_async(&config,panorama);
+	if(gsv_bench_selected(&config,"gsv_panorama_async"))
+		gsv_bench_panorama_async(&config,panorama);
+	if(gsv_bench_selected(&config,"crawl"))
+		gsv_bench_crawl(&config);
+	if(gsv_bench_selected(&config,"recrawl"))
+		gsv_bench_recrawl(&config,server.url);
+	if(gsv_bench_selected(&config,"dedupe"))
+		gsv_bench_dedupe(&config,server.url);
+	if(gsv_bench_selected(&config,"shard_scaling"))
+		gsv_bench_shard_scaling(&config,server.url);
+	if(gsv_bench_selected(&config,"decode"))
+		gsv_bench_decode(&config);
+	if(gsv_bench_selected(&config,"stress"))
+		gsv_bench_stress(&config);
+	if(gsv_bench_selected(&config,"archive"))
+		gsv_bench_archive(&config,panorama);
+	if(gsv_bench_selected(&config,"depth"))
+		gsv_bench_depth(&config,panorama);
+	if(gsv_bench_selected(&config,"sequence"))
+		gsv_bench_sequence(&config,server.url);
+	if(gsv_bench_selected(&config,"coroutines"))
+		gsv_bench_coroutines(&config);
+	if(gsv_bench_selected(&config,"prefetch_walk"))
+		gsv_bench_prefetch_walk(&config);
+	if(gsv_bench_selected(&config,"stats_overhead"))
+		gsv_bench_stats_overhead(&config,panorama);
+
+	if(config.tracePath != NULL && gsv_trace_flush(config.tracePath) != 0)
+		printf("Unable to write trace to %s\n",config.tracePath);
+
+	if(config.prometheus)
+	{
+		gsvStats stats;
+		gsv_stats_snapshot(&stats);
+		gsv_stats_prometheus(&stats,stderr);
+	}
+
+	gsv_close(&panorama);
+	gsv_mock_stop(&server);
+	gsv_global_cleanup();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,769 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <jpeglib.h>
+#include "gsv_mockserver.h"
+
+#define GSV_MOCK_GRID_OFFSET 500000000
+// Last-Modified of generation 0, the fixture's image_date of 2011-03
+#define GSV_MOCK_BASE_MODIFIED 1298937600
+#define GSV_MOCK_REQUEST_LENGTH 8192
+
+typedef struct gsvMockState_S {
+	gsvMockConfig config;
+	char* fixture;
+	unsigned char* tile;
+	unsigned long tileSize;
+} gsvMockState;
+
+typedef struct gsvMockConnection_S {
+	gsvMockState* state;
+	int socket;
+	unsigned int seed;
+} gsvMockConnection;
+
+/*
+ * Fixture handling
+ */
+
+void gsv_mock_panorama_id(int x,int y,char* panoramaId)
+{
+	char gridId[32];
+	snprintf(gridId,sizeof(gridId),"MOCK%09d%09d",x+GSV_MOCK_GRID_OFFSET,y+GSV_MOCK_GRID_OFFSET);
+	memcpy(panoramaId,gridId,GSV_MOCK_ID_LENGTH+1);
+}
+
+// Anything that is not one of ours (e.g. a lat/lng lookup) lands on the origin
+void gsv_mock_grid_position(const char* panoramaId,int* x,int* y)
+{
+	*x = 0;
+	*y = 0;
+	if(panoramaId == NULL || strlen(panoramaId) != GSV_MOCK_ID_LENGTH || strncmp(panoramaId,"MOCK",4) != 0)
+		return;
+
+	int gridX = 0;
+	int gridY = 0;
+	if(sscanf(&panoramaId[4],"%9d%9d",&gridX,&gridY) == 2)
+	{
+		*x = gridX-GSV_MOCK_GRID_OFFSET;
+		*y = gridY-GSV_MOCK_GRID_OFFSET;
+	}
+}
+
+static char* gsv_mock_load_file(const char* path)
+{
+	FILE* file = fopen(path,"rb");
+	if(file == NULL)
+		return NULL;
+
+	fseek(file,0,SEEK_END);
+	long fileSize = ftell(file);
+	fseek(file,0,SEEK_SET);
+
+	char* contents = (char*) malloc(fileSize+1);
+	if(contents != NULL)
+	{
+		if(fread(contents,1,fileSize,file) != (size_t)fileSize)
+		{
+			free(contents);
+			contents = NULL;
+		}
+		else
+			contents[fileSize] = '\0';
+	}
+	fclose(file);
+
+	return contents;
+}
+
+// The generation whose imagery (x,y) currently has, 0 until it is picked as one of the changed fraction
+static int gsv_mock_version(const gsvMockConfig* config,int x,int y)
+{
+	if(config->generation <= 0 || config->changedFraction <= 0.0)
+		return 0;
+	unsigned int hash = (unsigned int)x*73856093u^(unsigned int)y*19349663u^config->seed*83492791u;
+	hash ^= hash>>13;
+	hash *= 0x5bd1e995u;
+	hash ^= hash>>15;
+	return ((hash%10000) < config->changedFraction*10000.0) ? config->generation : 0;
+}
+
+// Order sensitive, unlike xoring products which sends (x,y) and (-x,-y) to the same value
+static unsigned int gsv_mock_mix(unsigned int hash,int value)
+{
+	hash ^= (unsigned int)value;
+	hash *= 0x9e3779b1u;
+	hash ^= hash>>16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash>>13;
+	return hash;
+}
+
+static int gsv_mock_recapture(const gsvMockConfig* config,int x,int y)
+{
+	unsigned int hash = gsv_mock_mix(gsv_mock_mix(config->seed*19349663u,x),y);
+	return (hash%10000) < config->duplicateFraction*10000.0;
+}
+
+void gsv_mock_scene(const gsvMockConfig* config,int x,int y,int* sceneX,int* sceneY)
+{
+	*sceneX = x;
+	*sceneY = y;
+	if(config->duplicateFraction <= 0.0)
+		return;
+	// A recapture of a recapture shows the same scene, the walk is capped in case the fraction is close to 1
+	for(int steps=0;steps<64 && gsv_mock_recapture(config,x,*sceneY);steps++)
+		(*sceneY)--;
+}
+
+// Replaces the value of the first occurrence of attribute (e.g. " lat=\"") in a malloc'd string
+static char* gsv_mock_set_attribute(char* xml,size_t* length,const char* attribute,const char* value)
+{
+	char* token = strstr(xml,attribute);
+	if(token == NULL)
+		return xml;
+	token += strlen(attribute);
+	char* end = strchr(token,'"');
+	if(end == NULL)
+		return xml;
+
+	size_t offset = token-xml;
+	size_t oldLength = end-token;
+	size_t newLength = strlen(value);
+	size_t tail = *length-(end-xml);
+	if(newLength > oldLength)
+	{
+		char* grown = (char*) realloc(xml,*length+newLength-oldLength+1);
+		if(grown == NULL)
+			return xml;
+		xml = grown;
+	}
+	memmove(&xml[offset+newLength],&xml[offset+oldLength],tail+1);
+	memcpy(&xml[offset],value,newLength);
+	*length = *length+newLength-oldLength;
+	return xml;
+}
+
+// Spreads the grid 10m apart around the fixture's position, a recapture sits 0.5m on from its scene for each step of the chain
+static char* gsv_mock_locate(const gsvMockConfig* config,char* xml,size_t* length,int x,int y)
+{
+	const char* data = strstr(xml,"<data_properties");
+	if(data == NULL)
+		return xml;
+	const char* latitudeAttribute = strstr(data," lat=\"");
+	const char* longitudeAttribute = strstr(data," lng=\"");
+	if(latitudeAttribute == NULL || longitudeAttribute == NULL)
+		return xml;
+	double latitude = atof(latitudeAttribute+6);
+	double longitude = atof(longitudeAttribute+6);
+
+	int sceneX = 0;
+	int sceneY = 0;
+	gsv_mock_scene(config,x,y,&sceneX,&sceneY);
+	double north = sceneY*10.0+(y-sceneY)*0.5;
+	double east = x*10.0;
+	latitude += north/111320.0;
+	longitude += east/(111320.0*cos(latitude*M_PI/180.0));
+
+	char value[32];
+	snprintf(value,sizeof(value),"%.7f",latitude);
+	xml = gsv_mock_set_attribute(xml,length," lat=\"",value);
+	snprintf(value,sizeof(value),"%.7f",longitude);
+	return gsv_mock_set_attribute(xml,length," lng=\"",value);
+}
+
+// Moves a "YYYY-MM" image_date on by months, in place
+static void gsv_mock_advance_date(char* xml,int months)
+{
+	char* imageDate = strstr(xml,"image_date=\"");
+	if(imageDate == NULL || months == 0)
+		return;
+	imageDate += 12;
+
+	int year = 0;
+	int month = 0;
+	if(sscanf(imageDate,"%4d-%2d",&year,&month) != 2)
+		return;
+	month += months-1;
+	year += month/12;
+	month = month%12+1;
+	char date[16];
+	snprintf(date,sizeof(date),"%04d-%02d",year,month);
+	memcpy(imageDate,date,7);
+}
+
+// Rewrites every pano_id in the fixture: the panorama's own becomes (x,y), a link's becomes the grid neighbour in the direction of its yaw_deg
+static char* gsv_mock_metadata(const char* fixture,int x,int y,size_t* length)
+{
+	const char* attribute = "pano_id=\"";
+	size_t attributeLength = strlen(attribute);
+
+	int numIds = 0;
+	for(const char* token=strstr(fixture,attribute);token!=NULL;token=strstr(token+attributeLength,attribute))
+		numIds++;
+
+	char* xml = (char*) malloc(strlen(fixture)+numIds*(GSV_MOCK_ID_LENGTH+1)+1);
+	if(xml == NULL)
+		return NULL;
+
+	size_t used = 0;
+	const char* cursor = fixture;
+	const char* token = NULL;
+	while((token = strstr(cursor,attribute)) != NULL)
+	{
+		token += attributeLength;
+		memcpy(&xml[used],cursor,token-cursor);
+		used += token-cursor;
+
+		const char* element = token;
+		while(element > fixture && *element != '<')
+			element--;
+
+		int idX = x;
+		int idY = y;
+		if(strncmp(element,"<link",5) == 0)
+		{
+			const char* yawAttribute = strstr(element,"yaw_deg=\"");
+			double yaw = (yawAttribute != NULL && yawAttribute < token) ? atof(yawAttribute+9) : 0.0;
+			switch(((int)floor((yaw+45.0)/90.0))&3)
+			{
+				case 0: idY++; break;
+				case 1: idX++; break;
+				case 2: idY--; break;
+				case 3: idX--; break;
+			}
+		}
+		gsv_mock_panorama_id(idX,idY,&xml[used]);
+		used += GSV_MOCK_ID_LENGTH;
+
+		cursor = strchr(token,'"');
+		if(cursor == NULL)
+			cursor = token+strlen(token);
+	}
+
+	size_t remaining = strlen(cursor);
+	memcpy(&xml[used],cursor,remaining+1);
+	*length = used+remaining;
+
+	return xml;
+}
+
+// Takes ownership of pixels
+static unsigned char* gsv_mock_encode(unsigned char* pixels,int tileSize,unsigned long* jpegSize)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	unsigned char* jpeg = NULL;
+	*jpegSize = 0;
+	jpeg_mem_dest(&cinfo,&jpeg,jpegSize);
+
+	cinfo.image_width = tileSize;
+	cinfo.image_height = tileSize;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo,80,TRUE);
+	jpeg_start_compress(&cinfo,TRUE);
+
+	while(cinfo.next_scanline < cinfo.image_height)
+	{
+		JSAMPROW rowPointer[1] = { &pixels[cinfo.next_scanline*tileSize*3] };
+		jpeg_write_scanlines(&cinfo,rowPointer,1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(pixels);
+
+	return jpeg;
+}
+
+// A noisy gradient, compresses to roughly the size of a real Street View tile
+static unsigned char* gsv_mock_tile(int tileSize,unsigned int seed,unsigned long* jpegSize)
+{
+	unsigned char* pixels = (unsigned char*) malloc(tileSize*tileSize*3);
+	if(pixels == NULL)
+		return NULL;
+
+	for(int y=0;y<tileSize;y++)
+	{
+		for(int x=0;x<tileSize;x++)
+		{
+			unsigned char* pixel = &pixels[(y*tileSize+x)*3];
+			int noise = rand_r(&seed)%48;
+			pixel[0] = (unsigned char)((x*255/tileSize+noise)&0xFF);
+			pixel[1] = (unsigned char)((y*255/tileSize+noise)&0xFF);
+			pixel[2] = (unsigned char)(((x^y)+noise)&0xFF);
+		}
+	}
+
+	return gsv_mock_encode(pixels,tileSize,jpegSize);
+}
+
+// 32 pixel blocks of a brightness picked by the scene, so a recapture matches its scene under its own noise
+static unsigned char* gsv_mock_scene_tile(const gsvMockConfig* config,int x,int y,int zoom,int tileX,int tileY,unsigned long* jpegSize)
+{
+	int tileSize = config->tileSize;
+	unsigned char* pixels = (unsigned char*) malloc(tileSize*tileSize*3);
+	if(pixels == NULL)
+		return NULL;
+
+	int sceneX = 0;
+	int sceneY = 0;
+	gsv_mock_scene(config,x,y,&sceneX,&sceneY);
+	unsigned int scene = gsv_mock_mix(gsv_mock_mix(gsv_mock_mix(gsv_mock_mix(gsv_mock_mix(config->seed,sceneX),sceneY),zoom),tileX),tileY);
+	unsigned int seed = gsv_mock_mix(gsv_mock_mix(gsv_mock_mix(scene,x),y),0x5bd1e995);
+
+	for(int row=0;row<tileSize;row++)
+	{
+		for(int column=0;column<tileSize;column++)
+		{
+			unsigned int block = scene^(unsigned int)(column/32)*2246822519u^(unsigned int)(row/32)*3266489917u;
+			block ^= block>>15;
+			block *= 0x5bd1e995u;
+			block ^= block>>13;
+			int brightness = (int)(block%208);
+			int noise = rand_r(&seed)%48;
+			unsigned char* pixel = &pixels[(row*tileSize+column)*3];
+			pixel[0] = (unsigned char)(brightness+noise);
+			pixel[1] = (unsigned char)(brightness+noise/2);
+			pixel[2] = (unsigned char)(brightness+(noise^column)%48);
+		}
+	}
+
+	return gsv_mock_encode(pixels,tileSize,jpegSize);
+}
+
+/*
+ * HTTP handling
+ */
+
+static int gsv_mock_query(const char* path,const char* key,char* value,size_t valueSize)
+{
+	size_t keyLength = strlen(key);
+	const char* query = strchr(path,'?');
+
+	while(query != NULL)
+	{
+		query++;
+		if(strncmp(query,key,keyLength) == 0 && query[keyLength] == '=')
+		{
+			const char* start = query+keyLength+1;
+			size_t valueLength = strcspn(start,"& ");
+			if(valueLength >= valueSize)
+				valueLength = valueSize-1;
+			memcpy(value,start,valueLength);
+			value[valueLength] = '\0';
+			return 1;
+		}
+		query = strchr(query,'&');
+	}
+
+	return 0;
+}
+
+static int gsv_mock_send_all(int socket,const void* data,size_t length)
+{
+	const unsigned char* cursor = (const unsigned char*)data;
+	while(length > 0)
+	{
+		ssize_t sent = send(socket,cursor,length,MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return -1;
+		cursor += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+// Paces the body in 20ms slices when a bandwidth is configured
+static int gsv_mock_send_body(int socket,const void* data,size_t length,int bandwidthKBps)
+{
+	if(bandwidthKBps <= 0)
+		return gsv_mock_send_all(socket,data,length);
+
+	size_t sliceSize = (size_t)bandwidthKBps*1024/50;
+	if(sliceSize == 0)
+		sliceSize = 1;
+
+	const unsigned char* cursor = (const unsigned char*)data;
+	while(length > 0)
+	{
+		size_t slice = (length < sliceSize) ? length : sliceSize;
+		if(gsv_mock_send_all(socket,cursor,slice) != 0)
+			return -1;
+		cursor += slice;
+		length -= slice;
+		usleep((useconds_t)(slice*1000000ULL/((size_t)bandwidthKBps*1024)));
+	}
+	return 0;
+}
+
+// Value of the named request header, case insensitively
+static int gsv_mock_header(const char* request,const char* name,char* value,size_t valueSize)
+{
+	size_t nameLength = strlen(name);
+	for(const char* line=strstr(request,"\r\n");line!=NULL && line[2]!='\r';line=strstr(line+2,"\r\n"))
+	{
+		if(strncasecmp(line+2,name,nameLength) != 0 || line[2+nameLength] != ':')
+			continue;
+		const char* start = line+2+nameLength+1;
+		while(*start == ' ')
+			start++;
+		size_t valueLength = strcspn(start,"\r\n");
+		if(valueLength >= valueSize)
+			valueLength = valueSize-1;
+		memcpy(value,start,valueLength);
+		value[valueLength] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+static const char* gsv_mock_reason(int status)
+{
+	switch(status)
+	{
+		case 200: return "OK";
+		case 304: return "Not Modified";
+		case 404: return "Not Found";
+	}
+	return "Service Unavailable";
+}
+
+// extraHeaders, if any, are whole CRLF terminated lines
+static int gsv_mock_respond_with(int socket,int status,const char* extraHeaders,const char* contentType,const void* body,size_t bodySize,int bandwidthKBps)
+{
+	char header[512];
+	int headerLength = snprintf(header,sizeof(header),"HTTP/1.1 %d %s\r\n%sContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",status,gsv_mock_reason(status),(extraHeaders != NULL) ? extraHeaders : "",contentType,bodySize);
+
+	if(gsv_mock_send_all(socket,header,headerLength) != 0)
+		return -1;
+	return gsv_mock_send_body(socket,body,bodySize,bandwidthKBps);
+}
+
+static int gsv_mock_respond(int socket,int status,const char* contentType,const void* body,size_t bodySize,int bandwidthKBps)
+{
+	return gsv_mock_respond_with(socket,status,NULL,contentType,body,bodySize,bandwidthKBps);
+}
+
+// A 304 when the request's validators match version, otherwise the validators to send with the body in headers
+static int gsv_mock_not_modified(const char* request,int x,int y,int version,char* headers,size_t headersSize)
+{
+	char etag[64];
+	snprintf(etag,sizeof(etag),"\"%d.%d.%d\"",x,y,version);
+	time_t lastModified = GSV_MOCK_BASE_MODIFIED+(time_t)version*86400;
+	char lastModifiedString[64];
+	struct tm lastModifiedTm;
+	strftime(lastModifiedString,sizeof(lastModifiedString),"%a, %d %b %Y %H:%M:%S GMT",gmtime_r(&lastModified,&lastModifiedTm));
+	snprintf(headers,headersSize,"ETag: %s\r\nLast-Modified: %s\r\n",etag,lastModifiedString);
+
+	// If-None-Match wins when both are sent
+	char value[256];
+	if(gsv_mock_header(request,"If-None-Match",value,sizeof(value)))
+		return strcmp(value,etag) == 0;
+	if(gsv_mock_header(request,"If-Modified-Since",value,sizeof(value)))
+	{
+		struct tm since;
+		memset(&since,0,sizeof(since));
+		if(strptime(value,"%a, %d %b %Y %H:%M:%S GMT",&since) != NULL)
+			return lastModified <= timegm(&since);
+	}
+	return 0;
+}
+
+static int gsv_mock_handle(gsvMockConnection* connection,const char* path,const char* request)
+{
+	gsvMockState* state = connection->state;
+
+	if(state->config.latencyMs > 0)
+		usleep(state->config.latencyMs*1000);
+
+	if(state->config.errorRate > 0.0 && rand_r(&connection->seed) < state->config.errorRate*RAND_MAX)
+		return gsv_mock_respond(connection->socket,503,"text/plain",NULL,0,0);
+
+	char output[16];
+	if(gsv_mock_query(path,"output",output,sizeof(output)) == 0)
+		return gsv_mock_respond(connection->socket,404,"text/plain",NULL,0,0);
+
+	if(strcmp(output,"tile") == 0 && state->config.duplicateFraction > 0.0)
+	{
+		char panoramaId[64] = "";
+		char zoom[16] = "0";
+		char tileX[16] = "0";
+		char tileY[16] = "0";
+		gsv_mock_query(path,"panoid",panoramaId,sizeof(panoramaId));
+		gsv_mock_query(path,"zoom",zoom,sizeof(zoom));
+		gsv_mock_query(path,"x",tileX,sizeof(tileX));
+		gsv_mock_query(path,"y",tileY,sizeof(tileY));
+
+		int x = 0;
+		int y = 0;
+		gsv_mock_grid_position(panoramaId,&x,&y);
+
+		unsigned long tileSize = 0;
+		unsigned char* tile = gsv_mock_scene_tile(&state->config,x,y,atoi(zoom),atoi(tileX),atoi(tileY),&tileSize);
+		if(tile == NULL)
+			return gsv_mock_respond(connection->socket,503,"text/plain",NULL,0,0);
+		int result = gsv_mock_respond(connection->socket,200,"image/jpeg",tile,tileSize,state->config.bandwidthKBps);
+		free(tile);
+		return result;
+	}
+
+	if(strcmp(output,"tile") == 0)
+		return gsv_mock_respond(connection->socket,200,"image/jpeg",state->tile,state->tileSize,state->config.bandwidthKBps);
+
+	if(strcmp(output,"xml") == 0)
+	{
+		char panoramaId[64] = "";
+		gsv_mock_query(path,"panoid",panoramaId,sizeof(panoramaId));
+
+		int x = 0;
+		int y = 0;
+		gsv_mock_grid_position(panoramaId,&x,&y);
+
+		int version = gsv_mock_version(&state->config,x,y);
+		char validators[256] = "";
+		if(state->config.conditional && gsv_mock_not_modified(request,x,y,version,validators,sizeof(validators)))
+			return gsv_mock_respond_with(connection->socket,304,validators,"text/xml",NULL,0,0);
+
+		size_t xmlSize = 0;
+		char* xml = gsv_mock_metadata(state->fixture,x,y,&xmlSize);
+		if(xml == NULL)
+			return gsv_mock_respond(connection->socket,503,"text/plain",NULL,0,0);
+		gsv_mock_advance_date(xml,version);
+		if(state->config.duplicateFraction > 0.0)
+			xml = gsv_mock_locate(&state->config,xml,&xmlSize,x,y);
+		int result = gsv_mock_respond_with(connection->socket,200,validators,"text/xml",xml,xmlSize,state->config.bandwidthKBps);
+		free(xml);
+		return result;
+	}
+
+	return gsv_mock_respond(connection->socket,404,"text/plain",NULL,0,0);
+}
+
+// Keep-alive loop, one request at a time
+static void* gsv_mock_connection(void* data)
+{
+	gsvMockConnection* connection = (gsvMockConnection*)data;
+	char request[GSV_MOCK_REQUEST_LENGTH+1] = "";
+	size_t used = 0;
+
+	for(;;)
+	{
+		char* headerEnd = NULL;
+		while((headerEnd = strstr(request,"\r\n\r\n")) == NULL || used == 0)
+		{
+			if(used >= GSV_MOCK_REQUEST_LENGTH)
+				goto done;
+			ssize_t received = recv(connection->socket,&request[used],GSV_MOCK_REQUEST_LENGTH-used,0);
+			if(received < 0 && errno == EINTR)
+				continue;
+			if(received <= 0)
+				goto done;
+			used += received;
+			request[used] = '\0';
+		}
+
+		char method[8];
+		char path[GSV_MOCK_REQUEST_LENGTH];
+		char version[16];
+		if(sscanf(request,"%7s %8191s %15s",method,path,version) != 3)
+			goto done;
+
+		int keepAlive = (strcmp(version,"HTTP/1.1") == 0 && strcasestr(request,"Connection: close") == NULL);
+
+		if(gsv_mock_handle(connection,path,request) != 0 || keepAlive == 0)
+			goto done;
+
+		size_t consumed = (headerEnd+4)-request;
+		memmove(request,&request[consumed],used-consumed);
+		used -= consumed;
+		request[used] = '\0';
+	}
+
+done:
+	close(connection->socket);
+	free(connection);
+	return NULL;
+}
+
+/*
+ * Public methods
+ */
+
+int gsv_mock_serve(const gsvMockConfig* config,int listenSocket)
+{
+	gsvMockState state;
+	state.config = *config;
+	state.fixture = gsv_mock_load_file(config->fixture);
+	if(state.fixture == NULL)
+	{
+		fprintf(stderr,"gsv_mockserver: cannot read fixture %s\n",config->fixture);
+		return -1;
+	}
+	state.tile = gsv_mock_tile(config->tileSize,config->seed,&state.tileSize);
+	if(state.tile == NULL)
+		return -1;
+
+	unsigned int connectionSeed = config->seed;
+	for(;;)
+	{
+		int socket = accept(listenSocket,NULL,NULL);
+		if(socket < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		int noDelay = 1;
+		setsockopt(socket,IPPROTO_TCP,TCP_NODELAY,&noDelay,sizeof(noDelay));
+
+		gsvMockConnection* connection = (gsvMockConnection*) malloc(sizeof(gsvMockConnection));
+		connection->state = &state;
+		connection->socket = socket;
+		connection->seed = connectionSeed++;
+
+		pthread_t thread;
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+		pthread_attr_setdetachstate(&attributes,PTHREAD_CREATE_DETACHED);
+		if(pthread_create(&thread,&attributes,gsv_mock_connection,connection) != 0)
+		{
+			close(socket);
+			free(connection);
+		}
+		pthread_attr_destroy(&attributes);
+	}
+
+	free(state.fixture);
+	free(state.tile);
+	return 0;
+}
+
+int gsv_mock_start(const gsvMockConfig* config,gsvMockServer* server)
+{
+	int listenSocket = socket(AF_INET,SOCK_STREAM,0);
+	if(listenSocket < 0)
+		return -1;
+
+	int reuse = 1;
+	setsockopt(listenSocket,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+
+	struct sockaddr_in address;
+	memset(&address,0,sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(config->port);
+	socklen_t addressLength = sizeof(address);
+
+	if(bind(listenSocket,(struct sockaddr*)&address,sizeof(address)) != 0 || listen(listenSocket,1024) != 0 || getsockname(listenSocket,(struct sockaddr*)&address,&addressLength) != 0)
+	{
+		close(listenSocket);
+		return -1;
+	}
+
+	// Flush so the child does not inherit and repeat buffered output
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		close(listenSocket);
+		return -1;
+	}
+	if(pid == 0)
+		_exit(gsv_mock_serve(config,listenSocket) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	close(listenSocket);
+	server->pid = pid;
+	server->port = ntohs(address.sin_port);
+	snprintf(server->url,sizeof(server->url),"http://127.0.0.1:%d",server->port);
+
+	return 0;
+}
+
+void gsv_mock_stop(gsvMockServer* server)
+{
+	if(server->pid <= 0)
+		return;
+
+	kill(server->pid,SIGTERM);
+	waitpid(server->pid,NULL,0);
+	server->pid = 0;
+}
+
+#ifdef GSV_MOCK_STANDALONE
+int main(int argc,char* argv[])
+{
+	gsvMockConfig config = gsvMockConfigDefault;
+	config.port = 8080;
+
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"--port") == 0 && i+1 < argc)
+			config.port = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--latency-ms") == 0 && i+1 < argc)
+			config.latencyMs = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--bandwidth-kbps") == 0 && i+1 < argc)
+			config.bandwidthKBps = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--error-rate") == 0 && i+1 < argc)
+			config.errorRate = atof(argv[++i]);
+		else if(strcmp(argv[i],"--fixture") == 0 && i+1 < argc)
+			config.fixture = argv[++i];
+		else if(strcmp(argv[i],"--changed-fraction") == 0 && i+1 < argc)
+			config.changedFraction = atof(argv[++i]);
+		else if(strcmp(argv[i],"--generation") == 0 && i+1 < argc)
+			config.generation = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--no-conditional") == 0)
+			config.conditional = 0;
+		else if(strcmp(argv[i],"--duplicate-fraction") == 0 && i+1 < argc)
+			config.duplicateFraction = atof(argv[++i]);
+		else
+		{
+			printf("Invalid arguments: gsv_mockserver [--port n] [--latency-ms n] [--bandwidth-kbps n] [--error-rate f] [--fixture path] [--changed-fraction f] [--generation n] [--no-conditional] [--duplicate-fraction f]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	gsvMockServer server;
+	if(gsv_mock_start(&config,&server) != 0)
+	{
+		printf("Unable to listen on port %d\n",config.port);
+		return EXIT_FAILURE;
+	}
+
+	printf("Serving on %s\n",server.url);
+	fflush(stdout);
+	waitpid(server.pid,NULL,0);
+
+	return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef GSV_MOCKSERVER_H
+#define GSV_MOCKSERVER_H
+
+#include <sys/types.h>
+
+/*
+ * A stand-in for the cbk web service. Metadata is the recorded fixture with its pano_id attributes rewritten so the panoramas form an endless street grid, tiles are a synthetic JPEG.
+ */
+
+typedef struct gsvMockConfig_S {
+	// 0 picks a free port
+	int port;
+	// Added before every response
+	int latencyMs;
+	// Per connection, 0 is unlimited
+	int bandwidthKBps;
+	// Fraction of requests answered with a 503
+	double errorRate;
+	const char* fixture;
+	int tileSize;
+	unsigned int seed;
+	// Fraction of the grid with new imagery in generation g > 0, image_date moved on g months
+	double changedFraction;
+	int generation;
+	// Send ETag/Last-Modified with metadata and answer If-None-Match/If-Modified-Since with a 304
+	int conditional;
+	// Fraction of positions that recapture the one south of them 0.5m on, 0 for none,
+	// otherwise positions are 10m apart with their own tiles
+	double duplicateFraction;
+} gsvMockConfig;
+
+const gsvMockConfig gsvMockConfigDefault = { 0, 0, 0, 0.0, "bench/fixtures/panorama.xml", 512, 1, 0.0, 0, 1, 0.0 };
+
+typedef struct gsvMockServer_S {
+	pid_t pid;
+	int port;
+	char url[32];
+} gsvMockServer;
+
+// Forks a server process, returns 0 once it is accepting connections
+int gsv_mock_start(const gsvMockConfig* config,gsvMockServer* server);
+void gsv_mock_stop(gsvMockServer* server);
+// Serves forever on an already listening socket
+int gsv_mock_serve(const gsvMockConfig* config,int listenSocket);
+// The id of the panorama at grid position (x,y), panoramaId must hold GSV_MOCK_ID_LENGTH+1 characters
+void gsv_mock_panorama_id(int x,int y,char* panoramaId);
+// The reverse, anything that is not a grid id is the origin
+void gsv_mock_grid_position(const char* panoramaId,int* x,int* y);
+// The position whose imagery (x,y) shows, itself unless it is a recapture
+void gsv_mock_scene(const gsvMockConfig* config,int x,int y,int* sceneX,int* sceneY);
+
+#define GSV_MOCK_ID_LENGTH 22
+
+#endif
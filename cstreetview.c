@@ -8,43 +8,74 @@
  
  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#include <pthread.h>
 #include <curl/curl.h>
 #include <tinyxml2.h>
-#include <jpeglib.h>
-#include <jerror.h>
-#include "cstreetview.h"
+#include "cstreetview_private.h"
 
-#ifndef MAX_DOUBLE_CHARACTERS
-#define MAX_DOUBLE_CHARACTERS (3 + DBL_MANT_DIG - DBL_MIN_EXP)
-#endif
+using namespace tinyxml2;
 
-// Comments these to disable debugging or the print warnings
-#ifndef GSV_DEBUG
-#define GSV_DEBUG
-#endif
-#ifndef GSV_WARNINGS
-#define GSV_WARNINGS
-#endif
+/*
+ * Process wide state: curl's global init and the server, read under a lock.
+ * Blocking fetches keep one curl handle per thread.
+ */
 
-#ifdef GSV_WARNINGS
-#define GSV_WARNING(msg,error) if(error!=XML_NO_ERROR)printf("GSV Warning: %s - %s\n",msg,(error==XML_WRONG_ATTRIBUTE_TYPE)?"Wrong Attribute Type":"No Attribute");
-#else
-#define GSV_WARNING(msg)
-#endif
+static pthread_rwlock_t gsvServerLock = PTHREAD_RWLOCK_INITIALIZER;
+static char gsvServer[GSV_MAX_SERVER_LENGTH] = GSV_DEFAULT_SERVER;
 
-using namespace tinyxml2;
+static pthread_once_t gsvGlobalOnce = PTHREAD_ONCE_INIT;
+static CURLcode gsvGlobalResult = CURLE_FAILED_INIT;
+// Only used for its destructor, lookups go through the __thread pointer
+static pthread_key_t gsvCurlKey;
+static __thread CURL* gsvThreadCurl = NULL;
+
+static void gsv_curl_destroy(void* data)
+{
+	curl_easy_cleanup((CURL*)data);
+}
 
-typedef struct CURLBuffer_S {
-	void* buffer;
-	size_t bufferSize;
-} CURLBuffer;
+// The child drops the forking thread's handle without touching the parent's connections
+static void gsv_global_child()
+{
+	if(gsvThreadCurl != NULL)
+	{
+		pthread_setspecific(gsvCurlKey,NULL);
+		gsvThreadCurl = NULL;
+	}
+	gsv_batch_loop_forget();
+	gsv_prefetch_forget();
+}
 
-const CURLBuffer CURLBufferDefault = { NULL, 0 };
+static void gsv_global_once()
+{
+	gsvGlobalResult = curl_global_init(CURL_GLOBAL_ALL);
+	pthread_key_create(&gsvCurlKey,gsv_curl_destroy);
+	pthread_atfork(NULL,NULL,gsv_global_child);
+}
 
 /*
  * CURL methods
  */
 
+// The calling thread's handle, reset so nothing from its last transfer carries over
+static CURL* gsv_curl()
+{
+	if(gsvThreadCurl != NULL)
+	{
+		curl_easy_reset(gsvThreadCurl);
+		return gsvThreadCurl;
+	}
+	if(gsv_global_init() != GSV_OK)
+		return NULL;
+
+	CURL* curl = curl_easy_init();
+	if(curl == NULL)
+		return NULL;
+	pthread_setspecific(gsvCurlKey,curl);
+	gsvThreadCurl = curl;
+	return curl;
+}
+
 int gsvCURLToBuffer(void* data,size_t size,size_t nmemb,CURLBuffer* buffer)
 {
 	if(buffer == NULL)
@@ -60,47 +91,93 @@ int gsvCURLToBuffer(void* data,size_t size,size_t nmemb,CURLBuffer* buffer)
 	return size*nmemb;
 }
 
-/*
- * libjpeg-turbo
- * http://stackoverflow.com/questions/5280756/libjpeg-ver-6b-jpeg-stdio-src-vs-jpeg-mem-src
- *
- * libjpeg turbo does not have a method to decompress a jpeg in memory, it's pointless to write to the disk and read back just to satisfy an API failure, so this rather ugly bit of code is the result
- */
+void gsv_curl_setup(CURL* curl,const char* urlString,CURLBuffer* buffer)
+{
+	curl_easy_setopt(curl,CURLOPT_URL,urlString);
+	curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1);
+	curl_easy_setopt(curl,CURLOPT_FAILONERROR,1);
+	curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,gsvCURLToBuffer);
+	curl_easy_setopt(curl,CURLOPT_WRITEDATA,buffer);
+	// Otherwise resolver timeouts are signals, which are process wide
+	curl_easy_setopt(curl,CURLOPT_NOSIGNAL,1L);
+}
 
-static void init_source (j_decompress_ptr cinfo) {}
-static boolean fill_input_buffer (j_decompress_ptr cinfo)
+CURLcode gsv_fetch(const char* urlString,CURLBuffer* buffer)
 {
-    ERREXIT(cinfo, JERR_INPUT_EMPTY);
-return TRUE;
+	if(gsv_prefetch_take(urlString,buffer,1))
+		return CURLE_OK;
+	
+	CURL* curl = gsv_curl();
+	if(curl == NULL)
+		return CURLE_FAILED_INIT;
+	
+	gsv_curl_setup(curl,urlString,buffer);
+	CURLcode result = curl_easy_perform(curl);
+	GSV_STATS_TRANSFER(curl,result,buffer->bufferSize);
+	
+	// A failed transfer can leave a partial body behind, nothing downstream can use it
+	if(result != CURLE_OK && buffer->buffer != NULL)
+	{
+		free(buffer->buffer);
+		*buffer = CURLBufferDefault;
+	}
+	
+	return result;
 }
-static void skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+
+// Keeps the ETag header, quotes and all, the other headers are not needed
+static size_t gsvCURLHeader(char* data,size_t size,size_t nmemb,gsvValidators* received)
 {
-    struct jpeg_source_mgr* src = (struct jpeg_source_mgr*) cinfo->src;
+	size_t length = size*nmemb;
+	if(length > 5 && strncasecmp(data,"ETag:",5) == 0)
+	{
+		size_t start = 5;
+		while(start < length && (data[start] == ' ' || data[start] == '\t'))
+			start++;
+		size_t end = length;
+		while(end > start && (data[end-1] == '\r' || data[end-1] == '\n' || data[end-1] == ' '))
+			end--;
+		if(end-start < GSV_MAX_ETAG_LENGTH)
+		{
+			memcpy(received->etag,&data[start],end-start);
+			received->etag[end-start] = '\0';
+		}
+	}
+	return length;
+}
 
-    if (num_bytes > 0) {
-        src->next_input_byte += (size_t) num_bytes;
-        src->bytes_in_buffer -= (size_t) num_bytes;
-    }
+void gsv_curl_conditional(CURL* curl,const gsvValidators* sent,gsvValidators* received,struct curl_slist** headers)
+{
+	*received = gsvValidatorsDefault;
+	*headers = NULL;
+	if(sent != NULL && sent->etag[0] != '\0')
+	{
+		char header[GSV_MAX_ETAG_LENGTH+16];
+		snprintf(header,sizeof(header),"If-None-Match: %s",sent->etag);
+		*headers = curl_slist_append(NULL,header);
+		curl_easy_setopt(curl,CURLOPT_HTTPHEADER,*headers);
+	}
+	if(sent != NULL && sent->lastModified > 0)
+	{
+		curl_easy_setopt(curl,CURLOPT_TIMECONDITION,(long)CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(curl,CURLOPT_TIMEVALUE,(long)sent->lastModified);
+	}
+	curl_easy_setopt(curl,CURLOPT_FILETIME,1L);
+	curl_easy_setopt(curl,CURLOPT_HEADERFUNCTION,gsvCURLHeader);
+	curl_easy_setopt(curl,CURLOPT_HEADERDATA,received);
 }
-static void term_source (j_decompress_ptr cinfo) {}
-static void jpeg_mem_src (j_decompress_ptr cinfo, void* buffer, long nbytes)
+
+int gsv_curl_not_modified(CURL* curl,gsvValidators* received)
 {
-    struct jpeg_source_mgr* src;
-
-    if (cinfo->src == NULL) {   /* first time for this JPEG object? */
-        cinfo->src = (struct jpeg_source_mgr *)
-            (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
-            sizeof(struct jpeg_source_mgr));
-    }
-
-    src = (struct jpeg_source_mgr*) cinfo->src;
-    src->init_source = init_source;
-    src->fill_input_buffer = fill_input_buffer;
-    src->skip_input_data = skip_input_data;
-    src->resync_to_restart = jpeg_resync_to_restart; /* use default method */
-    src->term_source = term_source;
-    src->bytes_in_buffer = nbytes;
-    src->next_input_byte = (JOCTET*)buffer;
+	long responseCode = 0;
+	long conditionUnmet = 0;
+	long fileTime = -1;
+	curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&responseCode);
+	curl_easy_getinfo(curl,CURLINFO_CONDITION_UNMET,&conditionUnmet);
+	curl_easy_getinfo(curl,CURLINFO_FILETIME,&fileTime);
+	if(fileTime > 0)
+		received->lastModified = (time_t)fileTime;
+	return responseCode == 304 || conditionUnmet != 0;
 }
 
 /*
@@ -134,6 +211,11 @@ GSV* gsv_parse(char* xmlString)
 	*gsvHandle = GSVDefault;
 	
 	XMLElement* panoramaElement = doc.FirstChildElement("panorama");
+	if(panoramaElement == NULL)
+	{
+		free(gsvHandle);
+		return NULL;
+	}
 	XMLElement* dataPropertiesElement = panoramaElement->FirstChildElement("data_properties");
 	if(dataPropertiesElement == NULL)
 	{
@@ -159,8 +241,9 @@ GSV* gsv_parse(char* xmlString)
 		memset(month,'\0',sizeof(month)*sizeof(char));
 		memcpy(year,imageDate,4*sizeof(char));
 		memcpy(month,&imageDate[5],2*sizeof(char));
-		struct tm imageDateTm = { 0, 0, 0, 1, atoi(month)-1, atoi(year)-1900, 0, 0, -1 };
-		gsvHandle->dataProperties.imageDate = mktime(&imageDateTm);
+		// UTC, so the same date gives the same time_t whatever the host's time zone
+		struct tm imageDateTm = { 0, 0, 0, 1, atoi(month)-1, atoi(year)-1900, 0, 0, 0 };
+		gsvHandle->dataProperties.imageDate = timegm(&imageDateTm);
 	}
 	
 	const char* pano_id = dataPropertiesElement->Attribute("pano_id");
@@ -172,9 +255,9 @@ GSV* gsv_parse(char* xmlString)
 	GSV_WARNING("lat",error);
 	error = dataPropertiesElement->QueryDoubleAttribute("lng",&gsvHandle->dataProperties.longitude);
 	GSV_WARNING("lng",error);
-	error = dataPropertiesElement->QueryDoubleAttribute("original_lat",&gsvHandle->dataProperties.longitude);
+	error = dataPropertiesElement->QueryDoubleAttribute("original_lat",&gsvHandle->dataProperties.originalLatitude);
 	GSV_WARNING("original_lat",error);
-	error = dataPropertiesElement->QueryDoubleAttribute("original_lng",&gsvHandle->dataProperties.longitude);
+	error = dataPropertiesElement->QueryDoubleAttribute("original_lng",&gsvHandle->dataProperties.originalLongitude);
 	GSV_WARNING("original_lng",error);
 	XMLElement* copyrightElement = dataPropertiesElement->FirstChildElement("copyright");
 	if(copyrightElement != NULL)
@@ -244,72 +327,261 @@ GSV* gsv_parse(char* xmlString)
 		}
 	}
 	
+	// Only copied here, gsv_depth_map and gsv_pano_map decode it if asked
+	XMLElement* modelElement = panoramaElement->FirstChildElement("model");
+	if(modelElement != NULL)
+	{
+		XMLElement* depthMapElement = modelElement->FirstChildElement("depth_map");
+		if(depthMapElement != NULL && depthMapElement->GetText() != NULL)
+			gsv_copy_string(depthMapElement->GetText(),&gsvHandle->modelProperties.depthMapData);
+		XMLElement* panoMapElement = modelElement->FirstChildElement("pano_map");
+		if(panoMapElement != NULL && panoMapElement->GetText() != NULL)
+			gsv_copy_string(panoMapElement->GetText(),&gsvHandle->modelProperties.panoMapData);
+	}
+	
+	return gsvHandle;
+}
+
+// XMLPrinter's own number formatting drops digits a coordinate needs
+static void gsv_serialize_double(XMLPrinter* printer,const char* name,double value)
+{
+	char valueString[32];
+	snprintf(valueString,sizeof(valueString),"%.17g",value);
+	printer->PushAttribute(name,valueString);
+}
+
+static void gsv_serialize_text(XMLPrinter* printer,const char* name,const char* text)
+{
+	if(text == NULL)
+		return;
+	printer->OpenElement(name);
+	printer->PushText(text);
+	printer->CloseElement();
+}
+
+void gsv_image_date_format(time_t imageDate,char* text,size_t textSize)
+{
+	struct tm imageDateTm;
+	if(imageDate == 0 || gmtime_r(&imageDate,&imageDateTm) == NULL)
+	{
+		text[0] = '\0';
+		return;
+	}
+	snprintf(text,textSize,"%04d-%02d",(imageDateTm.tm_year+1900)%10000,imageDateTm.tm_mon+1);
+}
+
+char* gsv_serialize(const GSV* panorama,size_t* size)
+{
+	XMLPrinter printer(NULL,true);
+	printer.OpenElement("panorama");
+
+	const gsvDataProperties* data = &panorama->dataProperties;
+	char panoramaId[GSV_PANORAMA_ID_LENGTH+1];
+	snprintf(panoramaId,sizeof(panoramaId),"%.*s",GSV_PANORAMA_ID_LENGTH,data->panoramaId);
+	printer.OpenElement("data_properties");
+	printer.PushAttribute("image_width",data->imageWidth);
+	printer.PushAttribute("image_height",data->imageHeight);
+	printer.PushAttribute("tile_width",data->tileWidth);
+	printer.PushAttribute("tile_height",data->tileHeight);
+	char imageDate[GSV_IMAGE_DATE_LENGTH];
+	gsv_image_date_format(data->imageDate,imageDate,sizeof(imageDate));
+	if(imageDate[0] != '\0')
+		printer.PushAttribute("image_date",imageDate);
+	printer.PushAttribute("pano_id",panoramaId);
+	printer.PushAttribute("num_zoom_levels",data->numZoomLevels);
+	gsv_serialize_double(&printer,"lat",data->latitude);
+	gsv_serialize_double(&printer,"lng",data->longitude);
+	gsv_serialize_double(&printer,"original_lat",data->originalLatitude);
+	gsv_serialize_double(&printer,"original_lng",data->originalLongitude);
+	gsv_serialize_text(&printer,"copyright",data->copyright);
+	gsv_serialize_text(&printer,"text",data->text);
+	gsv_serialize_text(&printer,"street_range",data->streetRange);
+	gsv_serialize_text(&printer,"region",data->region);
+	gsv_serialize_text(&printer,"country",data->country);
+	printer.CloseElement();
+
+	const gsvProjectionProperties* projection = &panorama->projectionProperties;
+	printer.OpenElement("projection_properties");
+	if(projection->projectionType != NULL)
+		printer.PushAttribute("projection_type",projection->projectionType);
+	gsv_serialize_double(&printer,"pano_yaw_deg",projection->panoramaYaw);
+	gsv_serialize_double(&printer,"tilt_yaw_deg",projection->tiltYaw);
+	gsv_serialize_double(&printer,"tilt_pitch_deg",projection->tiltPitch);
+	printer.CloseElement();
+
+	printer.OpenElement("annotation_properties");
+	for(int i=0;i<panorama->annotationProperties.numLinks;i++)
+	{
+		const gsvLink* link = &panorama->annotationProperties.links[i];
+		char linkPanoramaId[GSV_PANORAMA_ID_LENGTH+1];
+		snprintf(linkPanoramaId,sizeof(linkPanoramaId),"%.*s",GSV_PANORAMA_ID_LENGTH,link->panoramaId);
+		unsigned int roadColour = 0;
+		memcpy(&roadColour,link->roadColour,sizeof(roadColour));
+		char roadColourString[16];
+		snprintf(roadColourString,sizeof(roadColourString),"0x%08x",roadColour);
+
+		printer.OpenElement("link");
+		gsv_serialize_double(&printer,"yaw_deg",link->yaw);
+		printer.PushAttribute("pano_id",linkPanoramaId);
+		printer.PushAttribute("road_argb",roadColourString);
+		printer.PushAttribute("scene",link->scene);
+		gsv_serialize_text(&printer,"link_text",link->text);
+		printer.CloseElement();
+	}
+	printer.CloseElement();
+
+	const gsvModelProperties* model = &panorama->modelProperties;
+	if(model->depthMapData != NULL || model->panoMapData != NULL)
+	{
+		printer.OpenElement("model");
+		gsv_serialize_text(&printer,"depth_map",model->depthMapData);
+		gsv_serialize_text(&printer,"pano_map",model->panoMapData);
+		printer.CloseElement();
+	}
+
+	printer.CloseElement();
+
+	char* xmlString = (char*) malloc(printer.CStrSize());
+	if(xmlString == NULL)
+		return NULL;
+	memcpy(xmlString,printer.CStr(),printer.CStrSize());
+	if(size != NULL)
+		*size = printer.CStrSize();
+	return xmlString;
+}
+
+void gsv_metadata_url(const char* panoramaId,char* urlString,size_t urlSize)
+{
+	pthread_rwlock_rdlock(&gsvServerLock);
+	snprintf(urlString,urlSize,"%s/cbk?output=xml&cb_client=maps_sv&hl=en&dm=1&pm=1&ph=1&renderer=cubic,spherical&v=4&panoid=%s",gsvServer,panoramaId);
+	pthread_rwlock_unlock(&gsvServerLock);
+}
+
+void gsv_coordinate_url(double latitude,double longitude,char* urlString,size_t urlSize)
+{
+	pthread_rwlock_rdlock(&gsvServerLock);
+	snprintf(urlString,urlSize,"%s/cbk?output=xml&ll=%f,%f",gsvServer,latitude,longitude);
+	pthread_rwlock_unlock(&gsvServerLock);
+}
+
+void gsv_tile_url(const char* panoramaId,int zoomLevel,int x,int y,char* urlString,size_t urlSize)
+{
+	pthread_rwlock_rdlock(&gsvServerLock);
+	snprintf(urlString,urlSize,"%s/cbk?output=tile&panoid=%s&zoom=%d&x=%d&y=%d",gsvServer,panoramaId,zoomLevel,x,y);
+	pthread_rwlock_unlock(&gsvServerLock);
+}
+
+void gsv_tile_grid(int zoomLevel,int* maxX,int* maxY)
+{
+	switch(zoomLevel)
+	{
+		default: *maxX = 1; *maxY = 1; break;
+		case 1: *maxX = 2; *maxY = 1; break;
+		case 2: *maxX = 4; *maxY = 2; break;
+		case 3: *maxX = 6; *maxY = 3; break;
+		case 4: *maxX = 13; *maxY = 7; break;
+		case 5: *maxX = 26; *maxY = 13; break;
+	}
+}
+
+// Consumes the buffer
+GSV* gsv_parse_buffer(CURLBuffer* buffer)
+{
+	if(buffer->buffer == NULL)
+		return NULL;
+	
+	// Add a null terminator
+	buffer->buffer = realloc(buffer->buffer,++buffer->bufferSize);
+	char* xmlBuffer = (char*)buffer->buffer;
+	xmlBuffer[buffer->bufferSize-1] = '\0';
+	
+	GSV_STATS_BEGIN(parseTimer);
+	GSV_TRACE_BEGIN(parseTrace);
+	GSV* gsvHandle = gsv_parse(xmlBuffer);
+	GSV_TRACE_END(parseTrace,"parse","metadata",NULL);
+	GSV_STATS_END(GSV_STAGE_PARSE,parseTimer);
+	
+	free(buffer->buffer);
+	*buffer = CURLBufferDefault;
+	gsv_prefetch_links(gsvHandle);
 	return gsvHandle;
 }
 
+CURLcode gsv_fetch_tile(GSV* panorama,int zoomLevel,int x,int y,CURLBuffer* buffer)
+{
+	char urlString[GSV_MAX_URL_LENGTH];
+	gsv_tile_url(panorama->dataProperties.panoramaId,zoomLevel,x,y,urlString,sizeof(urlString));
+	
+	GSV_TRACE_BEGIN(downloadTrace);
+	CURLcode result = gsv_fetch(urlString,buffer);
+	GSV_TRACE_END(downloadTrace,"download","tile","%s z%d x%d y%d",panorama->dataProperties.panoramaId,zoomLevel,x,y);
+	
+	return result;
+}
+
 /*
  * Public methods
  */
 
+gsvStatus gsv_global_init()
+{
+	pthread_once(&gsvGlobalOnce,gsv_global_once);
+	return (gsvGlobalResult == CURLE_OK) ? GSV_OK : GSV_ERROR_NETWORK;
+}
+
+void gsv_global_cleanup()
+{
+#ifdef GSV_DEBUG
+	printf("gsv_global_cleanup()\n");
+#endif
+	gsv_prefetch_disable();
+	gsv_batch_loop_destroy();
+	if(gsvThreadCurl != NULL)
+	{
+		pthread_setspecific(gsvCurlKey,NULL);
+		curl_easy_cleanup(gsvThreadCurl);
+		gsvThreadCurl = NULL;
+	}
+	if(gsvGlobalResult == CURLE_OK)
+		curl_global_cleanup();
+}
+
+void gsv_set_server(const char* serverUrl)
+{
+	if(serverUrl == NULL)
+		serverUrl = GSV_DEFAULT_SERVER;
+	pthread_rwlock_wrlock(&gsvServerLock);
+	snprintf(gsvServer,sizeof(gsvServer),"%s",serverUrl);
+	pthread_rwlock_unlock(&gsvServerLock);
+}
+
 GSV* gsv_open(double latitude,double longitude)
 {
 #ifdef GSV_DEBUG
 	printf("gsv_open(%f,%f)\n",latitude,longitude);
 #endif
-	CURL* curl = curl_easy_init();
-	char urlString[43+(MAX_DOUBLE_CHARACTERS*2)];
-	
-	snprintf(urlString,sizeof(urlString),"http://cbk0.google.com/cbk?output=xml&ll=%f,%f",latitude,longitude);
-	
-	curl_easy_setopt(curl,CURLOPT_URL,urlString);
-	curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1);
-	curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,gsvCURLToBuffer);
+	char urlString[GSV_MAX_URL_LENGTH];
+	gsv_coordinate_url(latitude,longitude,urlString,sizeof(urlString));
 	
+	GSV_TRACE_BEGIN(downloadTrace);
 	CURLBuffer buffer = CURLBufferDefault;
-	curl_easy_setopt(curl,CURLOPT_WRITEDATA,&buffer);
-	curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
-	
-	if(buffer.buffer == NULL)
-		return NULL;
-	
-	// Add a null terminator
-	buffer.buffer = realloc(buffer.buffer,++buffer.bufferSize);
-	char* xmlBuffer = (char*)buffer.buffer;
-	xmlBuffer[buffer.bufferSize-1] = '\0';
+	gsv_fetch(urlString,&buffer);
+	GSV_TRACE_END(downloadTrace,"download","metadata","%f,%f",latitude,longitude);
 	
-	GSV* gsvHandle = gsv_parse(xmlBuffer);
-	free(buffer.buffer);
-	return gsvHandle;
+	return gsv_parse_buffer(&buffer);
 }
 
 GSV* gsv_open(char* panoramaId)
 {
-	CURL* curl = curl_easy_init();
-	char urlString[114+GSV_PANORAMA_ID_LENGTH];
-	
-	snprintf(urlString,sizeof(urlString),"http://cbk1.google.com/cbk?output=xml&cb_client=maps_sv&hl=en&dm=1&pm=1&ph=1&renderer=cubic,spherical&v=4&panoid=%s",panoramaId);
-	
-	curl_easy_setopt(curl,CURLOPT_URL,urlString);
-	curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1);
-	curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,gsvCURLToBuffer);
+	char urlString[GSV_MAX_URL_LENGTH];
+	gsv_metadata_url(panoramaId,urlString,sizeof(urlString));
 	
+	GSV_TRACE_BEGIN(downloadTrace);
 	CURLBuffer buffer = CURLBufferDefault;
-	curl_easy_setopt(curl,CURLOPT_WRITEDATA,&buffer);
-	curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
-	
-	if(buffer.buffer == NULL)
-		return NULL;
+	gsv_fetch(urlString,&buffer);
+	GSV_TRACE_END(downloadTrace,"download","metadata","%s",panoramaId);
 	
-	// Add a null terminator
-	buffer.buffer = realloc(buffer.buffer,++buffer.bufferSize);
-	char* xmlBuffer = (char*)buffer.buffer;
-	xmlBuffer[buffer.bufferSize-1] = '\0';
-	
-	GSV* gsvHandle = gsv_parse(xmlBuffer);
-	free(buffer.buffer);
-	return gsvHandle;
+	return gsv_parse_buffer(&buffer);
 }
 
 IplImage* gsv_tile(GSV* panorama,int zoomLevel,int x,int y)
@@ -317,44 +589,12 @@ IplImage* gsv_tile(GSV* panorama,int zoomLevel,int x,int y)
 #ifdef GSV_DEBUG
 	printf("gsv_tile(%p,%d,%d,%d)\n",panorama,zoomLevel,x,y);
 #endif
-	CURL* curl = curl_easy_init();
-	char urlString[66+GSV_PANORAMA_ID_LENGTH];
-	
-	snprintf(urlString,sizeof(urlString),"http://cbk0.google.com/cbk?output=tile&panoid=%s&zoom=%d&x=%d&y=%d",panorama->dataProperties.panoramaId,zoomLevel,x,y);
-	
-	curl_easy_setopt(curl,CURLOPT_URL,urlString);
-	curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1);
-	curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,gsvCURLToBuffer);
-	
 	CURLBuffer buffer = CURLBufferDefault;
-	curl_easy_setopt(curl,CURLOPT_WRITEDATA,&buffer);
-	curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
-	
-	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&cinfo);
-	jpeg_mem_src(&cinfo,(unsigned char*)buffer.buffer,buffer.bufferSize);
-	jpeg_read_header(&cinfo,1);
-	jpeg_start_decompress(&cinfo);
-	
-	IplImage* tileImage = cvCreateImage(cvSize(cinfo.output_width,cinfo.output_height),IPL_DEPTH_8U,cinfo.num_components);
-	JSAMPROW rowPointer[1] = { (unsigned char*) malloc(sizeof(unsigned char)*cinfo.output_width*cinfo.num_components) };
-	
-	while(cinfo.output_scanline < cinfo.image_height)
-	{
-		jpeg_read_scanlines(&cinfo,rowPointer,sizeof(rowPointer)/sizeof(JSAMPROW));
-		memcpy(&tileImage->imageData[(cinfo.output_scanline-1)*cinfo.output_width*cinfo.num_components],rowPointer[0],sizeof(char)*cinfo.output_width*cinfo.num_components);
-	}
-	
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
+	if(gsv_fetch_tile(panorama,zoomLevel,x,y,&buffer) != CURLE_OK)
+		return NULL;
 	
+	IplImage* tileImage = gsv_decode_tile(buffer.buffer,buffer.bufferSize);
 	free(buffer.buffer);
-	buffer.buffer = NULL;
-	
-	cvCvtColor(tileImage,tileImage,CV_RGB2BGR);
 	
 	return tileImage;
 }
@@ -366,31 +606,24 @@ IplImage* gsv_panorama(GSV* panorama,int zoomLevel)
 #endif
 	int maxX = 1;
 	int maxY = 1;
+	gsv_tile_grid(zoomLevel,&maxX,&maxY);
 	
-	switch(zoomLevel)
-	{
-		default: maxX = 1; maxY = 1; break;
-		case 1: maxX = 2; maxY = 1; break;
-		case 2: maxX = 4; maxY = 2; break;
-		case 3: maxX = 6; maxY = 3; break;
-		case 4: maxX = 13; maxY = 7; break;
-		case 5: maxX = 26; maxY = 13; break;
-	}
-	
+	GSV_TRACE_BEGIN(panoramaTrace);
 	IplImage* panoramaImage = cvCreateImage(cvSize(panorama->dataProperties.tileWidth*maxX,panorama->dataProperties.tileHeight*maxY),IPL_DEPTH_8U,3);
 	
 	for(int x=0;x<maxX;x++)
 	{
 		for(int y=0;y<maxY;y++)
 		{
-			IplImage* tileImage = gsv_tile(panorama,zoomLevel,x,y);
-			cvSetImageROI(panoramaImage,cvRect(x*panorama->dataProperties.tileWidth,y*panorama->dataProperties.tileHeight,tileImage->width,tileImage->height));
-			cvCopy(tileImage,panoramaImage);
-			cvResetImageROI(panoramaImage);
-			cvReleaseImage(&tileImage);
+			CURLBuffer buffer = CURLBufferDefault;
+			if(gsv_fetch_tile(panorama,zoomLevel,x,y,&buffer) != CURLE_OK)
+				continue;
+			gsv_decode_tile_into(panoramaImage,x*panorama->dataProperties.tileWidth,y*panorama->dataProperties.tileHeight,buffer.buffer,buffer.bufferSize);
+			free(buffer.buffer);
 		}
 	}
 	
+	GSV_TRACE_END(panoramaTrace,"panorama","panorama","%s z%d",panorama->dataProperties.panoramaId,zoomLevel);
 	return panoramaImage;
 }
 
@@ -423,6 +656,10 @@ void gsv_close(GSV** panorama)
 		}
 		free((*panorama)->annotationProperties.links);
 	}
+	free((*panorama)->modelProperties.depthMapData);
+	free((*panorama)->modelProperties.panoMapData);
+	gsv_depth_map_free(&(*panorama)->modelProperties.depthMap);
+	gsv_pano_map_free(&(*panorama)->modelProperties.panoMap);
 	free(*panorama);
 	*panorama = NULL;
 }
@@ -14,12 +14,16 @@
 #include <opencv2/opencv.hpp>
 
 #define GSV_PANORAMA_ID_LENGTH 23
+#define GSV_MAX_ETAG_LENGTH 128
+// YYYY-MM and its terminator
+#define GSV_IMAGE_DATE_LENGTH 8
 
 typedef struct gsvDataProperties_S {
 	int imageWidth;
 	int imageHeight;
 	int tileWidth;
 	int tileHeight;
+	// The first of the month the image_date names, at midnight UTC
 	time_t imageDate;
 	char panoramaId[GSV_PANORAMA_ID_LENGTH];
 	// This is a lie, often the max is 5, but Google says 3
@@ -67,18 +71,356 @@ typedef struct gsvAnnotationProperties_S {
 
 const gsvAnnotationProperties gsvAnnotationPropertiesDefault = { NULL, 0 };
 
+// One plane index per pixel of a small equirectangular image, mirrored left to right
+typedef struct gsvDepthMap_S {
+	int width;
+	int height;
+	// Row by row, 0 where there is no surface (sky)
+	unsigned char* planeIndices;
+	int numPlanes;
+	// Plane i is normals[3*i..3*i+2] and distances[i] metres away
+	float* normals;
+	float* distances;
+} gsvDepthMap;
+
+// Which nearby panorama each pixel of the same kind of image looks at
+typedef struct gsvPanoMap_S {
+	int width;
+	int height;
+	// Row by row indices into panoramaIds and positions
+	unsigned char* indices;
+	int numPanoramas;
+	char (*panoramaIds)[GSV_PANORAMA_ID_LENGTH];
+	// Metres, panorama i is at positions[2*i],positions[2*i+1]
+	float* positions;
+} gsvPanoMap;
+
+typedef struct gsvModelProperties_S {
+	// The <model> text until it is first decoded, NULL when there was none
+	char* depthMapData;
+	char* panoMapData;
+	gsvDepthMap* depthMap;
+	gsvPanoMap* panoMap;
+} gsvModelProperties;
+
+const gsvModelProperties gsvModelPropertiesDefault = { NULL, NULL, NULL, NULL };
+
 typedef struct GSV_S {
 	gsvDataProperties dataProperties;
 	gsvProjectionProperties projectionProperties;
 	gsvAnnotationProperties annotationProperties;
+	gsvModelProperties modelProperties;
 } GSV;
 
-const GSV GSVDefault = { gsvDataPropertiesDefault, gsvProjectionPropertiesDefault, gsvAnnotationPropertiesDefault };
+const GSV GSVDefault = { gsvDataPropertiesDefault, gsvProjectionPropertiesDefault, gsvAnnotationPropertiesDefault, gsvModelPropertiesDefault };
+
+typedef enum gsvStatus_E {
+	GSV_OK = 0,
+	// The transfer failed or the web service answered with an error
+	GSV_ERROR_NETWORK,
+	GSV_ERROR_PARSE,
+	GSV_ERROR_DECODE,
+	GSV_ERROR_MEMORY,
+	GSV_ERROR_INVALID,
+	// The loop was destroyed before the request finished
+	GSV_ERROR_CANCELLED,
+	// The output file could not be created or written
+	GSV_ERROR_IO,
+	// Another shard of the crawl failed
+	GSV_ERROR_ABORTED
+} gsvStatus;
+
+typedef struct gsvLoop_S gsvLoop;
+
+// What a recrawl learnt about one panorama from a previous crawl's manifest
+typedef enum gsvChange_E {
+	// The server answered 304, or the metadata still has the manifest's image date
+	GSV_UNCHANGED = 0,
+	// Same panorama id, new image date
+	GSV_CHANGED,
+	// Not in the manifest
+	GSV_NEW
+} gsvChange;
+
+// One panorama of a crawl manifest, keyed by panoramaId
+typedef struct gsvManifestEntry_S {
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	// As the web service writes it, YYYY-MM
+	char imageDate[GSV_IMAGE_DATE_LENGTH];
+	// Validators of the last response, empty and 0 when there were none
+	char etag[GSV_MAX_ETAG_LENGTH];
+	time_t lastModified;
+	// So an unchanged panorama can be walked past
+	char (*links)[GSV_PANORAMA_ID_LENGTH];
+	int numLinks;
+} gsvManifestEntry;
+
+typedef struct gsvManifest_S gsvManifest;
+
+// Maps panorama ids onto shards, which forward ids to each other through a spool directory
+typedef struct gsvShardRing_S gsvShardRing;
+typedef struct gsvSpool_S gsvSpool;
+// Called for every panorama a shard opens, which stays owned by the crawl
+typedef void (*gsvShardCallback)(GSV* panorama,void* userData);
+
+typedef struct gsvArchive_S gsvArchive;
+
+// Points into the archive, valid until it is closed
+typedef struct gsvArchiveRecord_S {
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	// XML gsv_parse reads, metadataSize includes the terminator
+	const char* metadata;
+	size_t metadataSize;
+	// As appended, a JPEG for gsv_archive_append_panorama
+	const void* image;
+	size_t imageSize;
+} gsvArchiveRecord;
+
+// What gsv_fingerprint takes from the zoom 0 tile and the metadata
+typedef struct gsvFingerprint_S {
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	// 64 bit difference hash of the horizon band, north aligned
+	unsigned long long hash;
+	double latitude;
+	double longitude;
+	time_t imageDate;
+} gsvFingerprint;
+
+typedef struct gsvDuplicateConfig_S {
+	// Differing hash bits still counted as the same view
+	int maxHashDistance;
+	// In metres
+	double maxDistance;
+	// Months between image dates, -1 ignores them
+	int maxMonthsApart;
+} gsvDuplicateConfig;
+
+const gsvDuplicateConfig gsvDuplicateConfigDefault = { 6, 3.0, 0 };
 
+typedef struct gsvDuplicateIndex_S gsvDuplicateIndex;
+
+// Run on a worker thread, the callback owns what it is given
+typedef void (*gsvOpenCallback)(gsvStatus status,GSV* panorama,void* userData);
+typedef void (*gsvImageCallback)(gsvStatus status,IplImage* image,void* userData);
+
+typedef struct gsvSequenceConfig_S {
+	// Frame size in pixels
+	int width;
+	int height;
+	// Horizontal, in degrees
+	double fieldOfView;
+	// Degrees above the horizon
+	double pitch;
+	// Tiles frames are rendered from
+	int zoomLevel;
+	// Frames spent turning to each step's direction
+	int framesPerStep;
+	// Steps opened and fetched ahead of the one being rendered
+	int lookahead;
+} gsvSequenceConfig;
+
+const gsvSequenceConfig gsvSequenceConfigDefault = { 1280, 720, 90.0, 0.0, 3, 1, 2 };
+
+// frame is only valid during the call, non-zero stops the sequence
+typedef int (*gsvFrameCallback)(int frameNumber,const GSV* panorama,double heading,IplImage* frame,void* userData);
+
+typedef struct gsvPrefetchConfig_S {
+	// Transfers in flight at once, links beyond it are skipped
+	int maxConcurrent;
+	// Unused responses kept, the oldest are dropped past it
+	size_t maxBytes;
+	// Unused responses are dropped after this long
+	int ttlMs;
+	// Every tile of each link at this zoom (0 or 1), -1 for none
+	int linkZoom;
+	// Horizon tiles facing each link at this zoom, -1 for none
+	int directionZoom;
+} gsvPrefetchConfig;
+
+const gsvPrefetchConfig gsvPrefetchConfigDefault = { 16, 8*1024*1024, 30000, -1, -1 };
+
+typedef struct gsvPrefetchStats_S {
+	unsigned long long issued;
+	// Requests served from a prefetched response
+	unsigned long long hits;
+	// Requests that looked for one
+	unsigned long long lookups;
+	// Fetched but dropped unused
+	unsigned long long wasted;
+	unsigned long long failed;
+	// Not issued because a budget was full
+	unsigned long long skipped;
+	unsigned long long bytesFetched;
+	unsigned long long bytesUsed;
+} gsvPrefetchStats;
+
+typedef enum gsvStage_E {
+	GSV_STAGE_DNS = 0,
+	GSV_STAGE_CONNECT,
+	// Connected until the first byte of the response
+	GSV_STAGE_FIRST_BYTE,
+	GSV_STAGE_TRANSFER,
+	GSV_STAGE_PARSE,
+	GSV_STAGE_DECODE,
+	GSV_STAGE_STITCH,
+	GSV_STAGE_ENCODE,
+	GSV_NUM_STAGES
+} gsvStage;
+
+// Bucket i counts samples under 2^i microseconds, the last one is unbounded
+#define GSV_STATS_BUCKETS 32
+
+typedef struct gsvStageStats_S {
+	unsigned long long count;
+	unsigned long long totalNanoseconds;
+	unsigned long long maxNanoseconds;
+	unsigned long long buckets[GSV_STATS_BUCKETS];
+} gsvStageStats;
+
+typedef struct gsvStats_S {
+	gsvStageStats stages[GSV_NUM_STAGES];
+	unsigned long long requests;
+	unsigned long long failedRequests;
+	unsigned long long bytesDownloaded;
+} gsvStats;
+
+// Thread safe on different panoramas. Call init before any threads, cleanup after every call
+gsvStatus gsv_global_init();
+void gsv_global_cleanup();
+// e.g. "http://127.0.0.1:8080", NULL restores Google
+void gsv_set_server(const char* serverUrl);
+// NULL on failure, gsv_panorama leaves black where a tile failed
 GSV* gsv_open(double latitude,double longitude);
 GSV* gsv_open(char* panoramaId);
 IplImage* gsv_tile(GSV* panorama,int zoomLevel,int x,int y);
 IplImage* gsv_panorama(GSV* panorama,int zoomLevel);
+// gsv_panorama as a JPEG of quality (0 for 90), one tile row in memory at a time
+// Any failed tile fails the write and leaves no file behind
+gsvStatus gsv_panorama_write(GSV* panorama,int zoomLevel,const char* path,int quality);
 void gsv_close(GSV** gsvHandle);
 
+// One step per yaw (or coordinate) along the closest link. Returns the first failure,
+// frames are still rendered with black where tiles failed
+gsvStatus gsv_sequence_render(GSV* start,const double* yaws,int numSteps,const gsvSequenceConfig* config,gsvFrameCallback callback,void* userData);
+gsvStatus gsv_sequence_render(GSV* start,const double* latitudes,const double* longitudes,int numSteps,const gsvSequenceConfig* config,gsvFrameCallback callback,void* userData);
+// userData is a printf pattern, e.g. "frames/%05d.jpg"
+int gsv_frame_write(int frameNumber,const GSV* panorama,double heading,IplImage* frame,void* userData);
+
+// Owned by the panorama, NULL when missing or corrupt. The first call must not race another
+const gsvDepthMap* gsv_depth_map(GSV* panorama);
+const gsvPanoMap* gsv_pano_map(GSV* panorama);
+// Metres per pixel of a width x height panorama, 0 for sky. depths holds width*height floats
+gsvStatus gsv_depth_panorama(GSV* panorama,int width,int height,float* depths);
+// The same for a perspective view, angles in degrees
+gsvStatus gsv_depth_view(GSV* panorama,double heading,double pitch,double fieldOfView,int width,int height,float* depths);
+
+// 0 picks defaults for either
+gsvLoop* gsv_loop_create(int numWorkers,int maxConnections);
+// Not from a callback
+void gsv_loop_wait(gsvLoop* loop);
+// Outstanding requests complete with GSV_ERROR_CANCELLED
+void gsv_loop_destroy(gsvLoop** loop);
+gsvStatus gsv_open_async(gsvLoop* loop,double latitude,double longitude,gsvOpenCallback callback,void* userData);
+gsvStatus gsv_open_async(gsvLoop* loop,const char* panoramaId,gsvOpenCallback callback,void* userData);
+gsvStatus gsv_tile_async(gsvLoop* loop,GSV* panorama,int zoomLevel,int x,int y,gsvImageCallback callback,void* userData);
+// Fails with the first tile error but still hands over the image with whatever tiles arrived
+gsvStatus gsv_panorama_async(gsvLoop* loop,GSV* panorama,int zoomLevel,gsvImageCallback callback,void* userData);
+// Returns the first failure in input order, statuses may be NULL
+gsvStatus gsv_open_many(const char* const* panoramaIds,int numPanoramas,GSV** panoramas,gsvStatus* statuses = NULL);
+gsvStatus gsv_open_many(const double* latitudes,const double* longitudes,int numPanoramas,GSV** panoramas,gsvStatus* statuses = NULL);
+// Shared by the batch calls and gsv_panorama_write, 0 for the default of 16
+void gsv_set_batch_connections(int maxConnections);
+const char* gsv_status_name(gsvStatus status);
+
+// Thread safe
+gsvManifest* gsv_manifest_create();
+// NULL when path cannot be read or is not a manifest
+gsvManifest* gsv_manifest_load(const char* path);
+// A failed save leaves the old manifest in place
+gsvStatus gsv_manifest_save(gsvManifest* manifest,const char* path);
+void gsv_manifest_destroy(gsvManifest** manifest);
+int gsv_manifest_size(gsvManifest* manifest);
+// NULL when unseen, valid until the manifest is destroyed but rewritten by a refresh
+const gsvManifestEntry* gsv_manifest_find(gsvManifest* manifest,const char* panoramaId);
+// The next refresh reports the panorama GSV_CHANGED
+gsvStatus gsv_manifest_invalidate(gsvManifest* manifest,const char* panoramaId);
+// *panorama is NULL after a 304, otherwise closed by the caller
+gsvStatus gsv_refresh(gsvManifest* manifest,const char* panoramaId,GSV** panorama,gsvChange* change);
+gsvStatus gsv_refresh_many(gsvManifest* manifest,const char* const* panoramaIds,int numPanoramas,GSV** panoramas,gsvChange* changes,gsvStatus* statuses = NULL);
+
+// virtualNodes of 0 picks a default
+gsvShardRing* gsv_shard_ring_create(int numShards,int virtualNodes);
+void gsv_shard_ring_destroy(gsvShardRing** ring);
+int gsv_shard_of(const gsvShardRing* ring,const char* panoramaId);
+// Once per crawl, before any shard opens it
+gsvStatus gsv_spool_reset(const char* directory,int numShards);
+gsvSpool* gsv_spool_open(const char* directory,int shard,int numShards);
+void gsv_spool_close(gsvSpool** spool);
+// panoramaId is not taken when a full batch fails to flush
+gsvStatus gsv_spool_send(gsvSpool* spool,int shard,const char* panoramaId);
+gsvStatus gsv_spool_flush(gsvSpool* spool);
+// The number of ids in *panoramaIds, freed by the caller, or -1
+int gsv_spool_receive(gsvSpool* spool,char (**panoramaIds)[GSV_PANORAMA_ID_LENGTH]);
+// 1 once every shard is idle with nothing in flight, -1 when one failed
+int gsv_spool_quiescent(gsvSpool* spool,int idle);
+// Marks shard as failed so the others stop
+gsvStatus gsv_spool_abort(const char* directory,int shard);
+// Returns once every shard has run dry, GSV_ERROR_ABORTED when another failed
+gsvStatus gsv_shard_crawl(gsvSpool* spool,const gsvShardRing* ring,const char* seedPanoramaId,int maxCount,gsvShardCallback callback,void* userData,int* numCrawled);
+
+// Appends to an existing archive, thread safe
+gsvArchive* gsv_archive_create(const char* path);
+gsvStatus gsv_archive_append(gsvArchive* archive,const GSV* panorama,const void* image,size_t imageSize);
+// Nothing is appended when a tile fails
+gsvStatus gsv_archive_append_panorama(gsvArchive* archive,GSV* panorama,int zoomLevel,int quality);
+// Invalidates every record handed out
+gsvStatus gsv_archive_close(gsvArchive** archive);
+// Read only, an unclosed archive is read up to its first torn record
+gsvArchive* gsv_archive_open(const char* path);
+int gsv_archive_size(gsvArchive* archive);
+// In the order they were written
+gsvStatus gsv_archive_record(gsvArchive* archive,int index,gsvArchiveRecord* record);
+// The latest record of panoramaId, GSV_ERROR_INVALID when there is none
+gsvStatus gsv_archive_find(gsvArchive* archive,const char* panoramaId,gsvArchiveRecord* record);
+// Closed with gsv_close
+GSV* gsv_archive_panorama(const gsvArchiveRecord* record);
+
+// Fetches one zoom 0 tile
+gsvStatus gsv_fingerprint(GSV* panorama,gsvFingerprint* fingerprint);
+// Hamming distance of the hashes
+int gsv_fingerprint_distance(const gsvFingerprint* a,const gsvFingerprint* b);
+// NULL uses gsvDuplicateConfigDefault
+gsvDuplicateIndex* gsv_duplicate_index_create(const gsvDuplicateConfig* config);
+void gsv_duplicate_index_destroy(gsvDuplicateIndex** index);
+int gsv_duplicate_index_size(gsvDuplicateIndex* index);
+// 1 and the closest match in duplicate (may be NULL), otherwise 0. Thread safe
+int gsv_duplicate_find(gsvDuplicateIndex* index,const gsvFingerprint* fingerprint,gsvFingerprint* duplicate);
+// Once the panorama has been written
+gsvStatus gsv_duplicate_add(gsvDuplicateIndex* index,const gsvFingerprint* fingerprint);
+
+// NULL uses gsvPrefetchConfigDefault
+void gsv_prefetch_enable(const gsvPrefetchConfig* config);
+// Drops everything unused
+void gsv_prefetch_disable();
+void gsv_prefetch_stats(gsvPrefetchStats* stats);
+
+// Process wide, on by default
+void gsv_stats_enable(int enabled);
+void gsv_stats_reset();
+void gsv_stats_snapshot(gsvStats* stats);
+void gsv_stats_prometheus(const gsvStats* stats,FILE* output);
+const char* gsv_stage_name(gsvStage stage);
+// For stages that happen outside the library, e.g. encoding the panorama
+unsigned long long gsv_stats_clock();
+void gsv_stats_record(gsvStage stage,unsigned long long nanoseconds);
+
+// eventsPerThread of 0 keeps the last size. Flushes Chrome trace-event JSON
+void gsv_trace_start(int eventsPerThread);
+void gsv_trace_stop();
+int gsv_trace_flush(const char* path);
+void gsv_trace_name_thread(const char* name);
+// 0 while tracing is off, those spans are dropped. name and category must outlive the flush
+unsigned long long gsv_trace_clock();
+void gsv_trace_span(const char* name,const char* category,unsigned long long start,unsigned long long end,const char* format,...);
+
 #endif
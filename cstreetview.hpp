@@ -0,0 +1,358 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef CSTREETVIEW_HPP
+#define CSTREETVIEW_HPP
+
+/*
+ * C++20 coroutine layer over gsvLoop, header only. gsv::open, gsv::tile and gsv::panorama start their request immediately and are awaited later, so issuing several before the first co_await runs them concurrently on the loop's connections. A coroutine resumes on the loop worker that completed the request, blocking there holds up other completions.
+ */
+
+#if __cplusplus < 202002L
+#error "cstreetview.hpp needs C++20 coroutines, build with -std=c++20"
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include "cstreetview.h"
+
+namespace gsv {
+
+struct PanoramaDeleter {
+	void operator()(GSV* panorama) const { gsv_close(&panorama); }
+};
+
+struct ImageDeleter {
+	void operator()(IplImage* image) const { cvReleaseImage(&image); }
+};
+
+typedef std::unique_ptr<GSV,PanoramaDeleter> Panorama;
+typedef std::unique_ptr<IplImage,ImageDeleter> Image;
+
+// value may be set even when status is an error, e.g. a panorama with missing tiles
+template<typename T>
+struct Result {
+	gsvStatus status = GSV_OK;
+	T value;
+
+	explicit operator bool() const { return status == GSV_OK && value != nullptr; }
+};
+
+class Loop {
+public:
+	explicit Loop(int numWorkers = 0,int maxConnections = 0) : loop(gsv_loop_create(numWorkers,maxConnections)) {}
+	~Loop() { gsv_loop_destroy(&loop); }
+	Loop(const Loop&) = delete;
+	Loop& operator=(const Loop&) = delete;
+
+	gsvLoop* get() const { return loop; }
+	void wait() { gsv_loop_wait(loop); }
+
+private:
+	gsvLoop* loop;
+};
+
+template<typename T> class Task;
+
+namespace detail {
+
+enum OperationPhase { OPERATION_PENDING = 0, OPERATION_AWAITED, OPERATION_DONE };
+
+template<typename T>
+struct OperationState {
+	// Whichever of the callback and the awaiter gets here second resumes the coroutine
+	std::atomic<int> phase{OPERATION_PENDING};
+	std::coroutine_handle<> awaiter;
+	Result<T> result;
+};
+
+template<typename T>
+void operation_complete(gsvStatus status,typename T::pointer value,void* userData)
+{
+	std::shared_ptr<OperationState<T>>* reference = static_cast<std::shared_ptr<OperationState<T>>*>(userData);
+	std::shared_ptr<OperationState<T>> state = std::move(*reference);
+	delete reference;
+
+	state->result.status = status;
+	state->result.value.reset(value);
+	if(state->phase.exchange(OPERATION_DONE,std::memory_order_acq_rel) == OPERATION_AWAITED)
+		state->awaiter.resume();
+}
+
+}
+
+// co_await once for the Result, dropped unawaited the request still finishes
+template<typename T>
+class Operation {
+public:
+	template<typename Submit>
+	explicit Operation(Submit submit) : state(std::make_shared<detail::OperationState<T>>())
+	{
+		// The callback holds its own reference so the state outlives an abandoned Operation
+		std::shared_ptr<detail::OperationState<T>>* reference = new std::shared_ptr<detail::OperationState<T>>(state);
+		gsvStatus status = submit(detail::operation_complete<T>,static_cast<void*>(reference));
+		if(status != GSV_OK)
+		{
+			delete reference;
+			state->result.status = status;
+			state->phase.store(detail::OPERATION_DONE,std::memory_order_release);
+		}
+	}
+
+	bool await_ready() const { return state->phase.load(std::memory_order_acquire) == detail::OPERATION_DONE; }
+
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		state->awaiter = handle;
+		int expected = detail::OPERATION_PENDING;
+		return state->phase.compare_exchange_strong(expected,detail::OPERATION_AWAITED,std::memory_order_acq_rel,std::memory_order_acquire);
+	}
+
+	Result<T> await_resume() { return std::move(state->result); }
+
+private:
+	std::shared_ptr<detail::OperationState<T>> state;
+};
+
+inline Operation<Panorama> open(Loop& loop,const char* panoramaId)
+{
+	return Operation<Panorama>([&](gsvOpenCallback callback,void* userData) { return gsv_open_async(loop.get(),panoramaId,callback,userData); });
+}
+
+inline Operation<Panorama> open(Loop& loop,double latitude,double longitude)
+{
+	return Operation<Panorama>([&](gsvOpenCallback callback,void* userData) { return gsv_open_async(loop.get(),latitude,longitude,callback,userData); });
+}
+
+inline Operation<Image> tile(Loop& loop,GSV* panorama,int zoomLevel,int x,int y)
+{
+	return Operation<Image>([&](gsvImageCallback callback,void* userData) { return gsv_tile_async(loop.get(),panorama,zoomLevel,x,y,callback,userData); });
+}
+
+inline Operation<Image> tile(Loop& loop,const Panorama& panorama,int zoomLevel,int x,int y)
+{
+	return tile(loop,panorama.get(),zoomLevel,x,y);
+}
+
+inline Operation<Image> panorama(Loop& loop,GSV* panorama,int zoomLevel)
+{
+	return Operation<Image>([&](gsvImageCallback callback,void* userData) { return gsv_panorama_async(loop.get(),panorama,zoomLevel,callback,userData); });
+}
+
+inline Operation<Image> panorama(Loop& loop,const Panorama& panorama,int zoomLevel)
+{
+	return gsv::panorama(loop,panorama.get(),zoomLevel);
+}
+
+/*
+ * Tasks
+ */
+
+namespace detail {
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+	std::exception_ptr exception;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept { return handle.promise().continuation; }
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+	void return_value(T returned) { value.emplace(std::move(returned)); }
+	T result()
+	{
+		if(exception)
+			std::rethrow_exception(exception);
+		return std::move(*value);
+	}
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object();
+	void return_void() {}
+	void result()
+	{
+		if(exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+}
+
+// Lazy, starts when awaited or passed to sync_wait
+template<typename T = void>
+class Task {
+public:
+	typedef detail::Promise<T> promise_type;
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle,nullptr)) {}
+	Task& operator=(Task&& other) noexcept
+	{
+		if(this != &other)
+		{
+			if(handle)
+				handle.destroy();
+			handle = std::exchange(other.handle,nullptr);
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task()
+	{
+		if(handle)
+			handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+	T await_resume() { return handle.promise().result(); }
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template<typename T>
+inline Task<T> Promise<T>::get_return_object() { return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this)); }
+
+inline Task<void> Promise<void>::get_return_object() { return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this)); }
+
+struct SyncWaitEvent {
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool done = false;
+
+	void set()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+		condition.notify_all();
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock,[this] { return done; });
+	}
+};
+
+// Signals from final_suspend so the frame is already suspended when the waiting thread destroys it
+struct SyncWaitTask {
+	struct promise_type {
+		SyncWaitEvent* event = nullptr;
+
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+			void await_suspend(std::coroutine_handle<promise_type> handle) noexcept { handle.promise().event->set(); }
+			void await_resume() noexcept {}
+		};
+
+		SyncWaitTask get_return_object() { return SyncWaitTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	explicit SyncWaitTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	SyncWaitTask(const SyncWaitTask&) = delete;
+	SyncWaitTask& operator=(const SyncWaitTask&) = delete;
+	~SyncWaitTask() { handle.destroy(); }
+
+	void run(SyncWaitEvent* event)
+	{
+		handle.promise().event = event;
+		handle.resume();
+		event->wait();
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+SyncWaitTask sync_wait_body(Task<T>& task,std::optional<T>& value,std::exception_ptr& exception)
+{
+	try
+	{
+		value.emplace(co_await task);
+	}
+	catch(...)
+	{
+		exception = std::current_exception();
+	}
+}
+
+inline SyncWaitTask sync_wait_body(Task<void>& task,std::exception_ptr& exception)
+{
+	try
+	{
+		co_await task;
+	}
+	catch(...)
+	{
+		exception = std::current_exception();
+	}
+}
+
+}
+
+// Runs task to completion from ordinary code, must not be called on a loop worker
+template<typename T>
+T sync_wait(Task<T> task)
+{
+	std::optional<T> value;
+	std::exception_ptr exception;
+	detail::SyncWaitEvent event;
+	detail::SyncWaitTask body = detail::sync_wait_body(task,value,exception);
+	body.run(&event);
+	if(exception)
+		std::rethrow_exception(exception);
+	return std::move(*value);
+}
+
+inline void sync_wait(Task<void> task)
+{
+	std::exception_ptr exception;
+	detail::SyncWaitEvent event;
+	detail::SyncWaitTask body = detail::sync_wait_body(task,exception);
+	body.run(&event);
+	if(exception)
+		std::rethrow_exception(exception);
+}
+
+}
+
+#endif
@@ -0,0 +1,586 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "cstreetview_private.h"
+
+/*
+ * Records back to back, each a header, the gsv_serialize metadata and the image,
+ * padded to 8 bytes. Closing appends the index,
+ *
+ * 	offsets[numRecords]	file offset of each record in file order
+ * 	slots[numSlots]	open addressed table of panorama id to record number
+ * 	footer	magic, where the index starts and its sizes
+ *
+ * Integers are in host byte order.
+ */
+
+#define GSV_ARCHIVE_RECORD_MAGIC "GSVR"
+#define GSV_ARCHIVE_INDEX_MAGIC "GSVINDX1"
+#define GSV_ARCHIVE_ALIGNMENT 8
+#define GSV_ARCHIVE_INITIAL_ENTRIES 1024
+
+typedef struct gsvArchiveHeader_S {
+	char magic[4];
+	// Including the terminator
+	uint32_t metadataSize;
+	uint64_t imageSize;
+	char panoramaId[GSV_PANORAMA_ID_LENGTH+1];
+} gsvArchiveHeader;
+
+typedef struct gsvArchiveSlot_S {
+	char panoramaId[GSV_PANORAMA_ID_LENGTH+1];
+	// Record number plus one, 0 for an empty slot
+	uint64_t record;
+} gsvArchiveSlot;
+
+typedef struct gsvArchiveFooter_S {
+	char magic[8];
+	uint64_t indexOffset;
+	uint64_t numRecords;
+	uint64_t numSlots;
+} gsvArchiveFooter;
+
+// A record put down by an appender, sorted into file order when the index is written
+typedef struct gsvArchiveEntry_S {
+	uint64_t offset;
+	char panoramaId[GSV_PANORAMA_ID_LENGTH+1];
+} gsvArchiveEntry;
+
+struct gsvArchive_S {
+	int descriptor;
+	int writable;
+
+	// Writing. end is where the next record goes
+	uint64_t end;
+	pthread_mutex_t mutex;
+	gsvArchiveEntry* entries;
+	int numEntries;
+	int capacity;
+
+	// Reading. Into the mapping, or rebuiltOffsets and rebuiltSlots for an unclosed archive
+	const unsigned char* mapping;
+	size_t mappingSize;
+	// Records end here, where the index starts
+	uint64_t dataEnd;
+	const uint64_t* offsets;
+	int numRecords;
+	const gsvArchiveSlot* slots;
+	uint64_t numSlots;
+	uint64_t* rebuiltOffsets;
+	gsvArchiveSlot* rebuiltSlots;
+};
+
+/*
+ * Index
+ */
+
+static uint64_t gsv_archive_hash(const char* panoramaId)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for(int i=0;i<GSV_PANORAMA_ID_LENGTH && panoramaId[i]!='\0';i++)
+		hash = (hash^(unsigned char)panoramaId[i])*1099511628211ull;
+	return hash;
+}
+
+// The slot holding panoramaId, or the empty slot it would go in. numSlots is a power of two and never full
+static uint64_t gsv_archive_slot(const gsvArchiveSlot* slots,uint64_t numSlots,const char* panoramaId)
+{
+	uint64_t slot = gsv_archive_hash(panoramaId)&(numSlots-1);
+	for(uint64_t probe=0;probe<numSlots;probe++)
+	{
+		if(slots[slot].record == 0 || strncmp(slots[slot].panoramaId,panoramaId,GSV_PANORAMA_ID_LENGTH) == 0)
+			return slot;
+		slot = (slot+1)&(numSlots-1);
+	}
+	return slot;
+}
+
+// At most half full, so probe runs stay short
+static uint64_t gsv_archive_num_slots(uint64_t numRecords)
+{
+	uint64_t numSlots = 16;
+	while(numSlots < numRecords*2)
+		numSlots *= 2;
+	return numSlots;
+}
+
+// Record i's id is at panoramaIds+i*stride. Later records of the same panorama replace earlier ones
+static void gsv_archive_fill_slots(gsvArchiveSlot* slots,uint64_t numSlots,const char* panoramaIds,size_t stride,uint64_t numRecords)
+{
+	memset(slots,0,sizeof(gsvArchiveSlot)*numSlots);
+	for(uint64_t i=0;i<numRecords;i++)
+	{
+		const char* panoramaId = panoramaIds+i*stride;
+		gsvArchiveSlot* slot = &slots[gsv_archive_slot(slots,numSlots,panoramaId)];
+		memcpy(slot->panoramaId,panoramaId,sizeof(slot->panoramaId));
+		slot->record = i+1;
+	}
+}
+
+/*
+ * Records
+ */
+
+static uint64_t gsv_archive_record_size(uint64_t metadataSize,uint64_t imageSize)
+{
+	uint64_t size = sizeof(gsvArchiveHeader)+metadataSize+imageSize;
+	return (size+GSV_ARCHIVE_ALIGNMENT-1)&~(uint64_t)(GSV_ARCHIVE_ALIGNMENT-1);
+}
+
+// The header of a whole record at offset, with its metadata terminated, -1 if there is none
+static int gsv_archive_header(const gsvArchive* archive,uint64_t offset,gsvArchiveHeader* header)
+{
+	if(offset%GSV_ARCHIVE_ALIGNMENT != 0 || offset > archive->dataEnd || archive->dataEnd-offset < sizeof(gsvArchiveHeader))
+		return -1;
+	memcpy(header,archive->mapping+offset,sizeof(gsvArchiveHeader));
+	uint64_t available = archive->dataEnd-offset-sizeof(gsvArchiveHeader);
+	if(memcmp(header->magic,GSV_ARCHIVE_RECORD_MAGIC,sizeof(header->magic)) != 0 || header->metadataSize == 0 || header->metadataSize > available || header->imageSize > available-header->metadataSize)
+		return -1;
+	if(archive->mapping[offset+sizeof(gsvArchiveHeader)+header->metadataSize-1] != '\0' || header->panoramaId[GSV_PANORAMA_ID_LENGTH] != '\0')
+		return -1;
+	return 0;
+}
+
+// Writes all of the vectors, retrying short writes
+static int gsv_archive_pwritev(int descriptor,struct iovec* vectors,int numVectors,uint64_t offset)
+{
+	while(numVectors > 0)
+	{
+		ssize_t written = pwritev(descriptor,vectors,numVectors,(off_t)offset);
+		if(written < 0)
+			return -1;
+		offset += written;
+		while(numVectors > 0 && (size_t)written >= vectors->iov_len)
+		{
+			written -= vectors->iov_len;
+			vectors++;
+			numVectors--;
+		}
+		if(numVectors > 0)
+		{
+			vectors->iov_base = (char*)vectors->iov_base+written;
+			vectors->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Files
+ */
+
+// Walks the records of an archive with no index until one is torn or missing
+static int gsv_archive_rebuild(gsvArchive* archive)
+{
+	archive->dataEnd = archive->mappingSize;
+	int capacity = GSV_ARCHIVE_INITIAL_ENTRIES;
+	archive->rebuiltOffsets = (uint64_t*) malloc(sizeof(uint64_t)*capacity);
+	char (*panoramaIds)[GSV_PANORAMA_ID_LENGTH+1] = (char (*)[GSV_PANORAMA_ID_LENGTH+1]) malloc(sizeof(*panoramaIds)*capacity);
+	if(archive->rebuiltOffsets == NULL || panoramaIds == NULL)
+	{
+		free(panoramaIds);
+		return -1;
+	}
+
+	int numRecords = 0;
+	uint64_t offset = 0;
+	gsvArchiveHeader header;
+	while(gsv_archive_header(archive,offset,&header) == 0)
+	{
+		if(numRecords == capacity)
+		{
+			uint64_t* offsets = (uint64_t*) realloc(archive->rebuiltOffsets,sizeof(uint64_t)*capacity*2);
+			if(offsets != NULL)
+				archive->rebuiltOffsets = offsets;
+			char (*ids)[GSV_PANORAMA_ID_LENGTH+1] = (char (*)[GSV_PANORAMA_ID_LENGTH+1]) realloc(panoramaIds,sizeof(*panoramaIds)*capacity*2);
+			if(ids != NULL)
+				panoramaIds = ids;
+			if(offsets == NULL || ids == NULL)
+			{
+				free(panoramaIds);
+				return -1;
+			}
+			capacity *= 2;
+		}
+		archive->rebuiltOffsets[numRecords] = offset;
+		memcpy(panoramaIds[numRecords],header.panoramaId,sizeof(panoramaIds[numRecords]));
+		numRecords++;
+		offset += gsv_archive_record_size(header.metadataSize,header.imageSize);
+	}
+	// Anything after the last whole record is a torn write or an old index
+	archive->dataEnd = (offset < archive->mappingSize) ? offset : archive->mappingSize;
+
+	archive->numSlots = gsv_archive_num_slots(numRecords);
+	archive->rebuiltSlots = (gsvArchiveSlot*) malloc(sizeof(gsvArchiveSlot)*archive->numSlots);
+	if(archive->rebuiltSlots == NULL)
+	{
+		free(panoramaIds);
+		return -1;
+	}
+	gsv_archive_fill_slots(archive->rebuiltSlots,archive->numSlots,panoramaIds[0],sizeof(*panoramaIds),numRecords);
+	free(panoramaIds);
+
+	archive->offsets = archive->rebuiltOffsets;
+	archive->slots = archive->rebuiltSlots;
+	archive->numRecords = numRecords;
+	return 0;
+}
+
+// Maps the file and finds its index, rebuilding it if the footer is missing
+static int gsv_archive_load(gsvArchive* archive)
+{
+	struct stat status;
+	if(fstat(archive->descriptor,&status) != 0)
+		return -1;
+	archive->mappingSize = (size_t)status.st_size;
+	if(archive->mappingSize == 0)
+	{
+		archive->numSlots = 0;
+		return 0;
+	}
+	void* mapping = mmap(NULL,archive->mappingSize,PROT_READ,MAP_SHARED,archive->descriptor,0);
+	if(mapping == MAP_FAILED)
+		return -1;
+	archive->mapping = (const unsigned char*)mapping;
+
+	gsvArchiveFooter footer;
+	if(archive->mappingSize >= sizeof(footer))
+	{
+		memcpy(&footer,archive->mapping+archive->mappingSize-sizeof(footer),sizeof(footer));
+		// Bounded first so the index's size cannot overflow
+		int sane = memcmp(footer.magic,GSV_ARCHIVE_INDEX_MAGIC,sizeof(footer.magic)) == 0 && footer.numRecords <= INT_MAX && footer.numSlots > footer.numRecords &&
+			(footer.numSlots&(footer.numSlots-1)) == 0 && footer.numSlots <= archive->mappingSize/sizeof(gsvArchiveSlot) && footer.indexOffset%GSV_ARCHIVE_ALIGNMENT == 0 && footer.indexOffset <= archive->mappingSize;
+		if(sane && footer.numRecords*sizeof(uint64_t)+footer.numSlots*sizeof(gsvArchiveSlot)+sizeof(footer) == archive->mappingSize-footer.indexOffset)
+		{
+			archive->dataEnd = footer.indexOffset;
+			archive->offsets = (const uint64_t*)(archive->mapping+footer.indexOffset);
+			archive->numRecords = (int)footer.numRecords;
+			archive->slots = (const gsvArchiveSlot*)(archive->mapping+footer.indexOffset+footer.numRecords*sizeof(uint64_t));
+			archive->numSlots = footer.numSlots;
+			return 0;
+		}
+	}
+	return gsv_archive_rebuild(archive);
+}
+
+static void gsv_archive_unload(gsvArchive* archive)
+{
+	if(archive->mapping != NULL)
+		munmap((void*)archive->mapping,archive->mappingSize);
+	free(archive->rebuiltOffsets);
+	free(archive->rebuiltSlots);
+	archive->mapping = NULL;
+	archive->mappingSize = 0;
+	archive->offsets = NULL;
+	archive->slots = NULL;
+	archive->rebuiltOffsets = NULL;
+	archive->rebuiltSlots = NULL;
+	archive->numRecords = 0;
+	archive->numSlots = 0;
+}
+
+static void gsv_archive_destroy(gsvArchive* archive)
+{
+	gsv_archive_unload(archive);
+	if(archive->descriptor >= 0)
+		close(archive->descriptor);
+	if(archive->writable)
+		pthread_mutex_destroy(&archive->mutex);
+	free(archive->entries);
+	free(archive);
+}
+
+static int gsv_archive_compare(const void* a,const void* b)
+{
+	uint64_t left = ((const gsvArchiveEntry*)a)->offset;
+	uint64_t right = ((const gsvArchiveEntry*)b)->offset;
+	return (left > right)-(left < right);
+}
+
+// Appended at the end of the records, the file is cut to end with it
+static gsvStatus gsv_archive_write_index(gsvArchive* archive)
+{
+	qsort(archive->entries,archive->numEntries,sizeof(gsvArchiveEntry),gsv_archive_compare);
+
+	gsvArchiveFooter footer;
+	memcpy(footer.magic,GSV_ARCHIVE_INDEX_MAGIC,sizeof(footer.magic));
+	footer.indexOffset = archive->end;
+	footer.numRecords = archive->numEntries;
+	footer.numSlots = gsv_archive_num_slots(archive->numEntries);
+	uint64_t* offsets = (uint64_t*) malloc(sizeof(uint64_t)*(archive->numEntries+1));
+	gsvArchiveSlot* slots = (gsvArchiveSlot*) malloc(sizeof(gsvArchiveSlot)*footer.numSlots);
+	if(offsets == NULL || slots == NULL)
+	{
+		free(offsets);
+		free(slots);
+		return GSV_ERROR_MEMORY;
+	}
+	for(int i=0;i<archive->numEntries;i++)
+		offsets[i] = archive->entries[i].offset;
+	gsv_archive_fill_slots(slots,footer.numSlots,archive->entries[0].panoramaId,sizeof(gsvArchiveEntry),archive->numEntries);
+
+	struct iovec vectors[3] = { { offsets, sizeof(uint64_t)*archive->numEntries }, { slots, sizeof(gsvArchiveSlot)*footer.numSlots }, { &footer, sizeof(footer) } };
+	uint64_t indexSize = vectors[0].iov_len+vectors[1].iov_len+vectors[2].iov_len;
+	gsvStatus status = GSV_OK;
+	if(gsv_archive_pwritev(archive->descriptor,vectors,3,archive->end) != 0 || ftruncate(archive->descriptor,(off_t)(archive->end+indexSize)) != 0)
+		status = GSV_ERROR_IO;
+	free(offsets);
+	free(slots);
+	return status;
+}
+
+static void gsv_archive_fill_record(const gsvArchive* archive,uint64_t offset,const gsvArchiveHeader* header,gsvArchiveRecord* record)
+{
+	memcpy(record->panoramaId,header->panoramaId,GSV_PANORAMA_ID_LENGTH);
+	record->metadata = (const char*)(archive->mapping+offset+sizeof(gsvArchiveHeader));
+	record->metadataSize = header->metadataSize;
+	record->image = archive->mapping+offset+sizeof(gsvArchiveHeader)+header->metadataSize;
+	record->imageSize = (size_t)header->imageSize;
+}
+
+/*
+ * Public methods
+ */
+
+gsvArchive* gsv_archive_create(const char* path)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_archive_create(%s)\n",path);
+#endif
+	if(path == NULL)
+		return NULL;
+	gsvArchive* archive = (gsvArchive*) calloc(1,sizeof(gsvArchive));
+	if(archive == NULL)
+		return NULL;
+	archive->descriptor = open(path,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+	if(archive->descriptor < 0)
+	{
+		free(archive);
+		return NULL;
+	}
+	pthread_mutex_init(&archive->mutex,NULL);
+	archive->writable = 1;
+
+	// An existing archive's records are kept and its index is cut off, a new one is written on close
+	archive->capacity = GSV_ARCHIVE_INITIAL_ENTRIES;
+	archive->entries = (gsvArchiveEntry*) malloc(sizeof(gsvArchiveEntry)*archive->capacity);
+	if(archive->entries == NULL || gsv_archive_load(archive) != 0)
+	{
+		gsv_archive_destroy(archive);
+		return NULL;
+	}
+	if(archive->numRecords > archive->capacity)
+	{
+		archive->capacity = archive->numRecords;
+		gsvArchiveEntry* entries = (gsvArchiveEntry*) realloc(archive->entries,sizeof(gsvArchiveEntry)*archive->capacity);
+		if(entries == NULL)
+		{
+			gsv_archive_destroy(archive);
+			return NULL;
+		}
+		archive->entries = entries;
+	}
+	for(int i=0;i<archive->numRecords;i++)
+	{
+		gsvArchiveHeader header;
+		if(gsv_archive_header(archive,archive->offsets[i],&header) != 0)
+			continue;
+		archive->entries[archive->numEntries].offset = archive->offsets[i];
+		memcpy(archive->entries[archive->numEntries].panoramaId,header.panoramaId,sizeof(header.panoramaId));
+		archive->numEntries++;
+	}
+	archive->end = archive->dataEnd;
+	gsv_archive_unload(archive);
+	// Drops the old index and anything torn, so no footer points at records written over
+	if(ftruncate(archive->descriptor,(off_t)archive->end) != 0)
+	{
+		gsv_archive_destroy(archive);
+		return NULL;
+	}
+	return archive;
+}
+
+gsvStatus gsv_archive_append(gsvArchive* archive,const GSV* panorama,const void* image,size_t imageSize)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_archive_append(%p,%p,%p,%zu)\n",archive,panorama,image,imageSize);
+#endif
+	if(archive == NULL || archive->writable == 0 || panorama == NULL || (image == NULL && imageSize > 0))
+		return GSV_ERROR_INVALID;
+
+	size_t metadataSize = 0;
+	char* metadata = gsv_serialize(panorama,&metadataSize);
+	if(metadata == NULL)
+		return GSV_ERROR_MEMORY;
+	if(metadataSize > UINT32_MAX)
+	{
+		free(metadata);
+		return GSV_ERROR_INVALID;
+	}
+
+	gsvArchiveHeader header;
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,GSV_ARCHIVE_RECORD_MAGIC,sizeof(header.magic));
+	header.metadataSize = (uint32_t)metadataSize;
+	header.imageSize = imageSize;
+	snprintf(header.panoramaId,sizeof(header.panoramaId),"%.*s",GSV_PANORAMA_ID_LENGTH,panorama->dataProperties.panoramaId);
+	uint64_t recordSize = gsv_archive_record_size(metadataSize,imageSize);
+	static const char padding[GSV_ARCHIVE_ALIGNMENT] = { 0 };
+
+	// A failed write leaves a hole the index never points at
+	uint64_t offset = __atomic_fetch_add(&archive->end,recordSize,__ATOMIC_RELAXED);
+	struct iovec vectors[4] = { { &header, sizeof(header) }, { metadata, metadataSize }, { (void*)image, imageSize }, { (void*)padding, (size_t)(recordSize-sizeof(header)-metadataSize-imageSize) } };
+	GSV_TRACE_BEGIN(appendTrace);
+	int written = gsv_archive_pwritev(archive->descriptor,vectors,4,offset);
+	GSV_TRACE_END(appendTrace,"archive_append","archive","%s %llu bytes",header.panoramaId,(unsigned long long)recordSize);
+	free(metadata);
+	if(written != 0)
+		return GSV_ERROR_IO;
+
+	gsvStatus status = GSV_OK;
+	pthread_mutex_lock(&archive->mutex);
+	if(archive->numEntries == archive->capacity)
+	{
+		gsvArchiveEntry* entries = (gsvArchiveEntry*) realloc(archive->entries,sizeof(gsvArchiveEntry)*archive->capacity*2);
+		if(entries != NULL)
+		{
+			archive->entries = entries;
+			archive->capacity *= 2;
+		}
+	}
+	if(archive->numEntries < archive->capacity)
+	{
+		archive->entries[archive->numEntries].offset = offset;
+		memcpy(archive->entries[archive->numEntries].panoramaId,header.panoramaId,sizeof(header.panoramaId));
+		archive->numEntries++;
+	}
+	else
+		status = GSV_ERROR_MEMORY;
+	pthread_mutex_unlock(&archive->mutex);
+	return status;
+}
+
+gsvStatus gsv_archive_append_panorama(gsvArchive* archive,GSV* panorama,int zoomLevel,int quality)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_archive_append_panorama(%p,%p,%d,%d)\n",archive,panorama,zoomLevel,quality);
+#endif
+	if(archive == NULL || panorama == NULL)
+		return GSV_ERROR_INVALID;
+
+	// Only the compressed image is held, the pixels still stream a tile row at a time
+	char* image = NULL;
+	size_t imageSize = 0;
+	FILE* file = open_memstream(&image,&imageSize);
+	if(file == NULL)
+		return GSV_ERROR_MEMORY;
+	gsvStatus status = gsv_panorama_encode(panorama,zoomLevel,file,quality);
+	if(fclose(file) != 0 && status == GSV_OK)
+		status = GSV_ERROR_MEMORY;
+	if(status == GSV_OK)
+		status = gsv_archive_append(archive,panorama,image,imageSize);
+	free(image);
+	return status;
+}
+
+gsvStatus gsv_archive_close(gsvArchive** archive)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_archive_close(%p)\n",archive);
+#endif
+	if(archive == NULL || *archive == NULL)
+		return GSV_ERROR_INVALID;
+	gsvStatus status = GSV_OK;
+	if((*archive)->writable)
+		status = gsv_archive_write_index(*archive);
+	gsv_archive_destroy(*archive);
+	*archive = NULL;
+	return status;
+}
+
+gsvArchive* gsv_archive_open(const char* path)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_archive_open(%s)\n",path);
+#endif
+	if(path == NULL)
+		return NULL;
+	gsvArchive* archive = (gsvArchive*) calloc(1,sizeof(gsvArchive));
+	if(archive == NULL)
+		return NULL;
+	archive->descriptor = open(path,O_RDONLY|O_CLOEXEC);
+	if(archive->descriptor < 0 || gsv_archive_load(archive) != 0)
+	{
+		gsv_archive_destroy(archive);
+		return NULL;
+	}
+	return archive;
+}
+
+int gsv_archive_size(gsvArchive* archive)
+{
+	if(archive == NULL)
+		return 0;
+	if(archive->writable == 0)
+		return archive->numRecords;
+	pthread_mutex_lock(&archive->mutex);
+	int size = archive->numEntries;
+	pthread_mutex_unlock(&archive->mutex);
+	return size;
+}
+
+gsvStatus gsv_archive_record(gsvArchive* archive,int index,gsvArchiveRecord* record)
+{
+	if(archive == NULL || archive->writable || record == NULL || index < 0 || index >= archive->numRecords)
+		return GSV_ERROR_INVALID;
+	gsvArchiveHeader header;
+	if(gsv_archive_header(archive,archive->offsets[index],&header) != 0)
+		return GSV_ERROR_DECODE;
+	gsv_archive_fill_record(archive,archive->offsets[index],&header,record);
+
+	// Reads the next record in while this one is used, a scan then streams at the disk's pace
+	if(index+1 < archive->numRecords && archive->offsets[index+1] < archive->dataEnd)
+	{
+		uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+		uint64_t start = archive->offsets[index+1]&~(pageSize-1);
+		uint64_t end = (index+2 < archive->numRecords && archive->offsets[index+2] <= archive->dataEnd) ? archive->offsets[index+2] : archive->dataEnd;
+		if(end > start)
+			madvise((void*)(archive->mapping+start),(size_t)(end-start),MADV_WILLNEED);
+	}
+	return GSV_OK;
+}
+
+gsvStatus gsv_archive_find(gsvArchive* archive,const char* panoramaId,gsvArchiveRecord* record)
+{
+	if(archive == NULL || archive->writable || panoramaId == NULL || record == NULL)
+		return GSV_ERROR_INVALID;
+	if(archive->numSlots == 0)
+		return GSV_ERROR_INVALID;
+	const gsvArchiveSlot* slot = &archive->slots[gsv_archive_slot(archive->slots,archive->numSlots,panoramaId)];
+	if(slot->record == 0 || slot->record > (uint64_t)archive->numRecords || strncmp(slot->panoramaId,panoramaId,GSV_PANORAMA_ID_LENGTH) != 0)
+		return GSV_ERROR_INVALID;
+	return gsv_archive_record(archive,(int)(slot->record-1),record);
+}
+
+GSV* gsv_archive_panorama(const gsvArchiveRecord* record)
+{
+	if(record == NULL || record->metadata == NULL)
+		return NULL;
+	// gsv_parse only reads the string
+	return gsv_parse((char*)record->metadata);
+}
@@ -0,0 +1,149 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <pthread.h>
+#include <turbojpeg.h>
+#include "cstreetview_private.h"
+
+/*
+ * One TurboJPEG handle and scratch buffer per thread. Tiles decode straight into
+ * the panorama, only one that would overhang it goes through the scratch buffer.
+ */
+
+typedef struct gsvDecoder_S {
+	tjhandle handle;
+	unsigned char* scratch;
+	size_t scratchSize;
+} gsvDecoder;
+
+static pthread_once_t gsvDecoderOnce = PTHREAD_ONCE_INIT;
+// Only used for its destructor, lookups go through the __thread pointer
+static pthread_key_t gsvDecoderKey;
+static __thread gsvDecoder* gsvThreadDecoder = NULL;
+
+static void gsv_decoder_destroy(void* data)
+{
+	gsvDecoder* decoder = (gsvDecoder*)data;
+	if(decoder->handle != NULL)
+		tjDestroy(decoder->handle);
+	free(decoder->scratch);
+	free(decoder);
+}
+
+static void gsv_decoder_key_create()
+{
+	pthread_key_create(&gsvDecoderKey,gsv_decoder_destroy);
+}
+
+static gsvDecoder* gsv_decoder()
+{
+	if(gsvThreadDecoder != NULL)
+		return gsvThreadDecoder;
+
+	gsvDecoder* decoder = (gsvDecoder*) calloc(1,sizeof(gsvDecoder));
+	if(decoder == NULL)
+		return NULL;
+	decoder->handle = tjInitDecompress();
+	if(decoder->handle == NULL)
+	{
+		free(decoder);
+		return NULL;
+	}
+
+	pthread_once(&gsvDecoderOnce,gsv_decoder_key_create);
+	pthread_setspecific(gsvDecoderKey,decoder);
+	gsvThreadDecoder = decoder;
+	return decoder;
+}
+
+static int gsv_decode_header(gsvDecoder* decoder,const void* jpegBuffer,size_t jpegSize,int* width,int* height)
+{
+	int subsampling = 0;
+	int colourspace = 0;
+	return tjDecompressHeader3(decoder->handle,(const unsigned char*)jpegBuffer,jpegSize,width,height,&subsampling,&colourspace);
+}
+
+/*
+ * Private methods
+ */
+
+IplImage* gsv_decode_tile(const void* jpegBuffer,size_t jpegSize)
+{
+	gsvDecoder* decoder = gsv_decoder();
+	if(decoder == NULL || jpegBuffer == NULL)
+		return NULL;
+
+	GSV_TRACE_BEGIN(decodeTrace);
+	GSV_STATS_BEGIN(decodeTimer);
+	int width = 0;
+	int height = 0;
+	if(gsv_decode_header(decoder,jpegBuffer,jpegSize,&width,&height) != 0)
+		return NULL;
+
+	IplImage* tileImage = cvCreateImage(cvSize(width,height),IPL_DEPTH_8U,3);
+	if(tjDecompress2(decoder->handle,(const unsigned char*)jpegBuffer,jpegSize,(unsigned char*)tileImage->imageData,width,tileImage->widthStep,height,TJPF_BGR,0) != 0)
+	{
+		cvReleaseImage(&tileImage);
+		return NULL;
+	}
+	GSV_STATS_END(GSV_STAGE_DECODE,decodeTimer);
+	GSV_TRACE_END(decodeTrace,"decode","tile",NULL);
+
+	return tileImage;
+}
+
+int gsv_decode_tile_into(IplImage* panoramaImage,int left,int top,const void* jpegBuffer,size_t jpegSize)
+{
+	gsvDecoder* decoder = gsv_decoder();
+	if(decoder == NULL || jpegBuffer == NULL || panoramaImage->nChannels != 3 || left < 0 || top < 0)
+		return -1;
+	if(left >= panoramaImage->width || top >= panoramaImage->height)
+		return 0;
+
+	GSV_TRACE_BEGIN(decodeTrace);
+	GSV_STATS_BEGIN(decodeTimer);
+	int width = 0;
+	int height = 0;
+	if(gsv_decode_header(decoder,jpegBuffer,jpegSize,&width,&height) != 0)
+		return -1;
+
+	unsigned char* destination = (unsigned char*)&panoramaImage->imageData[top*panoramaImage->widthStep+left*3];
+	if(left+width <= panoramaImage->width && top+height <= panoramaImage->height)
+	{
+		if(tjDecompress2(decoder->handle,(const unsigned char*)jpegBuffer,jpegSize,destination,width,panoramaImage->widthStep,height,TJPF_BGR,0) != 0)
+			return -1;
+		GSV_STATS_END(GSV_STAGE_DECODE,decodeTimer);
+		GSV_TRACE_END(decodeTrace,"decode","tile","into x%d y%d",left,top);
+		return 0;
+	}
+
+	size_t scratchSize = (size_t)width*height*3;
+	if(scratchSize > decoder->scratchSize)
+	{
+		unsigned char* scratch = (unsigned char*) realloc(decoder->scratch,scratchSize);
+		if(scratch == NULL)
+			return -1;
+		decoder->scratch = scratch;
+		decoder->scratchSize = scratchSize;
+	}
+	if(tjDecompress2(decoder->handle,(const unsigned char*)jpegBuffer,jpegSize,decoder->scratch,width,width*3,height,TJPF_BGR,0) != 0)
+		return -1;
+	GSV_STATS_END(GSV_STAGE_DECODE,decodeTimer);
+	GSV_TRACE_END(decodeTrace,"decode","tile","x%d y%d",left,top);
+
+	// No ROI, so workers can fill disjoint parts of one panorama at once
+	GSV_STATS_BEGIN(stitchTimer);
+	int copyWidth = (left+width > panoramaImage->width) ? panoramaImage->width-left : width;
+	int copyHeight = (top+height > panoramaImage->height) ? panoramaImage->height-top : height;
+	for(int row=0;row<copyHeight;row++)
+		memcpy(destination+row*panoramaImage->widthStep,decoder->scratch+row*width*3,copyWidth*3);
+	GSV_STATS_END(GSV_STAGE_STITCH,stitchTimer);
+
+	return 0;
+}
@@ -0,0 +1,492 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "cstreetview_private.h"
+
+/*
+ * Depth and pano maps, URL-safe base64 of a zlib stream that inflates to
+ *
+ * 	header size (1 byte), count, width, height, offset (16 bit little endian)
+ * 	width*height one byte indices, at offset for a depth map, header size for a pano map
+ * 	count planes of normal x,y,z and distance, or count 22 character ids then their x,y
+ *
+ * with 32 bit little endian floats. Map column width-x-1 is panorama column x,
+ * and depth along a ray v is |distance/(normal.v)|.
+ */
+
+#define GSV_MODEL_PANORAMA_ID_LENGTH 22
+#define GSV_DEPTH_MAP_HEADER_LENGTH 9
+#define GSV_PANO_MAP_HEADER_LENGTH 7
+
+static pthread_once_t gsvBase64Once = PTHREAD_ONCE_INIT;
+static signed char gsvBase64Values[256];
+
+static void gsv_base64_table()
+{
+	memset(gsvBase64Values,-1,sizeof(gsvBase64Values));
+	for(int i=0;i<26;i++)
+	{
+		gsvBase64Values['A'+i] = i;
+		gsvBase64Values['a'+i] = 26+i;
+	}
+	for(int i=0;i<10;i++)
+		gsvBase64Values['0'+i] = 52+i;
+	// Both alphabets, Google sends the URL-safe one
+	gsvBase64Values['+'] = gsvBase64Values['-'] = 62;
+	gsvBase64Values['/'] = gsvBase64Values['_'] = 63;
+}
+
+// Padding, whitespace and anything else outside the alphabets are skipped. Returns the decoded length
+static size_t gsv_base64_decode(const char* text,unsigned char* output)
+{
+	pthread_once(&gsvBase64Once,gsv_base64_table);
+	size_t length = 0;
+	unsigned int bits = 0;
+	int numBits = 0;
+	for(const unsigned char* cursor=(const unsigned char*)text;*cursor!='\0';cursor++)
+	{
+		int value = gsvBase64Values[*cursor];
+		if(value < 0)
+			continue;
+		bits = (bits << 6) | value;
+		numBits += 6;
+		if(numBits >= 8)
+		{
+			numBits -= 8;
+			output[length++] = (unsigned char)(bits >> numBits);
+		}
+	}
+	return length;
+}
+
+// The inflated size is not sent, the buffer starts at a few times the input and doubles
+static unsigned char* gsv_inflate(const unsigned char* input,size_t inputLength,size_t* outputLength)
+{
+	z_stream stream;
+	memset(&stream,0,sizeof(stream));
+	if(inflateInit(&stream) != Z_OK)
+		return NULL;
+
+	size_t capacity = (inputLength*4 > 4096) ? inputLength*4 : 4096;
+	unsigned char* output = (unsigned char*) malloc(capacity);
+	stream.next_in = (Bytef*)input;
+	stream.avail_in = (uInt)inputLength;
+	int result = Z_OK;
+	while(output != NULL)
+	{
+		stream.next_out = output+stream.total_out;
+		stream.avail_out = (uInt)(capacity-stream.total_out);
+		result = inflate(&stream,Z_NO_FLUSH);
+		if(result != Z_OK)
+			break;
+		if(stream.avail_out == 0)
+		{
+			unsigned char* grown = (unsigned char*) realloc(output,capacity*2);
+			if(grown == NULL)
+			{
+				free(output);
+				output = NULL;
+				break;
+			}
+			output = grown;
+			capacity *= 2;
+		}
+		else if(stream.avail_in == 0)
+			break;
+	}
+	*outputLength = stream.total_out;
+	inflateEnd(&stream);
+	if(result != Z_STREAM_END)
+	{
+		free(output);
+		return NULL;
+	}
+	return output;
+}
+
+static unsigned char* gsv_model_inflate(const char* text,size_t* length)
+{
+	unsigned char* compressed = (unsigned char*) malloc(strlen(text)*3/4+3);
+	if(compressed == NULL)
+		return NULL;
+	size_t compressedLength = gsv_base64_decode(text,compressed);
+	unsigned char* data = gsv_inflate(compressed,compressedLength,length);
+	free(compressed);
+	return data;
+}
+
+static int gsv_model_uint16(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+static float gsv_model_float(const unsigned char* data)
+{
+	unsigned int bits = (unsigned int)data[0] | ((unsigned int)data[1] << 8) | ((unsigned int)data[2] << 16) | ((unsigned int)data[3] << 24);
+	float value = 0.0f;
+	memcpy(&value,&bits,sizeof(value));
+	return value;
+}
+
+static gsvDepthMap* gsv_depth_map_decode(const char* text)
+{
+	size_t length = 0;
+	unsigned char* data = gsv_model_inflate(text,&length);
+	if(data == NULL)
+		return NULL;
+	if(length < GSV_DEPTH_MAP_HEADER_LENGTH)
+	{
+		free(data);
+		return NULL;
+	}
+
+	int numPlanes = gsv_model_uint16(&data[1]);
+	int width = gsv_model_uint16(&data[3]);
+	int height = gsv_model_uint16(&data[5]);
+	size_t offset = gsv_model_uint16(&data[7]);
+	size_t numPixels = (size_t)width*height;
+	gsvDepthMap* depthMap = NULL;
+	if(numPixels > 0 && offset+numPixels+(size_t)numPlanes*16 <= length)
+		depthMap = (gsvDepthMap*) calloc(1,sizeof(gsvDepthMap));
+	if(depthMap == NULL)
+	{
+		free(data);
+		return NULL;
+	}
+
+	depthMap->width = width;
+	depthMap->height = height;
+	// Tables for every possible index, so one naming a plane that was not sent finds a plane with no distance
+	depthMap->numPlanes = (numPlanes > 256) ? 256 : ((numPlanes > 0) ? numPlanes : 1);
+	depthMap->planeIndices = (unsigned char*) malloc(numPixels);
+	depthMap->normals = (float*) calloc(3*256,sizeof(float));
+	depthMap->distances = (float*) calloc(256,sizeof(float));
+	if(depthMap->planeIndices == NULL || depthMap->normals == NULL || depthMap->distances == NULL)
+	{
+		free(data);
+		gsv_depth_map_free(&depthMap);
+		return NULL;
+	}
+
+	memcpy(depthMap->planeIndices,&data[offset],numPixels);
+	const unsigned char* planes = &data[offset+numPixels];
+	for(int i=0;i<depthMap->numPlanes && i<numPlanes;i++)
+	{
+		depthMap->normals[3*i] = gsv_model_float(&planes[16*i]);
+		depthMap->normals[3*i+1] = gsv_model_float(&planes[16*i+4]);
+		depthMap->normals[3*i+2] = gsv_model_float(&planes[16*i+8]);
+		depthMap->distances[i] = gsv_model_float(&planes[16*i+12]);
+	}
+	// Sky, and any index past the planes that were sent, has no distance
+	depthMap->distances[0] = 0.0f;
+	free(data);
+	return depthMap;
+}
+
+static gsvPanoMap* gsv_pano_map_decode(const char* text)
+{
+	size_t length = 0;
+	unsigned char* data = gsv_model_inflate(text,&length);
+	if(data == NULL)
+		return NULL;
+	if(length < GSV_PANO_MAP_HEADER_LENGTH)
+	{
+		free(data);
+		return NULL;
+	}
+
+	size_t headerSize = data[0];
+	int numPanoramas = gsv_model_uint16(&data[1]);
+	int width = gsv_model_uint16(&data[3]);
+	int height = gsv_model_uint16(&data[5]);
+	size_t numPixels = (size_t)width*height;
+	gsvPanoMap* panoMap = NULL;
+	if(numPixels > 0 && headerSize+numPixels+(size_t)numPanoramas*(GSV_MODEL_PANORAMA_ID_LENGTH+8) <= length)
+		panoMap = (gsvPanoMap*) calloc(1,sizeof(gsvPanoMap));
+	if(panoMap == NULL)
+	{
+		free(data);
+		return NULL;
+	}
+
+	panoMap->width = width;
+	panoMap->height = height;
+	panoMap->numPanoramas = numPanoramas;
+	panoMap->indices = (unsigned char*) malloc(numPixels);
+	panoMap->panoramaIds = (char (*)[GSV_PANORAMA_ID_LENGTH]) calloc(numPanoramas+1,GSV_PANORAMA_ID_LENGTH);
+	panoMap->positions = (float*) calloc(2*(numPanoramas+1),sizeof(float));
+	if(panoMap->indices == NULL || panoMap->panoramaIds == NULL || panoMap->positions == NULL)
+	{
+		free(data);
+		gsv_pano_map_free(&panoMap);
+		return NULL;
+	}
+
+	memcpy(panoMap->indices,&data[headerSize],numPixels);
+	const unsigned char* panoramaIds = &data[headerSize+numPixels];
+	const unsigned char* positions = &panoramaIds[(size_t)numPanoramas*GSV_MODEL_PANORAMA_ID_LENGTH];
+	for(int i=0;i<numPanoramas;i++)
+	{
+		memcpy(panoMap->panoramaIds[i],&panoramaIds[i*GSV_MODEL_PANORAMA_ID_LENGTH],GSV_MODEL_PANORAMA_ID_LENGTH);
+		panoMap->positions[2*i] = gsv_model_float(&positions[8*i]);
+		panoMap->positions[2*i+1] = gsv_model_float(&positions[8*i+4]);
+	}
+	free(data);
+	return panoMap;
+}
+
+/*
+ * Depth queries. Rays are handled a row at a time: the depth map cell and the ray of every pixel are worked out first, the cells' planes gathered into flat rows, and the division done over whole rows with no branches or table lookups, which the compiler vectorises
+ */
+
+typedef struct gsvDepthRow_S {
+	int* cells;
+	float* rayX;
+	float* rayY;
+	float* rayZ;
+	float* normalX;
+	float* normalY;
+	float* normalZ;
+	float* distances;
+} gsvDepthRow;
+
+static int gsv_depth_row_create(gsvDepthRow* row,int width)
+{
+	row->cells = (int*) malloc(width*sizeof(int));
+	float* floats = (float*) malloc((size_t)width*7*sizeof(float));
+	row->rayX = floats;
+	if(row->cells == NULL || floats == NULL)
+	{
+		free(row->cells);
+		free(floats);
+		return -1;
+	}
+	row->rayY = &floats[width];
+	row->rayZ = &floats[2*width];
+	row->normalX = &floats[3*width];
+	row->normalY = &floats[4*width];
+	row->normalZ = &floats[5*width];
+	row->distances = &floats[6*width];
+	return 0;
+}
+
+static void gsv_depth_row_destroy(gsvDepthRow* row)
+{
+	free(row->cells);
+	free(row->rayX);
+}
+
+static void gsv_depth_row(const gsvDepthMap* depthMap,gsvDepthRow* row,int width,float* depths)
+{
+	for(int x=0;x<width;x++)
+	{
+		int plane = depthMap->planeIndices[row->cells[x]];
+		row->normalX[x] = depthMap->normals[3*plane];
+		row->normalY[x] = depthMap->normals[3*plane+1];
+		row->normalZ[x] = depthMap->normals[3*plane+2];
+		row->distances[x] = depthMap->distances[plane];
+	}
+	for(int x=0;x<width;x++)
+	{
+		float dot = row->normalX[x]*row->rayX[x]+row->normalY[x]*row->rayY[x]+row->normalZ[x]*row->rayZ[x];
+		float depth = fabsf(row->distances[x]/dot);
+		// Sky has no distance, and a ray along its plane never reaches it
+		depths[x] = (row->distances[x] != 0.0f && dot != 0.0f) ? depth : 0.0f;
+	}
+}
+
+// heading is clockwise from the panorama's centre column and elevation up from the horizon, both in radians
+static inline int gsv_depth_cell(const gsvDepthMap* depthMap,float heading,float elevation)
+{
+	float u = heading/(2.0f*(float)M_PI)+0.5f;
+	u -= floorf(u);
+	float v = 0.5f-elevation/(float)M_PI;
+	int x = (int)(u*depthMap->width);
+	int y = (int)(v*depthMap->height);
+	x = (x < 0) ? 0 : ((x >= depthMap->width) ? depthMap->width-1 : x);
+	x = depthMap->width-1-x;
+	y = (y < 0) ? 0 : ((y >= depthMap->height) ? depthMap->height-1 : y);
+	return y*depthMap->width+x;
+}
+
+/*
+ * Private methods
+ */
+
+void gsv_depth_map_free(gsvDepthMap** depthMap)
+{
+	if(depthMap == NULL || *depthMap == NULL)
+		return;
+	free((*depthMap)->planeIndices);
+	free((*depthMap)->normals);
+	free((*depthMap)->distances);
+	free(*depthMap);
+	*depthMap = NULL;
+}
+
+void gsv_pano_map_free(gsvPanoMap** panoMap)
+{
+	if(panoMap == NULL || *panoMap == NULL)
+		return;
+	free((*panoMap)->indices);
+	free((*panoMap)->panoramaIds);
+	free((*panoMap)->positions);
+	free(*panoMap);
+	*panoMap = NULL;
+}
+
+/*
+ * Public methods
+ */
+
+const gsvDepthMap* gsv_depth_map(GSV* panorama)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_depth_map(%p)\n",panorama);
+#endif
+	if(panorama == NULL)
+		return NULL;
+	gsvModelProperties* model = &panorama->modelProperties;
+	if(model->depthMap == NULL && model->depthMapData != NULL)
+	{
+		GSV_TRACE_BEGIN(decodeTrace);
+		model->depthMap = gsv_depth_map_decode(model->depthMapData);
+		GSV_TRACE_END(decodeTrace,"decode","model","depth map %s",panorama->dataProperties.panoramaId);
+		// Decoded or corrupt, the text is not needed again
+		free(model->depthMapData);
+		model->depthMapData = NULL;
+	}
+	return model->depthMap;
+}
+
+const gsvPanoMap* gsv_pano_map(GSV* panorama)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_pano_map(%p)\n",panorama);
+#endif
+	if(panorama == NULL)
+		return NULL;
+	gsvModelProperties* model = &panorama->modelProperties;
+	if(model->panoMap == NULL && model->panoMapData != NULL)
+	{
+		GSV_TRACE_BEGIN(decodeTrace);
+		model->panoMap = gsv_pano_map_decode(model->panoMapData);
+		GSV_TRACE_END(decodeTrace,"decode","model","pano map %s",panorama->dataProperties.panoramaId);
+		free(model->panoMapData);
+		model->panoMapData = NULL;
+	}
+	return model->panoMap;
+}
+
+gsvStatus gsv_depth_panorama(GSV* panorama,int width,int height,float* depths)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_depth_panorama(%p,%d,%d,%p)\n",panorama,width,height,depths);
+#endif
+	if(width <= 0 || height <= 0 || depths == NULL)
+		return GSV_ERROR_INVALID;
+	const gsvDepthMap* depthMap = gsv_depth_map(panorama);
+	if(depthMap == NULL)
+		return GSV_ERROR_DECODE;
+
+	gsvDepthRow row;
+	double* sinHeadings = (double*) malloc(width*2*sizeof(double));
+	if(sinHeadings == NULL || gsv_depth_row_create(&row,width) != 0)
+	{
+		free(sinHeadings);
+		return GSV_ERROR_MEMORY;
+	}
+	double* cosHeadings = &sinHeadings[width];
+	int* columns = (int*) malloc(width*sizeof(int));
+	if(columns == NULL)
+	{
+		free(sinHeadings);
+		gsv_depth_row_destroy(&row);
+		return GSV_ERROR_MEMORY;
+	}
+
+	// Columns only depend on x and rows on y, so the trigonometry is done once per column and once per row
+	for(int x=0;x<width;x++)
+	{
+		double heading = ((x+0.5)/width-0.5)*2.0*M_PI;
+		sinHeadings[x] = sin(heading);
+		cosHeadings[x] = cos(heading);
+		columns[x] = depthMap->width-1-(int)((x+0.5)/width*depthMap->width);
+	}
+	for(int y=0;y<height;y++)
+	{
+		double elevation = (0.5-(y+0.5)/height)*M_PI;
+		float cosElevation = (float)cos(elevation);
+		float rayZ = (float)-sin(elevation);
+		int rowStart = (int)((y+0.5)/height*depthMap->height)*depthMap->width;
+		for(int x=0;x<width;x++)
+		{
+			row.cells[x] = rowStart+columns[x];
+			row.rayX[x] = (float)sinHeadings[x]*cosElevation;
+			row.rayY[x] = (float)-cosHeadings[x]*cosElevation;
+			row.rayZ[x] = rayZ;
+		}
+		gsv_depth_row(depthMap,&row,width,&depths[(size_t)y*width]);
+	}
+
+	free(columns);
+	free(sinHeadings);
+	gsv_depth_row_destroy(&row);
+	return GSV_OK;
+}
+
+gsvStatus gsv_depth_view(GSV* panorama,double heading,double pitch,double fieldOfView,int width,int height,float* depths)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_depth_view(%p,%f,%f,%f,%d,%d,%p)\n",panorama,heading,pitch,fieldOfView,width,height,depths);
+#endif
+	if(width <= 0 || height <= 0 || depths == NULL || fieldOfView <= 0.0 || fieldOfView >= 180.0)
+		return GSV_ERROR_INVALID;
+	const gsvDepthMap* depthMap = gsv_depth_map(panorama);
+	if(depthMap == NULL)
+		return GSV_ERROR_DECODE;
+
+	gsvDepthRow row;
+	if(gsv_depth_row_create(&row,width) != 0)
+		return GSV_ERROR_MEMORY;
+
+	// Camera axes in the panorama's frame of x right of its centre column, y towards it and z up
+	double yaw = (heading-panorama->projectionProperties.panoramaYaw)*M_PI/180.0;
+	pitch *= M_PI/180.0;
+	float forward[3] = { (float)(sin(yaw)*cos(pitch)), (float)(cos(yaw)*cos(pitch)), (float)sin(pitch) };
+	float right[3] = { (float)cos(yaw), (float)-sin(yaw), 0.0f };
+	float up[3] = { (float)(-sin(yaw)*sin(pitch)), (float)(-cos(yaw)*sin(pitch)), (float)cos(pitch) };
+	float focalLength = (float)((width/2.0)/tan(fieldOfView*M_PI/360.0));
+
+	for(int y=0;y<height;y++)
+	{
+		float offsetY = height/2.0f-(y+0.5f);
+		for(int x=0;x<width;x++)
+		{
+			float offsetX = (x+0.5f)-width/2.0f;
+			float ray[3];
+			for(int i=0;i<3;i++)
+				ray[i] = right[i]*offsetX+up[i]*offsetY+forward[i]*focalLength;
+			float horizontal = sqrtf(ray[0]*ray[0]+ray[1]*ray[1]);
+			float length = sqrtf(horizontal*horizontal+ray[2]*ray[2]);
+			row.cells[x] = gsv_depth_cell(depthMap,atan2f(ray[0],ray[1]),atan2f(ray[2],horizontal));
+			// The depth map's frame is this one with y and z flipped
+			row.rayX[x] = ray[0]/length;
+			row.rayY[x] = -ray[1]/length;
+			row.rayZ[x] = -ray[2]/length;
+		}
+		gsv_depth_row(depthMap,&row,width,&depths[(size_t)y*width]);
+	}
+
+	gsv_depth_row_destroy(&row);
+	return GSV_OK;
+}
@@ -0,0 +1,308 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <math.h>
+#include <pthread.h>
+#include "cstreetview_private.h"
+
+/*
+ * A fingerprint is a difference hash of 8x8 cells of the horizon band, north aligned.
+ * The index buckets fingerprints into a grid of cells maxDistance wide.
+ */
+
+#define GSV_DUPLICATE_CELLS 8
+#define GSV_DUPLICATE_INITIAL_BUCKETS 1024
+#define GSV_DUPLICATE_METRES_PER_DEGREE 111320.0
+
+typedef struct gsvDuplicateNode_S {
+	gsvFingerprint fingerprint;
+	long cellLatitude;
+	long cellLongitude;
+	struct gsvDuplicateNode_S* next;
+} gsvDuplicateNode;
+
+struct gsvDuplicateIndex_S {
+	gsvDuplicateConfig config;
+	// In degrees
+	double cellSize;
+	pthread_mutex_t mutex;
+	gsvDuplicateNode** buckets;
+	size_t numBuckets;
+	int size;
+};
+
+static size_t gsv_duplicate_bucket(const gsvDuplicateIndex* index,long cellLatitude,long cellLongitude)
+{
+	unsigned long long hash = (unsigned long long)cellLatitude*0x9E3779B97F4A7C15ULL^(unsigned long long)cellLongitude*0xC2B2AE3D27D4EB4FULL;
+	hash ^= hash>>29;
+	return (size_t)(hash&(index->numBuckets-1));
+}
+
+static long gsv_duplicate_cell(const gsvDuplicateIndex* index,double degrees)
+{
+	return (long)floor(degrees/index->cellSize);
+}
+
+static int gsv_duplicate_grow(gsvDuplicateIndex* index)
+{
+	size_t oldNumBuckets = index->numBuckets;
+	gsvDuplicateNode** oldBuckets = index->buckets;
+	gsvDuplicateNode** buckets = (gsvDuplicateNode**) calloc(oldNumBuckets*2,sizeof(gsvDuplicateNode*));
+	if(buckets == NULL)
+		return -1;
+
+	index->buckets = buckets;
+	index->numBuckets = oldNumBuckets*2;
+	for(size_t i=0;i<oldNumBuckets;i++)
+	{
+		gsvDuplicateNode* node = oldBuckets[i];
+		while(node != NULL)
+		{
+			gsvDuplicateNode* next = node->next;
+			size_t bucket = gsv_duplicate_bucket(index,node->cellLatitude,node->cellLongitude);
+			node->next = buckets[bucket];
+			buckets[bucket] = node;
+			node = next;
+		}
+	}
+	free(oldBuckets);
+	return 0;
+}
+
+// Equirectangular, plenty at a few metres
+static double gsv_duplicate_distance(const gsvFingerprint* a,const gsvFingerprint* b)
+{
+	double north = (a->latitude-b->latitude)*GSV_DUPLICATE_METRES_PER_DEGREE;
+	double east = (a->longitude-b->longitude)*GSV_DUPLICATE_METRES_PER_DEGREE*cos((a->latitude+b->latitude)*M_PI/360.0);
+	return sqrt(north*north+east*east);
+}
+
+static int gsv_duplicate_months_apart(time_t a,time_t b)
+{
+	struct tm aTm;
+	struct tm bTm;
+	gmtime_r(&a,&aTm);
+	gmtime_r(&b,&bTm);
+	return abs((aTm.tm_year*12+aTm.tm_mon)-(bTm.tm_year*12+bTm.tm_mon));
+}
+
+/*
+ * Public methods
+ */
+
+gsvStatus gsv_fingerprint(GSV* panorama,gsvFingerprint* fingerprint)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_fingerprint(%p,%p)\n",panorama,fingerprint);
+#endif
+	if(panorama == NULL || fingerprint == NULL)
+		return GSV_ERROR_INVALID;
+
+	IplImage* tile = gsv_tile(panorama,0,0,0);
+	if(tile == NULL)
+		return GSV_ERROR_NETWORK;
+
+	// The zoom 0 panorama is the full one halved until it fits the tile, the rest of the tile is padding
+	int sphereWidth = panorama->dataProperties.imageWidth;
+	while(sphereWidth > tile->width)
+		sphereWidth >>= 1;
+	if(sphereWidth <= 0)
+		sphereWidth = tile->width;
+	int sphereHeight = sphereWidth/2;
+	if(sphereHeight > tile->height)
+		sphereHeight = tile->height;
+
+	unsigned long long sums[GSV_DUPLICATE_CELLS][GSV_DUPLICATE_CELLS];
+	unsigned int counts[GSV_DUPLICATE_CELLS][GSV_DUPLICATE_CELLS];
+	memset(sums,0,sizeof(sums));
+	memset(counts,0,sizeof(counts));
+
+	int* columnCells = (int*) malloc(sphereWidth*sizeof(int));
+	if(columnCells == NULL)
+	{
+		cvReleaseImage(&tile);
+		return GSV_ERROR_MEMORY;
+	}
+	// The centre column faces panoramaYaw
+	for(int x=0;x<sphereWidth;x++)
+	{
+		double heading = ((x+0.5)/sphereWidth-0.5)*360.0+panorama->projectionProperties.panoramaYaw;
+		heading = fmod(fmod(heading,360.0)+360.0,360.0);
+		columnCells[x] = ((int)(heading/(360.0/GSV_DUPLICATE_CELLS)))%GSV_DUPLICATE_CELLS;
+	}
+
+	int top = sphereHeight/4;
+	int bandHeight = sphereHeight/2;
+	for(int y=0;y<bandHeight;y++)
+	{
+		int row = y*GSV_DUPLICATE_CELLS/bandHeight;
+		const unsigned char* pixel = (const unsigned char*)&tile->imageData[(top+y)*tile->widthStep];
+		for(int x=0;x<sphereWidth;x++,pixel+=3)
+		{
+			// BGR luma in integer weights summing to 256
+			sums[row][columnCells[x]] += pixel[0]*29+pixel[1]*150+pixel[2]*77;
+			counts[row][columnCells[x]]++;
+		}
+	}
+	free(columnCells);
+	cvReleaseImage(&tile);
+
+	unsigned long long hash = 0;
+	for(int row=0;row<GSV_DUPLICATE_CELLS;row++)
+	{
+		for(int column=0;column<GSV_DUPLICATE_CELLS;column++)
+		{
+			int east = (column+1)%GSV_DUPLICATE_CELLS;
+			// Cross multiplied so cells with different pixel counts compare by mean
+			hash <<= 1;
+			if(sums[row][column]*counts[row][east] > sums[row][east]*counts[row][column])
+				hash |= 1;
+		}
+	}
+
+	memcpy(fingerprint->panoramaId,panorama->dataProperties.panoramaId,GSV_PANORAMA_ID_LENGTH);
+	fingerprint->hash = hash;
+	fingerprint->latitude = panorama->dataProperties.latitude;
+	fingerprint->longitude = panorama->dataProperties.longitude;
+	fingerprint->imageDate = panorama->dataProperties.imageDate;
+
+	return GSV_OK;
+}
+
+int gsv_fingerprint_distance(const gsvFingerprint* a,const gsvFingerprint* b)
+{
+	return __builtin_popcountll(a->hash^b->hash);
+}
+
+gsvDuplicateIndex* gsv_duplicate_index_create(const gsvDuplicateConfig* config)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_duplicate_index_create(%p)\n",config);
+#endif
+	gsvDuplicateIndex* index = (gsvDuplicateIndex*) calloc(1,sizeof(gsvDuplicateIndex));
+	if(index == NULL)
+		return NULL;
+	index->config = (config != NULL) ? *config : gsvDuplicateConfigDefault;
+	// A cell never narrower than a metre, however tight maxDistance is
+	index->cellSize = ((index->config.maxDistance > 1.0) ? index->config.maxDistance : 1.0)/GSV_DUPLICATE_METRES_PER_DEGREE;
+	index->numBuckets = GSV_DUPLICATE_INITIAL_BUCKETS;
+	index->buckets = (gsvDuplicateNode**) calloc(index->numBuckets,sizeof(gsvDuplicateNode*));
+	if(index->buckets == NULL)
+	{
+		free(index);
+		return NULL;
+	}
+	pthread_mutex_init(&index->mutex,NULL);
+
+	return index;
+}
+
+void gsv_duplicate_index_destroy(gsvDuplicateIndex** index)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_duplicate_index_destroy(%p)\n",index);
+#endif
+	if(index == NULL || *index == NULL)
+		return;
+
+	for(size_t i=0;i<(*index)->numBuckets;i++)
+	{
+		gsvDuplicateNode* node = (*index)->buckets[i];
+		while(node != NULL)
+		{
+			gsvDuplicateNode* next = node->next;
+			free(node);
+			node = next;
+		}
+	}
+	free((*index)->buckets);
+	pthread_mutex_destroy(&(*index)->mutex);
+	free(*index);
+	*index = NULL;
+}
+
+int gsv_duplicate_index_size(gsvDuplicateIndex* index)
+{
+	if(index == NULL)
+		return 0;
+
+	pthread_mutex_lock(&index->mutex);
+	int size = index->size;
+	pthread_mutex_unlock(&index->mutex);
+	return size;
+}
+
+int gsv_duplicate_find(gsvDuplicateIndex* index,const gsvFingerprint* fingerprint,gsvFingerprint* duplicate)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_duplicate_find(%p,%p,%p)\n",index,fingerprint,duplicate);
+#endif
+	if(index == NULL || fingerprint == NULL)
+		return 0;
+
+	long cellLatitude = gsv_duplicate_cell(index,fingerprint->latitude);
+	long cellLongitude = gsv_duplicate_cell(index,fingerprint->longitude);
+	// Cells are square in degrees, so narrower than maxDistance east to west away from the equator
+	double shrink = cos(fingerprint->latitude*M_PI/180.0);
+	long longitudeCells = (shrink > 1.0/64.0) ? (long)ceil(1.0/shrink) : 64;
+
+	pthread_mutex_lock(&index->mutex);
+
+	const gsvDuplicateNode* best = NULL;
+	int bestDistance = index->config.maxHashDistance+1;
+	for(long i=cellLatitude-1;i<=cellLatitude+1;i++)
+	{
+		for(long j=cellLongitude-longitudeCells;j<=cellLongitude+longitudeCells;j++)
+		{
+			for(const gsvDuplicateNode* node=index->buckets[gsv_duplicate_bucket(index,i,j)];node!=NULL;node=node->next)
+			{
+				if(node->cellLatitude != i || node->cellLongitude != j)
+					continue;
+				int hashDistance = gsv_fingerprint_distance(fingerprint,&node->fingerprint);
+				if(hashDistance >= bestDistance || gsv_duplicate_distance(fingerprint,&node->fingerprint) > index->config.maxDistance)
+					continue;
+				if(index->config.maxMonthsApart >= 0 && gsv_duplicate_months_apart(fingerprint->imageDate,node->fingerprint.imageDate) > index->config.maxMonthsApart)
+					continue;
+				best = node;
+				bestDistance = hashDistance;
+			}
+		}
+	}
+
+	if(best != NULL && duplicate != NULL)
+		*duplicate = best->fingerprint;
+	pthread_mutex_unlock(&index->mutex);
+	return best != NULL;
+}
+
+gsvStatus gsv_duplicate_add(gsvDuplicateIndex* index,const gsvFingerprint* fingerprint)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_duplicate_add(%p,%p)\n",index,fingerprint);
+#endif
+	if(index == NULL || fingerprint == NULL)
+		return GSV_ERROR_INVALID;
+
+	gsvDuplicateNode* node = (gsvDuplicateNode*) malloc(sizeof(gsvDuplicateNode));
+	if(node == NULL)
+		return GSV_ERROR_MEMORY;
+	node->fingerprint = *fingerprint;
+	node->cellLatitude = gsv_duplicate_cell(index,fingerprint->latitude);
+	node->cellLongitude = gsv_duplicate_cell(index,fingerprint->longitude);
+
+	pthread_mutex_lock(&index->mutex);
+	if((size_t)index->size >= index->numBuckets)
+		gsv_duplicate_grow(index);
+	size_t bucket = gsv_duplicate_bucket(index,node->cellLatitude,node->cellLongitude);
+	node->next = index->buckets[bucket];
+	index->buckets[bucket] = node;
+	index->size++;
+	pthread_mutex_unlock(&index->mutex);
+	return GSV_OK;
+}
@@ -0,0 +1,1017 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "cstreetview_private.h"
+
+/*
+ * Requests wake the I/O thread through an eventfd, it drives curl multi over epoll
+ * and queues completed bodies for the workers.
+ */
+
+#define GSV_LOOP_DEFAULT_CONNECTIONS 64
+#define GSV_LOOP_MAX_EVENTS 256
+// Default fan-out of the batch calls and gsv_panorama_write
+#define GSV_BATCH_CONNECTIONS 16
+
+typedef enum gsvRequestKind_E {
+	GSV_REQUEST_OPEN = 0,
+	GSV_REQUEST_TILE,
+	GSV_REQUEST_PANORAMA_TILE,
+	// Raw body for the library's own use, e.g. prefetching
+	GSV_REQUEST_FETCH,
+	// A FETCH made conditional on the validators of an earlier response
+	GSV_REQUEST_REVALIDATE
+} gsvRequestKind;
+
+// Shared by every tile request of one gsv_panorama_async
+typedef struct gsvPanoramaJob_S {
+	IplImage* image;
+	int remaining;
+	gsvStatus status;
+	gsvImageCallback callback;
+	void* userData;
+	char panoramaId[GSV_PANORAMA_ID_LENGTH];
+	int zoomLevel;
+	unsigned long long trace;
+} gsvPanoramaJob;
+
+typedef struct gsvRequest_S {
+	gsvRequestKind kind;
+	char url[GSV_MAX_URL_LENGTH];
+	CURL* curl;
+	CURLBuffer buffer;
+	gsvStatus status;
+	int left;
+	int top;
+	gsvOpenCallback openCallback;
+	gsvImageCallback imageCallback;
+	gsvFetchCallback fetchCallback;
+	gsvRevalidateCallback revalidateCallback;
+	void* userData;
+	// REVALIDATE only, validators is sent and then overwritten with the response's
+	gsvValidators validators;
+	gsvValidators received;
+	struct curl_slist* headers;
+	int notModified;
+	gsvPanoramaJob* panorama;
+	unsigned long long trace;
+	struct gsvRequest_S* next;
+	struct gsvRequest_S* previous;
+} gsvRequest;
+
+typedef struct gsvRequestQueue_S {
+	gsvRequest* head;
+	gsvRequest* tail;
+} gsvRequestQueue;
+
+struct gsvLoop_S {
+	CURLM* multi;
+	int epollFd;
+	int wakeFd;
+	// Absolute CLOCK_MONOTONIC deadline curl asked for, in milliseconds, or -1
+	long long timerDeadline;
+	pthread_t ioThread;
+	pthread_t* workers;
+	int numWorkers;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t workAvailable;
+	pthread_cond_t idle;
+	gsvRequestQueue submitted;
+	gsvRequestQueue completed;
+	// Owned by the I/O thread, everything currently inside the multi handle
+	gsvRequest* active;
+	int outstanding;
+	int stopping;
+	int workersStopping;
+	// Set under the mutex and handed to curl by the I/O thread, which owns the multi handle
+	int maxConnections;
+	int connectionsChanged;
+};
+
+/*
+ * Queues
+ */
+
+static void gsv_queue_push(gsvRequestQueue* queue,gsvRequest* request)
+{
+	request->next = NULL;
+	if(queue->tail != NULL)
+		queue->tail->next = request;
+	else
+		queue->head = request;
+	queue->tail = request;
+}
+
+static gsvRequest* gsv_queue_pop(gsvRequestQueue* queue)
+{
+	gsvRequest* request = queue->head;
+	if(request != NULL)
+	{
+		queue->head = request->next;
+		if(queue->head == NULL)
+			queue->tail = NULL;
+		request->next = NULL;
+	}
+	return request;
+}
+
+static long long gsv_loop_milliseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (long long)now.tv_sec*1000LL+now.tv_nsec/1000000;
+}
+
+static void gsv_loop_wake(gsvLoop* loop)
+{
+	uint64_t one = 1;
+	while(write(loop->wakeFd,&one,sizeof(one)) < 0 && errno == EINTR);
+}
+
+/*
+ * Workers
+ */
+
+static void gsv_request_free(gsvRequest* request)
+{
+	if(request->buffer.buffer != NULL)
+		free(request->buffer.buffer);
+	if(request->headers != NULL)
+		curl_slist_free_all(request->headers);
+	free(request);
+}
+
+// Marks a request finished, the last one out wakes gsv_loop_wait
+static void gsv_loop_finish(gsvLoop* loop,gsvRequest* request)
+{
+	gsv_request_free(request);
+
+	pthread_mutex_lock(&loop->mutex);
+	if(--loop->outstanding == 0)
+		pthread_cond_broadcast(&loop->idle);
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+static void gsv_loop_complete_panorama_tile(gsvRequest* request)
+{
+	gsvPanoramaJob* job = request->panorama;
+
+	if(request->status == GSV_OK && gsv_decode_tile_into(job->image,request->left,request->top,request->buffer.buffer,request->buffer.bufferSize) != 0)
+		request->status = GSV_ERROR_DECODE;
+	// Keep the first error, later ones are usually the same failure repeated
+	gsvStatus expected = GSV_OK;
+	if(request->status != GSV_OK)
+		__atomic_compare_exchange_n(&job->status,&expected,request->status,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED);
+
+	if(__atomic_sub_fetch(&job->remaining,1,__ATOMIC_ACQ_REL) == 0)
+	{
+		GSV_TRACE_END(job->trace,"panorama","panorama","%s z%d",job->panoramaId,job->zoomLevel);
+		job->callback(__atomic_load_n(&job->status,__ATOMIC_RELAXED),job->image,job->userData);
+		free(job);
+	}
+}
+
+static void gsv_loop_complete(gsvRequest* request)
+{
+	switch(request->kind)
+	{
+		case GSV_REQUEST_OPEN:
+		{
+			GSV* panorama = NULL;
+			if(request->status == GSV_OK)
+			{
+				panorama = gsv_parse_buffer(&request->buffer);
+				if(panorama == NULL)
+					request->status = GSV_ERROR_PARSE;
+			}
+			request->openCallback(request->status,panorama,request->userData);
+			break;
+		}
+		case GSV_REQUEST_TILE:
+		{
+			IplImage* tileImage = NULL;
+			if(request->status == GSV_OK)
+			{
+				tileImage = gsv_decode_tile(request->buffer.buffer,request->buffer.bufferSize);
+				if(tileImage == NULL)
+					request->status = GSV_ERROR_DECODE;
+			}
+			request->imageCallback(request->status,tileImage,request->userData);
+			break;
+		}
+		case GSV_REQUEST_PANORAMA_TILE:
+			gsv_loop_complete_panorama_tile(request);
+			break;
+		case GSV_REQUEST_FETCH:
+			if(request->status != GSV_OK && request->buffer.buffer != NULL)
+			{
+				free(request->buffer.buffer);
+				request->buffer = CURLBufferDefault;
+			}
+			request->fetchCallback(request->status,&request->buffer,request->userData);
+			break;
+		case GSV_REQUEST_REVALIDATE:
+			if((request->status != GSV_OK || request->notModified) && request->buffer.buffer != NULL)
+			{
+				free(request->buffer.buffer);
+				request->buffer = CURLBufferDefault;
+			}
+			request->revalidateCallback(request->status,request->notModified,&request->buffer,&request->received,request->userData);
+			break;
+	}
+}
+
+static void* gsv_loop_worker(void* data)
+{
+	gsvLoop* loop = (gsvLoop*)data;
+	gsv_trace_name_thread("gsv_worker");
+
+	for(;;)
+	{
+		pthread_mutex_lock(&loop->mutex);
+		gsvRequest* request = NULL;
+		while((request = gsv_queue_pop(&loop->completed)) == NULL && loop->workersStopping == 0)
+			pthread_cond_wait(&loop->workAvailable,&loop->mutex);
+		pthread_mutex_unlock(&loop->mutex);
+
+		if(request == NULL)
+			break;
+
+		gsv_loop_complete(request);
+		gsv_loop_finish(loop,request);
+	}
+
+	return NULL;
+}
+
+/*
+ * I/O thread
+ */
+
+static int gsv_loop_socket(CURL* curl,curl_socket_t socket,int action,void* userData,void* socketData)
+{
+	gsvLoop* loop = (gsvLoop*)userData;
+
+	if(action == CURL_POLL_REMOVE)
+	{
+		epoll_ctl(loop->epollFd,EPOLL_CTL_DEL,socket,NULL);
+		return 0;
+	}
+
+	struct epoll_event event;
+	memset(&event,0,sizeof(event));
+	event.data.fd = socket;
+	event.events = ((action & CURL_POLL_IN) ? EPOLLIN : 0) | ((action & CURL_POLL_OUT) ? EPOLLOUT : 0);
+	if(epoll_ctl(loop->epollFd,EPOLL_CTL_MOD,socket,&event) != 0 && errno == ENOENT)
+		epoll_ctl(loop->epollFd,EPOLL_CTL_ADD,socket,&event);
+
+	return 0;
+}
+
+static int gsv_loop_timer(CURLM* multi,long timeoutMs,void* userData)
+{
+	gsvLoop* loop = (gsvLoop*)userData;
+	loop->timerDeadline = (timeoutMs < 0) ? -1 : gsv_loop_milliseconds()+timeoutMs;
+	return 0;
+}
+
+static void gsv_loop_hand_off(gsvLoop* loop,gsvRequest* request)
+{
+	pthread_mutex_lock(&loop->mutex);
+	gsv_queue_push(&loop->completed,request);
+	pthread_cond_signal(&loop->workAvailable);
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+static void gsv_loop_detach(gsvLoop* loop,gsvRequest* request)
+{
+	if(request->previous != NULL)
+		request->previous->next = request->next;
+	else
+		loop->active = request->next;
+	if(request->next != NULL)
+		request->next->previous = request->previous;
+	request->next = NULL;
+	request->previous = NULL;
+
+	curl_multi_remove_handle(loop->multi,request->curl);
+	curl_easy_cleanup(request->curl);
+	request->curl = NULL;
+}
+
+static void gsv_loop_admit(gsvLoop* loop)
+{
+	pthread_mutex_lock(&loop->mutex);
+	gsvRequest* submitted = loop->submitted.head;
+	loop->submitted.head = NULL;
+	loop->submitted.tail = NULL;
+	int connectionsChanged = loop->connectionsChanged;
+	long maxConnections = loop->maxConnections;
+	loop->connectionsChanged = 0;
+	pthread_mutex_unlock(&loop->mutex);
+
+	// The smaller cache closes connections above a lowered cap as they come back
+	if(connectionsChanged)
+	{
+		curl_multi_setopt(loop->multi,CURLMOPT_MAX_HOST_CONNECTIONS,maxConnections);
+		curl_multi_setopt(loop->multi,CURLMOPT_MAXCONNECTS,maxConnections);
+	}
+
+	while(submitted != NULL)
+	{
+		gsvRequest* request = submitted;
+		submitted = submitted->next;
+
+		if(request->kind != GSV_REQUEST_FETCH && request->kind != GSV_REQUEST_REVALIDATE && gsv_prefetch_take(request->url,&request->buffer,0))
+		{
+			gsv_loop_hand_off(loop,request);
+			continue;
+		}
+
+		request->curl = curl_easy_init();
+		if(request->curl == NULL)
+		{
+			request->status = GSV_ERROR_MEMORY;
+			gsv_loop_hand_off(loop,request);
+			continue;
+		}
+		gsv_curl_setup(request->curl,request->url,&request->buffer);
+		curl_easy_setopt(request->curl,CURLOPT_PRIVATE,request);
+		if(request->kind == GSV_REQUEST_REVALIDATE)
+			gsv_curl_conditional(request->curl,&request->validators,&request->received,&request->headers);
+		request->trace = gsv_trace_clock();
+
+		request->previous = NULL;
+		request->next = loop->active;
+		if(loop->active != NULL)
+			loop->active->previous = request;
+		loop->active = request;
+
+		curl_multi_add_handle(loop->multi,request->curl);
+	}
+}
+
+static void gsv_loop_harvest(gsvLoop* loop)
+{
+	CURLMsg* message = NULL;
+	int remaining = 0;
+	while((message = curl_multi_info_read(loop->multi,&remaining)) != NULL)
+	{
+		if(message->msg != CURLMSG_DONE)
+			continue;
+
+		gsvRequest* request = NULL;
+		curl_easy_getinfo(message->easy_handle,CURLINFO_PRIVATE,(char**)&request);
+		CURLcode result = message->data.result;
+
+		GSV_STATS_TRANSFER(request->curl,result,request->buffer.bufferSize);
+		GSV_TRACE_END(request->trace,"download",(request->kind == GSV_REQUEST_OPEN || request->kind == GSV_REQUEST_REVALIDATE) ? "metadata" : "tile","%s",request->url);
+		if(request->kind == GSV_REQUEST_REVALIDATE && result == CURLE_OK)
+			request->notModified = gsv_curl_not_modified(request->curl,&request->received);
+
+		gsv_loop_detach(loop,request);
+		if(result != CURLE_OK)
+		{
+			request->status = GSV_ERROR_NETWORK;
+			if(request->buffer.buffer != NULL)
+			{
+				free(request->buffer.buffer);
+				request->buffer = CURLBufferDefault;
+			}
+		}
+		gsv_loop_hand_off(loop,request);
+	}
+}
+
+static void* gsv_loop_io(void* data)
+{
+	gsvLoop* loop = (gsvLoop*)data;
+	gsv_trace_name_thread("gsv_io");
+	struct epoll_event events[GSV_LOOP_MAX_EVENTS];
+	int running = 0;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&loop->mutex);
+		int stopping = loop->stopping;
+		pthread_mutex_unlock(&loop->mutex);
+		if(stopping)
+			break;
+
+		int timeout = -1;
+		if(loop->timerDeadline >= 0)
+		{
+			long long untilDeadline = loop->timerDeadline-gsv_loop_milliseconds();
+			timeout = (untilDeadline > 0) ? (int)untilDeadline : 0;
+		}
+
+		int numEvents = epoll_wait(loop->epollFd,events,GSV_LOOP_MAX_EVENTS,timeout);
+		for(int i=0;i<numEvents;i++)
+		{
+			if(events[i].data.fd == loop->wakeFd)
+			{
+				uint64_t count = 0;
+				while(read(loop->wakeFd,&count,sizeof(count)) < 0 && errno == EINTR);
+				gsv_loop_admit(loop);
+				continue;
+			}
+
+			int flags = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) | ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) | ((events[i].events & (EPOLLERR|EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+			curl_multi_socket_action(loop->multi,events[i].data.fd,flags,&running);
+		}
+
+		// Checked even when sockets were busy so curl's timeouts are never starved
+		if(loop->timerDeadline >= 0 && gsv_loop_milliseconds() >= loop->timerDeadline)
+		{
+			loop->timerDeadline = -1;
+			curl_multi_socket_action(loop->multi,CURL_SOCKET_TIMEOUT,0,&running);
+		}
+
+		gsv_loop_harvest(loop);
+	}
+
+	// Cancel whatever is still in flight or waiting to be admitted
+	while(loop->active != NULL)
+	{
+		gsvRequest* request = loop->active;
+		gsv_loop_detach(loop,request);
+		request->status = GSV_ERROR_CANCELLED;
+		gsv_loop_hand_off(loop,request);
+	}
+	pthread_mutex_lock(&loop->mutex);
+	gsvRequest* request = NULL;
+	while((request = gsv_queue_pop(&loop->submitted)) != NULL)
+	{
+		request->status = GSV_ERROR_CANCELLED;
+		gsv_queue_push(&loop->completed,request);
+	}
+	pthread_cond_broadcast(&loop->workAvailable);
+	pthread_mutex_unlock(&loop->mutex);
+
+	return NULL;
+}
+
+/*
+ * Submission
+ */
+
+static gsvRequest* gsv_request_create(gsvRequestKind kind)
+{
+	gsvRequest* request = (gsvRequest*) calloc(1,sizeof(gsvRequest));
+	if(request == NULL)
+		return NULL;
+	request->kind = kind;
+	request->buffer = CURLBufferDefault;
+	request->status = GSV_OK;
+	return request;
+}
+
+static gsvStatus gsv_loop_submit(gsvLoop* loop,gsvRequest** requests,int numRequests)
+{
+	pthread_mutex_lock(&loop->mutex);
+	if(loop->stopping)
+	{
+		pthread_mutex_unlock(&loop->mutex);
+		return GSV_ERROR_CANCELLED;
+	}
+	for(int i=0;i<numRequests;i++)
+		gsv_queue_push(&loop->submitted,requests[i]);
+	loop->outstanding += numRequests;
+	pthread_mutex_unlock(&loop->mutex);
+
+	gsv_loop_wake(loop);
+	return GSV_OK;
+}
+
+void gsv_loop_set_connections(gsvLoop* loop,int maxConnections)
+{
+	pthread_mutex_lock(&loop->mutex);
+	loop->maxConnections = maxConnections;
+	loop->connectionsChanged = 1;
+	pthread_mutex_unlock(&loop->mutex);
+	gsv_loop_wake(loop);
+}
+
+/*
+ * Batches
+ */
+
+// Shared by the blocking batch calls. Not a pthread_once, so a forked child can start over
+static pthread_mutex_t gsvBatchLoopMutex = PTHREAD_MUTEX_INITIALIZER;
+static gsvLoop* gsvBatchLoop = NULL;
+static int gsvBatchLoopClosed = 0;
+static int gsvBatchConnections = GSV_BATCH_CONNECTIONS;
+
+// Exactly one of panoramaIds, latitudes and longitudes, or urls is set
+typedef struct gsvBatch_S {
+	const char* const* panoramaIds;
+	const double* latitudes;
+	const double* longitudes;
+	const char* const* urls;
+	GSV** panoramas;
+	CURLBuffer* buffers;
+	gsvValidators* validators;
+	int* notModified;
+	gsvStatus* statuses;
+	int remaining;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+} gsvBatch;
+
+typedef struct gsvBatchItem_S {
+	gsvBatch* batch;
+	int index;
+} gsvBatchItem;
+
+const gsvBatch gsvBatchDefault = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0 };
+
+gsvLoop* gsv_batch_loop()
+{
+	pthread_mutex_lock(&gsvBatchLoopMutex);
+	if(gsvBatchLoop == NULL && gsvBatchLoopClosed == 0)
+		gsvBatchLoop = gsv_loop_create(0,gsvBatchConnections);
+	gsvLoop* loop = gsvBatchLoop;
+	pthread_mutex_unlock(&gsvBatchLoopMutex);
+	return loop;
+}
+
+void gsv_batch_loop_destroy()
+{
+	pthread_mutex_lock(&gsvBatchLoopMutex);
+	gsvBatchLoopClosed = 1;
+	gsvLoop* loop = gsvBatchLoop;
+	gsvBatchLoop = NULL;
+	pthread_mutex_unlock(&gsvBatchLoopMutex);
+	gsv_loop_destroy(&loop);
+}
+
+void gsv_batch_loop_forget()
+{
+	// Its threads did not survive the fork and its sockets are the parent's, so it is leaked
+	gsvBatchLoop = NULL;
+	pthread_mutex_init(&gsvBatchLoopMutex,NULL);
+}
+
+static void gsv_batch_item_done(gsvBatchItem* item,gsvStatus status)
+{
+	gsvBatch* batch = item->batch;
+	batch->statuses[item->index] = status;
+
+	pthread_mutex_lock(&batch->mutex);
+	if(--batch->remaining == 0)
+		pthread_cond_signal(&batch->done);
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+static void gsv_batch_opened(gsvStatus status,GSV* panorama,void* userData)
+{
+	gsvBatchItem* item = (gsvBatchItem*)userData;
+	item->batch->panoramas[item->index] = panorama;
+	gsv_batch_item_done(item,status);
+}
+
+static void gsv_batch_fetched(gsvStatus status,CURLBuffer* buffer,void* userData)
+{
+	gsvBatchItem* item = (gsvBatchItem*)userData;
+	item->batch->buffers[item->index] = *buffer;
+	*buffer = CURLBufferDefault;
+	gsv_batch_item_done(item,status);
+}
+
+static void gsv_batch_revalidated(gsvStatus status,int notModified,CURLBuffer* buffer,const gsvValidators* validators,void* userData)
+{
+	gsvBatchItem* item = (gsvBatchItem*)userData;
+	gsvBatch* batch = item->batch;
+	batch->notModified[item->index] = notModified;
+	if(status == GSV_OK && notModified == 0)
+		batch->validators[item->index] = *validators;
+	batch->buffers[item->index] = *buffer;
+	*buffer = CURLBufferDefault;
+	gsv_batch_item_done(item,status);
+}
+
+static gsvStatus gsv_batch_run(gsvBatch* batch,int numItems,gsvStatus* statuses)
+{
+	if(numItems < 0)
+		return GSV_ERROR_INVALID;
+	if(numItems == 0)
+		return GSV_OK;
+
+	gsvLoop* loop = gsv_batch_loop();
+	gsvBatchItem* items = (gsvBatchItem*) malloc(sizeof(gsvBatchItem)*numItems);
+	gsvStatus* itemStatuses = (statuses != NULL) ? statuses : (gsvStatus*) malloc(sizeof(gsvStatus)*numItems);
+	if(loop == NULL || items == NULL || itemStatuses == NULL)
+	{
+		free(items);
+		if(itemStatuses != statuses)
+			free(itemStatuses);
+		return GSV_ERROR_MEMORY;
+	}
+
+	batch->statuses = itemStatuses;
+	batch->remaining = numItems;
+	pthread_mutex_init(&batch->mutex,NULL);
+	pthread_cond_init(&batch->done,NULL);
+
+	for(int i=0;i<numItems;i++)
+	{
+		items[i].batch = batch;
+		items[i].index = i;
+		if(batch->panoramas != NULL)
+			batch->panoramas[i] = NULL;
+		if(batch->buffers != NULL)
+			batch->buffers[i] = CURLBufferDefault;
+		if(batch->notModified != NULL)
+			batch->notModified[i] = 0;
+
+		gsvStatus status = GSV_ERROR_INVALID;
+		if(batch->urls != NULL)
+		{
+			if(batch->urls[i] != NULL && batch->validators != NULL)
+				status = gsv_loop_revalidate_async(loop,batch->urls[i],&batch->validators[i],gsv_batch_revalidated,&items[i]);
+			else if(batch->urls[i] != NULL)
+				status = gsv_loop_fetch_async(loop,batch->urls[i],gsv_batch_fetched,&items[i]);
+		}
+		else if(batch->panoramaIds != NULL)
+		{
+			if(batch->panoramaIds[i] != NULL)
+				status = gsv_open_async(loop,batch->panoramaIds[i],gsv_batch_opened,&items[i]);
+		}
+		else
+			status = gsv_open_async(loop,batch->latitudes[i],batch->longitudes[i],gsv_batch_opened,&items[i]);
+		if(status != GSV_OK)
+			gsv_batch_item_done(&items[i],status);
+	}
+
+	pthread_mutex_lock(&batch->mutex);
+	while(batch->remaining > 0)
+		pthread_cond_wait(&batch->done,&batch->mutex);
+	pthread_mutex_unlock(&batch->mutex);
+
+	pthread_mutex_destroy(&batch->mutex);
+	pthread_cond_destroy(&batch->done);
+	free(items);
+
+	gsvStatus status = GSV_OK;
+	for(int i=0;i<numItems && status==GSV_OK;i++)
+		status = itemStatuses[i];
+	if(itemStatuses != statuses)
+		free(itemStatuses);
+	return status;
+}
+
+gsvStatus gsv_fetch_many(const char* const* urlStrings,int numUrls,CURLBuffer* buffers,gsvStatus* statuses)
+{
+	if(numUrls > 0 && (urlStrings == NULL || buffers == NULL))
+		return GSV_ERROR_INVALID;
+
+	gsvBatch batch = gsvBatchDefault;
+	batch.urls = urlStrings;
+	batch.buffers = buffers;
+	return gsv_batch_run(&batch,numUrls,statuses);
+}
+
+gsvStatus gsv_revalidate_many(const char* const* urlStrings,int numUrls,gsvValidators* validators,CURLBuffer* buffers,int* notModified,gsvStatus* statuses)
+{
+	if(numUrls > 0 && (urlStrings == NULL || validators == NULL || buffers == NULL || notModified == NULL))
+		return GSV_ERROR_INVALID;
+
+	gsvBatch batch = gsvBatchDefault;
+	batch.urls = urlStrings;
+	batch.buffers = buffers;
+	batch.validators = validators;
+	batch.notModified = notModified;
+	return gsv_batch_run(&batch,numUrls,statuses);
+}
+
+/*
+ * Public methods
+ */
+
+gsvLoop* gsv_loop_create(int numWorkers,int maxConnections)
+{
+	if(numWorkers <= 0)
+	{
+		long numProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+		numWorkers = (numProcessors > 0) ? (int)numProcessors : 1;
+	}
+	if(maxConnections <= 0)
+		maxConnections = GSV_LOOP_DEFAULT_CONNECTIONS;
+	if(gsv_global_init() != GSV_OK)
+		return NULL;
+
+	gsvLoop* loop = (gsvLoop*) calloc(1,sizeof(gsvLoop));
+	if(loop == NULL)
+		return NULL;
+
+	loop->timerDeadline = -1;
+	loop->maxConnections = maxConnections;
+	loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	loop->wakeFd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	loop->multi = curl_multi_init();
+	loop->workers = (pthread_t*) calloc(numWorkers,sizeof(pthread_t));
+	if(loop->epollFd < 0 || loop->wakeFd < 0 || loop->multi == NULL || loop->workers == NULL)
+	{
+		if(loop->epollFd >= 0)
+			close(loop->epollFd);
+		if(loop->wakeFd >= 0)
+			close(loop->wakeFd);
+		if(loop->multi != NULL)
+			curl_multi_cleanup(loop->multi);
+		free(loop->workers);
+		free(loop);
+		return NULL;
+	}
+
+	struct epoll_event wakeEvent;
+	memset(&wakeEvent,0,sizeof(wakeEvent));
+	wakeEvent.events = EPOLLIN;
+	wakeEvent.data.fd = loop->wakeFd;
+	epoll_ctl(loop->epollFd,EPOLL_CTL_ADD,loop->wakeFd,&wakeEvent);
+
+	curl_multi_setopt(loop->multi,CURLMOPT_SOCKETFUNCTION,gsv_loop_socket);
+	curl_multi_setopt(loop->multi,CURLMOPT_SOCKETDATA,loop);
+	curl_multi_setopt(loop->multi,CURLMOPT_TIMERFUNCTION,gsv_loop_timer);
+	curl_multi_setopt(loop->multi,CURLMOPT_TIMERDATA,loop);
+	// Transfers beyond this wait inside curl rather than opening more connections to the same host
+	curl_multi_setopt(loop->multi,CURLMOPT_MAX_HOST_CONNECTIONS,(long)maxConnections);
+
+	pthread_mutex_init(&loop->mutex,NULL);
+	pthread_cond_init(&loop->workAvailable,NULL);
+	pthread_cond_init(&loop->idle,NULL);
+
+	pthread_create(&loop->ioThread,NULL,gsv_loop_io,loop);
+	for(int i=0;i<numWorkers;i++)
+		pthread_create(&loop->workers[i],NULL,gsv_loop_worker,loop);
+	loop->numWorkers = numWorkers;
+
+	return loop;
+}
+
+void gsv_loop_wait(gsvLoop* loop)
+{
+	if(loop == NULL)
+		return;
+
+	pthread_mutex_lock(&loop->mutex);
+	while(loop->outstanding > 0)
+		pthread_cond_wait(&loop->idle,&loop->mutex);
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+void gsv_loop_destroy(gsvLoop** loop)
+{
+	if(loop == NULL || *loop == NULL)
+		return;
+	gsvLoop* destroyed = *loop;
+
+	pthread_mutex_lock(&destroyed->mutex);
+	destroyed->stopping = 1;
+	pthread_mutex_unlock(&destroyed->mutex);
+	gsv_loop_wake(destroyed);
+	pthread_join(destroyed->ioThread,NULL);
+
+	// Workers drain the cancelled requests before they see workersStopping
+	gsv_loop_wait(destroyed);
+	pthread_mutex_lock(&destroyed->mutex);
+	destroyed->workersStopping = 1;
+	pthread_cond_broadcast(&destroyed->workAvailable);
+	pthread_mutex_unlock(&destroyed->mutex);
+	for(int i=0;i<destroyed->numWorkers;i++)
+		pthread_join(destroyed->workers[i],NULL);
+
+	curl_multi_cleanup(destroyed->multi);
+	close(destroyed->epollFd);
+	close(destroyed->wakeFd);
+	pthread_mutex_destroy(&destroyed->mutex);
+	pthread_cond_destroy(&destroyed->workAvailable);
+	pthread_cond_destroy(&destroyed->idle);
+	free(destroyed->workers);
+	free(destroyed);
+	*loop = NULL;
+}
+
+gsvStatus gsv_open_async(gsvLoop* loop,double latitude,double longitude,gsvOpenCallback callback,void* userData)
+{
+	if(loop == NULL || callback == NULL)
+		return GSV_ERROR_INVALID;
+
+	gsvRequest* request = gsv_request_create(GSV_REQUEST_OPEN);
+	if(request == NULL)
+		return GSV_ERROR_MEMORY;
+	gsv_coordinate_url(latitude,longitude,request->url,sizeof(request->url));
+	request->openCallback = callback;
+	request->userData = userData;
+
+	gsvStatus status = gsv_loop_submit(loop,&request,1);
+	if(status != GSV_OK)
+		gsv_request_free(request);
+	return status;
+}
+
+gsvStatus gsv_open_async(gsvLoop* loop,const char* panoramaId,gsvOpenCallback callback,void* userData)
+{
+	if(loop == NULL || panoramaId == NULL || callback == NULL)
+		return GSV_ERROR_INVALID;
+
+	gsvRequest* request = gsv_request_create(GSV_REQUEST_OPEN);
+	if(request == NULL)
+		return GSV_ERROR_MEMORY;
+	gsv_metadata_url(panoramaId,request->url,sizeof(request->url));
+	request->openCallback = callback;
+	request->userData = userData;
+
+	gsvStatus status = gsv_loop_submit(loop,&request,1);
+	if(status != GSV_OK)
+		gsv_request_free(request);
+	return status;
+}
+
+gsvStatus gsv_tile_async(gsvLoop* loop,GSV* panorama,int zoomLevel,int x,int y,gsvImageCallback callback,void* userData)
+{
+	if(loop == NULL || panorama == NULL || callback == NULL)
+		return GSV_ERROR_INVALID;
+
+	gsvRequest* request = gsv_request_create(GSV_REQUEST_TILE);
+	if(request == NULL)
+		return GSV_ERROR_MEMORY;
+	gsv_tile_url(panorama->dataProperties.panoramaId,zoomLevel,x,y,request->url,sizeof(request->url));
+	request->imageCallback = callback;
+	request->userData = userData;
+
+	gsvStatus status = gsv_loop_submit(loop,&request,1);
+	if(status != GSV_OK)
+		gsv_request_free(request);
+	return status;
+}
+
+// Only the id and tile size are copied out of panorama, it can be closed as soon as this returns
+gsvStatus gsv_panorama_async(gsvLoop* loop,GSV* panorama,int zoomLevel,gsvImageCallback callback,void* userData)
+{
+	if(loop == NULL || panorama == NULL || callback == NULL || zoomLevel < 0 || zoomLevel > 5)
+		return GSV_ERROR_INVALID;
+	if(panorama->dataProperties.tileWidth <= 0 || panorama->dataProperties.tileHeight <= 0)
+		return GSV_ERROR_INVALID;
+
+	int maxX = 1;
+	int maxY = 1;
+	gsv_tile_grid(zoomLevel,&maxX,&maxY);
+	int numTiles = maxX*maxY;
+
+	gsvPanoramaJob* job = (gsvPanoramaJob*) calloc(1,sizeof(gsvPanoramaJob));
+	gsvRequest** requests = (gsvRequest**) calloc(numTiles,sizeof(gsvRequest*));
+	if(job == NULL || requests == NULL)
+	{
+		free(job);
+		free(requests);
+		return GSV_ERROR_MEMORY;
+	}
+
+	job->image = cvCreateImage(cvSize(panorama->dataProperties.tileWidth*maxX,panorama->dataProperties.tileHeight*maxY),IPL_DEPTH_8U,3);
+	if(job->image == NULL)
+	{
+		free(job);
+		free(requests);
+		return GSV_ERROR_MEMORY;
+	}
+	job->remaining = numTiles;
+	job->status = GSV_OK;
+	job->callback = callback;
+	job->userData = userData;
+	job->zoomLevel = zoomLevel;
+	job->trace = gsv_trace_clock();
+	memcpy(job->panoramaId,panorama->dataProperties.panoramaId,GSV_PANORAMA_ID_LENGTH);
+
+	for(int i=0;i<numTiles;i++)
+	{
+		int x = i%maxX;
+		int y = i/maxX;
+		requests[i] = gsv_request_create(GSV_REQUEST_PANORAMA_TILE);
+		if(requests[i] == NULL)
+		{
+			for(int j=0;j<i;j++)
+				gsv_request_free(requests[j]);
+			cvReleaseImage(&job->image);
+			free(job);
+			free(requests);
+			return GSV_ERROR_MEMORY;
+		}
+		gsv_tile_url(job->panoramaId,zoomLevel,x,y,requests[i]->url,sizeof(requests[i]->url));
+		requests[i]->left = x*panorama->dataProperties.tileWidth;
+		requests[i]->top = y*panorama->dataProperties.tileHeight;
+		requests[i]->panorama = job;
+	}
+
+	gsvStatus status = gsv_loop_submit(loop,requests,numTiles);
+	if(status != GSV_OK)
+	{
+		for(int i=0;i<numTiles;i++)
+			gsv_request_free(requests[i]);
+		cvReleaseImage(&job->image);
+		free(job);
+	}
+	free(requests);
+
+	return status;
+}
+
+gsvStatus gsv_open_many(const char* const* panoramaIds,int numPanoramas,GSV** panoramas,gsvStatus* statuses)
+{
+	if(numPanoramas > 0 && (panoramaIds == NULL || panoramas == NULL))
+		return GSV_ERROR_INVALID;
+
+	gsvBatch batch = gsvBatchDefault;
+	batch.panoramaIds = panoramaIds;
+	batch.panoramas = panoramas;
+	return gsv_batch_run(&batch,numPanoramas,statuses);
+}
+
+gsvStatus gsv_open_many(const double* latitudes,const double* longitudes,int numPanoramas,GSV** panoramas,gsvStatus* statuses)
+{
+	if(numPanoramas > 0 && (latitudes == NULL || longitudes == NULL || panoramas == NULL))
+		return GSV_ERROR_INVALID;
+
+	gsvBatch batch = gsvBatchDefault;
+	batch.latitudes = latitudes;
+	batch.longitudes = longitudes;
+	batch.panoramas = panoramas;
+	return gsv_batch_run(&batch,numPanoramas,statuses);
+}
+
+void gsv_set_batch_connections(int maxConnections)
+{
+	if(maxConnections <= 0)
+		maxConnections = GSV_BATCH_CONNECTIONS;
+	pthread_mutex_lock(&gsvBatchLoopMutex);
+	gsvBatchConnections = maxConnections;
+	if(gsvBatchLoop != NULL)
+		gsv_loop_set_connections(gsvBatchLoop,maxConnections);
+	pthread_mutex_unlock(&gsvBatchLoopMutex);
+}
+
+gsvStatus gsv_loop_fetch_async(gsvLoop* loop,const char* urlString,gsvFetchCallback callback,void* userData)
+{
+	if(loop == NULL || urlString == NULL || callback == NULL)
+		return GSV_ERROR_INVALID;
+
+	gsvRequest* request = gsv_request_create(GSV_REQUEST_FETCH);
+	if(request == NULL)
+		return GSV_ERROR_MEMORY;
+	snprintf(request->url,sizeof(request->url),"%s",urlString);
+	request->fetchCallback = callback;
+	request->userData = userData;
+
+	gsvStatus status = gsv_loop_submit(loop,&request,1);
+	if(status != GSV_OK)
+		gsv_request_free(request);
+	return status;
+}
+
+gsvStatus gsv_loop_revalidate_async(gsvLoop* loop,const char* urlString,const gsvValidators* validators,gsvRevalidateCallback callback,void* userData)
+{
+	if(loop == NULL || urlString == NULL || callback == NULL)
+		return GSV_ERROR_INVALID;
+
+	gsvRequest* request = gsv_request_create(GSV_REQUEST_REVALIDATE);
+	if(request == NULL)
+		return GSV_ERROR_MEMORY;
+	snprintf(request->url,sizeof(request->url),"%s",urlString);
+	request->validators = (validators != NULL) ? *validators : gsvValidatorsDefault;
+	request->revalidateCallback = callback;
+	request->userData = userData;
+
+	gsvStatus status = gsv_loop_submit(loop,&request,1);
+	if(status != GSV_OK)
+		gsv_request_free(request);
+	return status;
+}
+
+const char* gsv_status_name(gsvStatus status)
+{
+	switch(status)
+	{
+		case GSV_OK: return "ok";
+		case GSV_ERROR_NETWORK: return "network error";
+		case GSV_ERROR_PARSE: return "parse error";
+		case GSV_ERROR_DECODE: return "decode error";
+		case GSV_ERROR_MEMORY: return "out of memory";
+		case GSV_ERROR_INVALID: return "invalid argument";
+		case GSV_ERROR_CANCELLED: return "cancelled";
+		case GSV_ERROR_IO: return "i/o error";
+		case GSV_ERROR_ABORTED: return "aborted";
+	}
+	return "unknown";
+}
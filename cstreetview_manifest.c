@@ -0,0 +1,412 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <pthread.h>
+#include <unistd.h>
+#include "cstreetview_private.h"
+
+/*
+ * Entries are held by pointer so one handed out never moves. On disk, a header
+ * line then one tab separated line per panorama,
+ *
+ * 	panoramaId	imageDate	lastModified	etag	link,link,...
+ *
+ * with the date as YYYY-MM and "-" for an unknown date, an empty etag or no links.
+ */
+
+// Version 1 manifests kept local time_t dates and are not loaded
+#define GSV_MANIFEST_HEADER "# cstreetview manifest 2"
+#define GSV_MANIFEST_INITIAL_CAPACITY 1024
+
+struct gsvManifest_S {
+	gsvManifestEntry** entries;
+	int capacity;
+	int size;
+	pthread_mutex_t mutex;
+};
+
+/*
+ * Table
+ */
+
+static unsigned int gsv_manifest_hash(const char* panoramaId)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for(int i=0;i<GSV_PANORAMA_ID_LENGTH && panoramaId[i]!='\0';i++)
+		hash = (hash^(unsigned char)panoramaId[i])*16777619u;
+	return hash;
+}
+
+// The slot holding panoramaId, or the empty slot it would go in
+static int gsv_manifest_slot(const gsvManifest* manifest,const char* panoramaId)
+{
+	int slot = (int)(gsv_manifest_hash(panoramaId)&(manifest->capacity-1));
+	while(manifest->entries[slot] != NULL && strncmp(manifest->entries[slot]->panoramaId,panoramaId,GSV_PANORAMA_ID_LENGTH) != 0)
+		slot = (slot+1)&(manifest->capacity-1);
+	return slot;
+}
+
+static int gsv_manifest_grow(gsvManifest* manifest)
+{
+	gsvManifestEntry** entries = manifest->entries;
+	int capacity = manifest->capacity;
+
+	manifest->entries = (gsvManifestEntry**) calloc(capacity*2,sizeof(gsvManifestEntry*));
+	if(manifest->entries == NULL)
+	{
+		manifest->entries = entries;
+		return -1;
+	}
+	manifest->capacity = capacity*2;
+	for(int i=0;i<capacity;i++)
+	{
+		if(entries[i] != NULL)
+			manifest->entries[gsv_manifest_slot(manifest,entries[i]->panoramaId)] = entries[i];
+	}
+	free(entries);
+	return 0;
+}
+
+// Called with the mutex held, a new entry starts out empty apart from its id
+static gsvManifestEntry* gsv_manifest_upsert(gsvManifest* manifest,const char* panoramaId)
+{
+	int slot = gsv_manifest_slot(manifest,panoramaId);
+	if(manifest->entries[slot] != NULL)
+		return manifest->entries[slot];
+
+	// Kept at most half full so probe runs stay short
+	if((manifest->size+1)*2 > manifest->capacity)
+	{
+		if(gsv_manifest_grow(manifest) != 0)
+			return NULL;
+		slot = gsv_manifest_slot(manifest,panoramaId);
+	}
+
+	gsvManifestEntry* entry = (gsvManifestEntry*) calloc(1,sizeof(gsvManifestEntry));
+	if(entry == NULL)
+		return NULL;
+	snprintf(entry->panoramaId,sizeof(entry->panoramaId),"%s",panoramaId);
+	manifest->entries[slot] = entry;
+	manifest->size++;
+	return entry;
+}
+
+static int gsv_manifest_set_links(gsvManifestEntry* entry,int numLinks)
+{
+	char (*links)[GSV_PANORAMA_ID_LENGTH] = NULL;
+	if(numLinks > 0)
+	{
+		links = (char (*)[GSV_PANORAMA_ID_LENGTH]) realloc(entry->links,sizeof(*links)*numLinks);
+		if(links == NULL)
+			return -1;
+	}
+	else
+		free(entry->links);
+	entry->links = links;
+	entry->numLinks = numLinks;
+	return 0;
+}
+
+// Called with the mutex held
+static gsvChange gsv_manifest_record(gsvManifest* manifest,const GSV* panorama,const gsvValidators* validators)
+{
+	char imageDate[GSV_IMAGE_DATE_LENGTH];
+	gsv_image_date_format(panorama->dataProperties.imageDate,imageDate,sizeof(imageDate));
+	gsvManifestEntry* entry = manifest->entries[gsv_manifest_slot(manifest,panorama->dataProperties.panoramaId)];
+	gsvChange change = GSV_UNCHANGED;
+	if(entry == NULL)
+		change = GSV_NEW;
+	else if(entry->imageDate[0] == '\0' || strcmp(entry->imageDate,imageDate) != 0)
+		change = GSV_CHANGED;
+
+	entry = gsv_manifest_upsert(manifest,panorama->dataProperties.panoramaId);
+	if(entry == NULL)
+		return change;
+	memcpy(entry->imageDate,imageDate,sizeof(entry->imageDate));
+	memcpy(entry->etag,validators->etag,sizeof(entry->etag));
+	entry->lastModified = validators->lastModified;
+	if(gsv_manifest_set_links(entry,panorama->annotationProperties.numLinks) == 0)
+	{
+		for(int i=0;i<entry->numLinks;i++)
+			memcpy(entry->links[i],panorama->annotationProperties.links[i].panoramaId,GSV_PANORAMA_ID_LENGTH);
+	}
+	return change;
+}
+
+/*
+ * Files
+ */
+
+static int gsv_manifest_parse_line(gsvManifest* manifest,char* line)
+{
+	char* fields[5];
+	char* cursor = line;
+	for(int i=0;i<5;i++)
+	{
+		fields[i] = strsep(&cursor,"\t");
+		if(fields[i] == NULL || fields[i][0] == '\0')
+			return -1;
+	}
+	fields[4][strcspn(fields[4],"\r\n")] = '\0';
+	if(strlen(fields[0]) >= GSV_PANORAMA_ID_LENGTH || strlen(fields[1]) >= GSV_IMAGE_DATE_LENGTH || strlen(fields[3]) >= GSV_MAX_ETAG_LENGTH)
+		return -1;
+
+	gsvManifestEntry* entry = gsv_manifest_upsert(manifest,fields[0]);
+	if(entry == NULL)
+		return -1;
+	snprintf(entry->imageDate,sizeof(entry->imageDate),"%s",(strcmp(fields[1],"-") == 0) ? "" : fields[1]);
+	entry->lastModified = (time_t)strtoll(fields[2],NULL,10);
+	snprintf(entry->etag,sizeof(entry->etag),"%s",(strcmp(fields[3],"-") == 0) ? "" : fields[3]);
+
+	int numLinks = 0;
+	if(strcmp(fields[4],"-") != 0)
+	{
+		numLinks = 1;
+		for(const char* comma=strchr(fields[4],',');comma!=NULL;comma=strchr(comma+1,','))
+			numLinks++;
+	}
+	if(gsv_manifest_set_links(entry,numLinks) != 0)
+		return -1;
+	cursor = fields[4];
+	for(int i=0;i<numLinks;i++)
+		snprintf(entry->links[i],GSV_PANORAMA_ID_LENGTH,"%s",strsep(&cursor,","));
+	return 0;
+}
+
+/*
+ * Public methods
+ */
+
+gsvManifest* gsv_manifest_create()
+{
+	gsvManifest* manifest = (gsvManifest*) calloc(1,sizeof(gsvManifest));
+	if(manifest == NULL)
+		return NULL;
+	manifest->capacity = GSV_MANIFEST_INITIAL_CAPACITY;
+	manifest->entries = (gsvManifestEntry**) calloc(manifest->capacity,sizeof(gsvManifestEntry*));
+	if(manifest->entries == NULL)
+	{
+		free(manifest);
+		return NULL;
+	}
+	pthread_mutex_init(&manifest->mutex,NULL);
+	return manifest;
+}
+
+gsvManifest* gsv_manifest_load(const char* path)
+{
+	FILE* file = (path != NULL) ? fopen(path,"r") : NULL;
+	if(file == NULL)
+		return NULL;
+
+	gsvManifest* manifest = gsv_manifest_create();
+	char* line = NULL;
+	size_t lineSize = 0;
+	int valid = (manifest != NULL && getline(&line,&lineSize,file) > 0 && strncmp(line,GSV_MANIFEST_HEADER,strlen(GSV_MANIFEST_HEADER)) == 0);
+	while(valid && getline(&line,&lineSize,file) > 0)
+	{
+		if(line[0] != '\n')
+			valid = (gsv_manifest_parse_line(manifest,line) == 0);
+	}
+	free(line);
+	fclose(file);
+
+	if(valid == 0)
+		gsv_manifest_destroy(&manifest);
+	return manifest;
+}
+
+gsvStatus gsv_manifest_save(gsvManifest* manifest,const char* path)
+{
+	if(manifest == NULL || path == NULL)
+		return GSV_ERROR_INVALID;
+
+	size_t pathLength = strlen(path);
+	char* temporaryPath = (char*) malloc(pathLength+5);
+	if(temporaryPath == NULL)
+		return GSV_ERROR_MEMORY;
+	snprintf(temporaryPath,pathLength+5,"%s.tmp",path);
+
+	FILE* file = fopen(temporaryPath,"w");
+	if(file == NULL)
+	{
+		free(temporaryPath);
+		return GSV_ERROR_IO;
+	}
+
+	pthread_mutex_lock(&manifest->mutex);
+	fprintf(file,"%s\n",GSV_MANIFEST_HEADER);
+	for(int i=0;i<manifest->capacity;i++)
+	{
+		const gsvManifestEntry* entry = manifest->entries[i];
+		if(entry == NULL)
+			continue;
+		fprintf(file,"%s\t%s\t%lld\t%s\t",entry->panoramaId,(entry->imageDate[0] != '\0') ? entry->imageDate : "-",(long long)entry->lastModified,(entry->etag[0] != '\0') ? entry->etag : "-");
+		for(int j=0;j<entry->numLinks;j++)
+			fprintf(file,"%s%s",(j > 0) ? "," : "",entry->links[j]);
+		fprintf(file,"%s\n",(entry->numLinks == 0) ? "-" : "");
+	}
+	pthread_mutex_unlock(&manifest->mutex);
+
+	int failed = (ferror(file) != 0);
+	failed |= (fclose(file) != 0);
+	if(failed == 0)
+		failed = (rename(temporaryPath,path) != 0);
+	if(failed)
+		unlink(temporaryPath);
+	free(temporaryPath);
+	return failed ? GSV_ERROR_IO : GSV_OK;
+}
+
+void gsv_manifest_destroy(gsvManifest** manifest)
+{
+	if(manifest == NULL || *manifest == NULL)
+		return;
+
+	for(int i=0;i<(*manifest)->capacity;i++)
+	{
+		if((*manifest)->entries[i] != NULL)
+		{
+			free((*manifest)->entries[i]->links);
+			free((*manifest)->entries[i]);
+		}
+	}
+	free((*manifest)->entries);
+	pthread_mutex_destroy(&(*manifest)->mutex);
+	free(*manifest);
+	*manifest = NULL;
+}
+
+int gsv_manifest_size(gsvManifest* manifest)
+{
+	pthread_mutex_lock(&manifest->mutex);
+	int size = manifest->size;
+	pthread_mutex_unlock(&manifest->mutex);
+	return size;
+}
+
+const gsvManifestEntry* gsv_manifest_find(gsvManifest* manifest,const char* panoramaId)
+{
+	pthread_mutex_lock(&manifest->mutex);
+	const gsvManifestEntry* entry = manifest->entries[gsv_manifest_slot(manifest,panoramaId)];
+	pthread_mutex_unlock(&manifest->mutex);
+	return entry;
+}
+
+gsvStatus gsv_manifest_invalidate(gsvManifest* manifest,const char* panoramaId)
+{
+	if(manifest == NULL || panoramaId == NULL)
+		return GSV_ERROR_INVALID;
+	pthread_mutex_lock(&manifest->mutex);
+	gsvManifestEntry* entry = manifest->entries[gsv_manifest_slot(manifest,panoramaId)];
+	if(entry != NULL)
+	{
+		// The links stay, the crawl can still walk past it
+		entry->imageDate[0] = '\0';
+		entry->etag[0] = '\0';
+		entry->lastModified = 0;
+	}
+	pthread_mutex_unlock(&manifest->mutex);
+	return (entry != NULL) ? GSV_OK : GSV_ERROR_INVALID;
+}
+
+gsvStatus gsv_refresh(gsvManifest* manifest,const char* panoramaId,GSV** panorama,gsvChange* change)
+{
+	return gsv_refresh_many(manifest,&panoramaId,1,panorama,change,NULL);
+}
+
+gsvStatus gsv_refresh_many(gsvManifest* manifest,const char* const* panoramaIds,int numPanoramas,GSV** panoramas,gsvChange* changes,gsvStatus* statuses)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_refresh_many(%p,%p,%d)\n",manifest,panoramaIds,numPanoramas);
+#endif
+	if(numPanoramas < 0 || manifest == NULL || (numPanoramas > 0 && (panoramaIds == NULL || panoramas == NULL || changes == NULL)))
+		return GSV_ERROR_INVALID;
+	if(numPanoramas == 0)
+		return GSV_OK;
+
+	char (*urlStrings)[GSV_MAX_URL_LENGTH] = (char (*)[GSV_MAX_URL_LENGTH]) malloc(sizeof(*urlStrings)*numPanoramas);
+	const char** urls = (const char**) malloc(sizeof(const char*)*numPanoramas);
+	gsvValidators* validators = (gsvValidators*) malloc(sizeof(gsvValidators)*numPanoramas);
+	CURLBuffer* buffers = (CURLBuffer*) malloc(sizeof(CURLBuffer)*numPanoramas);
+	int* notModified = (int*) malloc(sizeof(int)*numPanoramas);
+	gsvStatus* itemStatuses = (statuses != NULL) ? statuses : (gsvStatus*) malloc(sizeof(gsvStatus)*numPanoramas);
+	gsvStatus status = GSV_OK;
+	if(urlStrings == NULL || urls == NULL || validators == NULL || buffers == NULL || notModified == NULL || itemStatuses == NULL)
+		status = GSV_ERROR_MEMORY;
+
+	if(status != GSV_OK)
+	{
+		free(urlStrings);
+		free(urls);
+		free(validators);
+		free(buffers);
+		free(notModified);
+		if(itemStatuses != statuses)
+			free(itemStatuses);
+		return status;
+	}
+
+	for(int i=0;i<numPanoramas;i++)
+	{
+		panoramas[i] = NULL;
+		changes[i] = GSV_UNCHANGED;
+		validators[i] = gsvValidatorsDefault;
+		buffers[i] = CURLBufferDefault;
+		notModified[i] = 0;
+		// Replaced by the batch, unless it could not start at all
+		itemStatuses[i] = GSV_ERROR_MEMORY;
+		urls[i] = NULL;
+		if(panoramaIds[i] == NULL)
+			continue;
+
+		gsv_metadata_url(panoramaIds[i],urlStrings[i],GSV_MAX_URL_LENGTH);
+		urls[i] = urlStrings[i];
+		pthread_mutex_lock(&manifest->mutex);
+		const gsvManifestEntry* entry = manifest->entries[gsv_manifest_slot(manifest,panoramaIds[i])];
+		if(entry != NULL)
+		{
+			memcpy(validators[i].etag,entry->etag,sizeof(validators[i].etag));
+			validators[i].lastModified = entry->lastModified;
+		}
+		pthread_mutex_unlock(&manifest->mutex);
+	}
+
+	gsv_revalidate_many(urls,numPanoramas,validators,buffers,notModified,itemStatuses);
+
+	// Parsed here rather than on the loop's workers, a 304 has nothing to parse
+	for(int i=0;i<numPanoramas;i++)
+	{
+		if(itemStatuses[i] != GSV_OK || notModified[i])
+			continue;
+
+		panoramas[i] = gsv_parse_buffer(&buffers[i]);
+		if(panoramas[i] == NULL)
+		{
+			itemStatuses[i] = GSV_ERROR_PARSE;
+			continue;
+		}
+		pthread_mutex_lock(&manifest->mutex);
+		changes[i] = gsv_manifest_record(manifest,panoramas[i],&validators[i]);
+		pthread_mutex_unlock(&manifest->mutex);
+	}
+
+	for(int i=0;i<numPanoramas && status==GSV_OK;i++)
+		status = itemStatuses[i];
+
+	free(urlStrings);
+	free(urls);
+	free(validators);
+	free(buffers);
+	free(notModified);
+	if(itemStatuses != statuses)
+		free(itemStatuses);
+	return status;
+}
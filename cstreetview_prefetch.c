@@ -0,0 +1,323 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "cstreetview_private.h"
+
+/*
+ * Response bodies keyed by URL, oldest first. The budget is small enough for a list scan.
+ */
+
+typedef struct gsvPrefetchEntry_S {
+	char url[GSV_MAX_URL_LENGTH];
+	CURLBuffer buffer;
+	int ready;
+	long long createdMs;
+	struct gsvPrefetchEntry_S* next;
+} gsvPrefetchEntry;
+
+static pthread_mutex_t gsvPrefetchMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gsvPrefetchArrived = PTHREAD_COND_INITIALIZER;
+static gsvPrefetchConfig gsvPrefetchSettings;
+static int gsvPrefetchEnabled = 0;
+static gsvLoop* gsvPrefetchLoop = NULL;
+static gsvPrefetchEntry* gsvPrefetchEntries = NULL;
+static size_t gsvPrefetchBytes = 0;
+static int gsvPrefetchInFlight = 0;
+static gsvPrefetchStats gsvPrefetchCounters;
+
+static long long gsv_prefetch_milliseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (long long)now.tv_sec*1000LL+now.tv_nsec/1000000;
+}
+
+static gsvPrefetchEntry* gsv_prefetch_find(const char* urlString,gsvPrefetchEntry** previous)
+{
+	gsvPrefetchEntry* last = NULL;
+	for(gsvPrefetchEntry* entry=gsvPrefetchEntries;entry!=NULL;entry=entry->next)
+	{
+		if(strcmp(entry->url,urlString) == 0)
+		{
+			if(previous != NULL)
+				*previous = last;
+			return entry;
+		}
+		last = entry;
+	}
+	return NULL;
+}
+
+static void gsv_prefetch_remove(gsvPrefetchEntry* entry,gsvPrefetchEntry* previous)
+{
+	if(previous != NULL)
+		previous->next = entry->next;
+	else
+		gsvPrefetchEntries = entry->next;
+	gsvPrefetchBytes -= entry->buffer.bufferSize;
+}
+
+// Drops expired responses, then the oldest until the byte budget holds. Called with the mutex held
+static void gsv_prefetch_evict()
+{
+	long long expiry = gsv_prefetch_milliseconds()-gsvPrefetchSettings.ttlMs;
+	gsvPrefetchEntry* previous = NULL;
+	gsvPrefetchEntry* entry = gsvPrefetchEntries;
+	while(entry != NULL)
+	{
+		gsvPrefetchEntry* next = entry->next;
+		if(entry->ready && (entry->createdMs < expiry || gsvPrefetchBytes > gsvPrefetchSettings.maxBytes))
+		{
+			gsv_prefetch_remove(entry,previous);
+			gsvPrefetchCounters.wasted++;
+			free(entry->buffer.buffer);
+			free(entry);
+		}
+		else
+			previous = entry;
+		entry = next;
+	}
+}
+
+static void gsv_prefetch_fetched(gsvStatus status,CURLBuffer* buffer,void* userData)
+{
+	gsvPrefetchEntry* entry = (gsvPrefetchEntry*)userData;
+
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	gsvPrefetchInFlight--;
+	if(status == GSV_OK)
+	{
+		entry->buffer = *buffer;
+		*buffer = CURLBufferDefault;
+		entry->ready = 1;
+		entry->createdMs = gsv_prefetch_milliseconds();
+		gsvPrefetchBytes += entry->buffer.bufferSize;
+		gsvPrefetchCounters.bytesFetched += entry->buffer.bufferSize;
+		gsv_prefetch_evict();
+	}
+	else
+	{
+		// A waiting gsv_fetch sees the entry gone and goes to the network itself
+		gsvPrefetchEntry* previous = NULL;
+		if(gsv_prefetch_find(entry->url,&previous) == entry)
+			gsv_prefetch_remove(entry,previous);
+		gsvPrefetchCounters.failed++;
+		free(entry);
+	}
+	pthread_cond_broadcast(&gsvPrefetchArrived);
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+}
+
+// Called with the mutex held
+static void gsv_prefetch_issue(const char* urlString)
+{
+	if(gsvPrefetchInFlight >= gsvPrefetchSettings.maxConcurrent || gsvPrefetchBytes >= gsvPrefetchSettings.maxBytes)
+	{
+		gsvPrefetchCounters.skipped++;
+		return;
+	}
+	if(gsv_prefetch_find(urlString,NULL) != NULL)
+		return;
+
+	gsvPrefetchEntry* entry = (gsvPrefetchEntry*) calloc(1,sizeof(gsvPrefetchEntry));
+	if(entry == NULL)
+		return;
+	snprintf(entry->url,sizeof(entry->url),"%s",urlString);
+	entry->buffer = CURLBufferDefault;
+
+	if(gsv_loop_fetch_async(gsvPrefetchLoop,entry->url,gsv_prefetch_fetched,entry) != GSV_OK)
+	{
+		free(entry);
+		return;
+	}
+	gsvPrefetchInFlight++;
+	gsvPrefetchCounters.issued++;
+
+	// Appended so the list stays oldest first for eviction
+	gsvPrefetchEntry** tail = &gsvPrefetchEntries;
+	while(*tail != NULL)
+		tail = &(*tail)->next;
+	*tail = entry;
+}
+
+// The horizon tiles facing the link, assuming the neighbour is oriented like this panorama
+static void gsv_prefetch_direction(const GSV* panorama,const gsvLink* link,int zoomLevel)
+{
+	const gsvDataProperties* data = &panorama->dataProperties;
+	int maxX = 1;
+	int maxY = 1;
+	gsv_tile_grid(zoomLevel,&maxX,&maxY);
+
+	// Zoom 5 is full resolution, each level below halves it. The centre column faces panoramaYaw
+	double columns = maxX;
+	double rows = maxY;
+	if(data->imageWidth > 0 && data->tileWidth > 0 && data->tileHeight > 0)
+	{
+		columns = (double)(data->imageWidth>>(5-zoomLevel))/data->tileWidth;
+		rows = (double)(data->imageHeight>>(5-zoomLevel))/data->tileHeight;
+	}
+	double facing = fmod((link->yaw-panorama->projectionProperties.panoramaYaw)/360.0+0.5+2.0,1.0);
+	int column = (int)(facing*columns);
+	int row = (int)(rows/2.0);
+	if(row >= maxY)
+		row = maxY-1;
+
+	char urlString[GSV_MAX_URL_LENGTH];
+	for(int offset=-1;offset<=1;offset++)
+	{
+		int x = (column+offset+maxX)%maxX;
+		gsv_tile_url(link->panoramaId,zoomLevel,x,row,urlString,sizeof(urlString));
+		gsv_prefetch_issue(urlString);
+	}
+}
+
+/*
+ * Library hooks
+ */
+
+void gsv_prefetch_links(const GSV* panorama)
+{
+	if(panorama == NULL || __atomic_load_n(&gsvPrefetchEnabled,__ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	if(gsvPrefetchEnabled)
+	{
+		gsv_prefetch_evict();
+
+		char urlString[GSV_MAX_URL_LENGTH];
+		// Metadata of every link first, it is what a step needs before anything else
+		for(int i=0;i<panorama->annotationProperties.numLinks;i++)
+		{
+			gsv_metadata_url(panorama->annotationProperties.links[i].panoramaId,urlString,sizeof(urlString));
+			gsv_prefetch_issue(urlString);
+		}
+		for(int i=0;i<panorama->annotationProperties.numLinks;i++)
+		{
+			const gsvLink* link = &panorama->annotationProperties.links[i];
+			if(gsvPrefetchSettings.linkZoom >= 0)
+			{
+				int maxX = 1;
+				int maxY = 1;
+				gsv_tile_grid(gsvPrefetchSettings.linkZoom,&maxX,&maxY);
+				for(int y=0;y<maxY;y++)
+				{
+					for(int x=0;x<maxX;x++)
+					{
+						gsv_tile_url(link->panoramaId,gsvPrefetchSettings.linkZoom,x,y,urlString,sizeof(urlString));
+						gsv_prefetch_issue(urlString);
+					}
+				}
+			}
+			if(gsvPrefetchSettings.directionZoom >= 0)
+				gsv_prefetch_direction(panorama,link,gsvPrefetchSettings.directionZoom);
+		}
+	}
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+}
+
+int gsv_prefetch_take(const char* urlString,CURLBuffer* buffer,int wait)
+{
+	if(__atomic_load_n(&gsvPrefetchEnabled,__ATOMIC_RELAXED) == 0)
+		return 0;
+
+	int hit = 0;
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	gsvPrefetchCounters.lookups++;
+	gsvPrefetchEntry* previous = NULL;
+	gsvPrefetchEntry* entry = gsv_prefetch_find(urlString,&previous);
+	while(wait && entry != NULL && entry->ready == 0)
+	{
+		pthread_cond_wait(&gsvPrefetchArrived,&gsvPrefetchMutex);
+		entry = gsv_prefetch_find(urlString,&previous);
+	}
+	if(entry != NULL && entry->ready)
+	{
+		gsv_prefetch_remove(entry,previous);
+		*buffer = entry->buffer;
+		gsvPrefetchCounters.hits++;
+		gsvPrefetchCounters.bytesUsed += entry->buffer.bufferSize;
+		free(entry);
+		hit = 1;
+	}
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+
+	return hit;
+}
+
+void gsv_prefetch_forget()
+{
+	// Like the batch loop, the loop and its entries are leaked, the list may be mid-update
+	pthread_mutex_init(&gsvPrefetchMutex,NULL);
+	pthread_cond_init(&gsvPrefetchArrived,NULL);
+	__atomic_store_n(&gsvPrefetchEnabled,0,__ATOMIC_RELAXED);
+	gsvPrefetchLoop = NULL;
+	gsvPrefetchEntries = NULL;
+	gsvPrefetchBytes = 0;
+	gsvPrefetchInFlight = 0;
+}
+
+/*
+ * Public methods
+ */
+
+void gsv_prefetch_enable(const gsvPrefetchConfig* config)
+{
+	gsvPrefetchConfig settings = (config != NULL) ? *config : gsvPrefetchConfigDefault;
+	if(settings.maxConcurrent <= 0)
+		settings.maxConcurrent = gsvPrefetchConfigDefault.maxConcurrent;
+	if(settings.linkZoom > 5)
+		settings.linkZoom = 5;
+	if(settings.directionZoom > 5)
+		settings.directionZoom = 5;
+
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	if(gsvPrefetchLoop == NULL)
+		gsvPrefetchLoop = gsv_loop_create(1,settings.maxConcurrent);
+	gsvPrefetchSettings = settings;
+	if(gsvPrefetchLoop != NULL)
+		__atomic_store_n(&gsvPrefetchEnabled,1,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+}
+
+void gsv_prefetch_disable()
+{
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	__atomic_store_n(&gsvPrefetchEnabled,0,__ATOMIC_RELAXED);
+	gsvLoop* loop = gsvPrefetchLoop;
+	gsvPrefetchLoop = NULL;
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+
+	// Cancelled transfers call back into gsv_prefetch_fetched, so the mutex can't be held here
+	gsv_loop_destroy(&loop);
+
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	while(gsvPrefetchEntries != NULL)
+	{
+		gsvPrefetchEntry* entry = gsvPrefetchEntries;
+		gsv_prefetch_remove(entry,NULL);
+		gsvPrefetchCounters.wasted++;
+		free(entry->buffer.buffer);
+		free(entry);
+	}
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+}
+
+void gsv_prefetch_stats(gsvPrefetchStats* stats)
+{
+	if(stats == NULL)
+		return;
+
+	pthread_mutex_lock(&gsvPrefetchMutex);
+	*stats = gsvPrefetchCounters;
+	pthread_mutex_unlock(&gsvPrefetchMutex);
+}
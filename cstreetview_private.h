@@ -0,0 +1,136 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef CSTREETVIEW_PRIVATE_H
+#define CSTREETVIEW_PRIVATE_H
+
+// Shared between the library's translation units, not part of the public API
+
+#include <curl/curl.h>
+#include "cstreetview.h"
+
+#ifndef MAX_DOUBLE_CHARACTERS
+#define MAX_DOUBLE_CHARACTERS (3 + DBL_MANT_DIG - DBL_MIN_EXP)
+#endif
+
+#define GSV_DEFAULT_SERVER "http://cbk0.google.com"
+#define GSV_MAX_SERVER_LENGTH 256
+#define GSV_MAX_URL_LENGTH (GSV_MAX_SERVER_LENGTH+256)
+
+// Comment these, or build with GSV_NO_STATS/GSV_NO_TRACE, to disable the timers or tracing
+#if !defined(GSV_STATS) && !defined(GSV_NO_STATS)
+#define GSV_STATS
+#endif
+#if !defined(GSV_TRACE) && !defined(GSV_NO_TRACE)
+#define GSV_TRACE
+#endif
+
+#ifdef GSV_WARNINGS
+#define GSV_WARNING(msg,error) if(error!=XML_NO_ERROR)printf("GSV Warning: %s - %s\n",msg,(error==XML_WRONG_ATTRIBUTE_TYPE)?"Wrong Attribute Type":"No Attribute");
+#else
+#define GSV_WARNING(msg,error) (void)(error);
+#endif
+
+#ifdef GSV_STATS
+#define GSV_STATS_BEGIN(timer) unsigned long long timer = gsv_stats_clock()
+#define GSV_STATS_END(stage,timer) if(timer!=0)gsv_stats_record(stage,gsv_stats_clock()-timer)
+#define GSV_STATS_TRANSFER(curl,result,bytes) gsv_stats_record_transfer(curl,result,bytes)
+#else
+#define GSV_STATS_BEGIN(timer)
+#define GSV_STATS_END(stage,timer)
+#define GSV_STATS_TRANSFER(curl,result,bytes)
+#endif
+
+// Spans are only formatted and recorded between gsv_trace_start and gsv_trace_stop
+#ifdef GSV_TRACE
+#define GSV_TRACE_BEGIN(timer) unsigned long long timer = gsv_trace_clock()
+#define GSV_TRACE_END(timer,name,category,...) if(timer!=0)gsv_trace_span(name,category,timer,gsv_trace_clock(),__VA_ARGS__)
+#else
+#define GSV_TRACE_BEGIN(timer)
+#define GSV_TRACE_END(timer,name,category,...)
+#endif
+
+typedef struct CURLBuffer_S {
+	void* buffer;
+	size_t bufferSize;
+} CURLBuffer;
+
+const CURLBuffer CURLBufferDefault = { NULL, 0 };
+
+// HTTP validators of a response, sent back to make the next fetch of the same url conditional
+typedef struct gsvValidators_S {
+	char etag[GSV_MAX_ETAG_LENGTH];
+	time_t lastModified;
+} gsvValidators;
+
+const gsvValidators gsvValidatorsDefault = { "\0", 0 };
+
+int gsvCURLToBuffer(void* data,size_t size,size_t nmemb,CURLBuffer* buffer);
+void gsv_curl_setup(CURL* curl,const char* urlString,CURLBuffer* buffer);
+CURLcode gsv_fetch(const char* urlString,CURLBuffer* buffer);
+// Sends whichever validators of sent are set, the response's go in received
+void gsv_curl_conditional(CURL* curl,const gsvValidators* sent,gsvValidators* received,struct curl_slist** headers);
+// After the transfer, non-zero when the server answered 304 or the body was no newer than sent
+int gsv_curl_not_modified(CURL* curl,gsvValidators* received);
+GSV* gsv_parse(char* xmlString);
+GSV* gsv_parse_buffer(CURLBuffer* buffer);
+// XML gsv_parse reads back, size includes the terminator
+char* gsv_serialize(const GSV* panorama,size_t* size);
+// imageDate as the web service's YYYY-MM, empty for 0
+void gsv_image_date_format(time_t imageDate,char* text,size_t textSize);
+
+void gsv_metadata_url(const char* panoramaId,char* urlString,size_t urlSize);
+void gsv_coordinate_url(double latitude,double longitude,char* urlString,size_t urlSize);
+void gsv_tile_url(const char* panoramaId,int zoomLevel,int x,int y,char* urlString,size_t urlSize);
+void gsv_tile_grid(int zoomLevel,int* maxX,int* maxY);
+
+CURLcode gsv_fetch_tile(GSV* panorama,int zoomLevel,int x,int y,CURLBuffer* buffer);
+
+// BGR out, _into writes the tile into panorama at left,top and returns 0
+IplImage* gsv_decode_tile(const void* jpegBuffer,size_t jpegSize);
+int gsv_decode_tile_into(IplImage* panoramaImage,int left,int top,const void* jpegBuffer,size_t jpegSize);
+
+// Takes ownership of the body by moving it out of buffer, it is freed otherwise
+typedef void (*gsvFetchCallback)(gsvStatus status,CURLBuffer* buffer,void* userData);
+gsvStatus gsv_loop_fetch_async(gsvLoop* loop,const char* urlString,gsvFetchCallback callback,void* userData);
+// Like gsvFetchCallback, buffer is empty when notModified is set
+typedef void (*gsvRevalidateCallback)(gsvStatus status,int notModified,CURLBuffer* buffer,const gsvValidators* validators,void* userData);
+gsvStatus gsv_loop_revalidate_async(gsvLoop* loop,const char* urlString,const gsvValidators* validators,gsvRevalidateCallback callback,void* userData);
+// Blocking, over the same shared loop as gsv_open_many. buffers[i] is left empty for a failed url
+gsvStatus gsv_fetch_many(const char* const* urlStrings,int numUrls,CURLBuffer* buffers,gsvStatus* statuses);
+// validators[i] is replaced by the response's unless notModified[i] is set
+gsvStatus gsv_revalidate_many(const char* const* urlStrings,int numUrls,gsvValidators* validators,CURLBuffer* buffers,int* notModified,gsvStatus* statuses);
+// The loop the batch calls share, created on first use. NULL after gsv_batch_loop_destroy
+gsvLoop* gsv_batch_loop();
+// Connections above a lowered cap are closed as they go idle
+void gsv_loop_set_connections(gsvLoop* loop,int maxConnections);
+// For gsv_global_cleanup, batches after it fail with GSV_ERROR_MEMORY
+void gsv_batch_loop_destroy();
+// For a forked child, the next batch creates a loop of its own
+void gsv_batch_loop_forget();
+
+// A whole BGR image as a JPEG of quality (1-100, 0 for 90)
+gsvStatus gsv_write_image(const IplImage* image,const char* path,int quality);
+// gsv_panorama_write to an open stream, which is left open
+gsvStatus gsv_panorama_encode(GSV* panorama,int zoomLevel,FILE* file,int quality);
+
+// Free what gsv_depth_map/gsv_pano_map decoded
+void gsv_depth_map_free(gsvDepthMap** depthMap);
+void gsv_pano_map_free(gsvPanoMap** panoMap);
+
+// Hands a prefetched body for urlString to buffer, wait blocks on one in flight
+void gsv_prefetch_links(const GSV* panorama);
+int gsv_prefetch_take(const char* urlString,CURLBuffer* buffer,int wait);
+// For a forked child, prefetching is off until it is enabled again
+void gsv_prefetch_forget();
+
+// Splits curl's own timings into the DNS/connect/first byte/transfer stages
+void gsv_stats_record_transfer(CURL* curl,CURLcode result,size_t bytes);
+
+#endif
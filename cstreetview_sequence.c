@@ -0,0 +1,595 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <math.h>
+#include <pthread.h>
+#include "cstreetview_private.h"
+
+/*
+ * A producer thread opens and fetches up to lookahead steps ahead, the caller's
+ * thread decodes them into a canvas and remaps the frames. Rays are traced once,
+ * each frame's maps are a horizontal shift of them.
+ */
+
+// One step of the route and the frames rendered at it
+typedef struct gsvSequenceStep_S {
+	GSV* panorama;
+	// Set on the last step at a panorama the sequence opened itself
+	int ownsPanorama;
+	// Tile grid covering the sphere at the sequence's zoom, and the sphere's extent on it in pixels
+	int columns;
+	int rows;
+	int tileWidth;
+	int tileHeight;
+	int numFrames;
+	double* headings;
+	CvMat** mapsX;
+	CvMat** mapsY;
+	// y*columns+x of each tile fetched for this step and its body, empty when it failed
+	int numTiles;
+	int* tiles;
+	CURLBuffer* buffers;
+	struct gsvSequenceStep_S* next;
+} gsvSequenceStep;
+
+typedef struct gsvSequence_S {
+	gsvSequenceConfig config;
+	GSV* start;
+	const double* yaws;
+	const double* latitudes;
+	const double* longitudes;
+	int numSteps;
+	// Per frame pixel, heading in turns from the view's centre and row in panorama heights
+	float* rayColumns;
+	float* rayRows;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	gsvSequenceStep* head;
+	gsvSequenceStep* tail;
+	int numQueued;
+	int finished;
+	int stopped;
+	gsvStatus status;
+} gsvSequence;
+
+static void gsv_sequence_fail(gsvSequence* sequence,gsvStatus status)
+{
+	pthread_mutex_lock(&sequence->mutex);
+	if(sequence->status == GSV_OK)
+		sequence->status = status;
+	pthread_mutex_unlock(&sequence->mutex);
+}
+
+/*
+ * Route
+ */
+
+// In (-180,180]
+static double gsv_sequence_turn(double from,double to)
+{
+	double turn = fmod(to-from,360.0);
+	if(turn > 180.0)
+		turn -= 360.0;
+	else if(turn <= -180.0)
+		turn += 360.0;
+	return turn;
+}
+
+// The route's yaw, or the initial great circle bearing towards its coordinate
+static double gsv_sequence_bearing(const gsvSequence* sequence,int step,const GSV* panorama)
+{
+	if(sequence->yaws != NULL)
+		return sequence->yaws[step];
+
+	double fromLatitude = panorama->dataProperties.latitude*M_PI/180.0;
+	double toLatitude = sequence->latitudes[step]*M_PI/180.0;
+	double longitudeDifference = (sequence->longitudes[step]-panorama->dataProperties.longitude)*M_PI/180.0;
+	double y = sin(longitudeDifference)*cos(toLatitude);
+	double x = cos(fromLatitude)*sin(toLatitude)-sin(fromLatitude)*cos(toLatitude)*cos(longitudeDifference);
+	return atan2(y,x)*180.0/M_PI;
+}
+
+// The link closest to bearing within 90 degrees, -1 for none
+static int gsv_sequence_link(const GSV* panorama,double bearing)
+{
+	int closest = -1;
+	double closestTurn = 90.0;
+	for(int i=0;i<panorama->annotationProperties.numLinks;i++)
+	{
+		double turn = fabs(gsv_sequence_turn(bearing,panorama->annotationProperties.links[i].yaw));
+		if(turn < closestTurn)
+		{
+			closest = i;
+			closestTurn = turn;
+		}
+	}
+	return closest;
+}
+
+/*
+ * Steps
+ */
+
+// Each zoom below 5 halves the resolution, gsv_tile_grid's columns can stop short
+static void gsv_sequence_geometry(const GSV* panorama,int zoomLevel,int* columns,int* rows,double* sphereWidth,double* sphereHeight)
+{
+	const gsvDataProperties* data = &panorama->dataProperties;
+	gsv_tile_grid(zoomLevel,columns,rows);
+	*sphereWidth = (double)*columns*data->tileWidth;
+	*sphereHeight = (double)*rows*data->tileHeight;
+	if(data->imageWidth > 0 && data->imageHeight > 0)
+	{
+		*sphereWidth = data->imageWidth>>(5-zoomLevel);
+		*sphereHeight = data->imageHeight>>(5-zoomLevel);
+		*columns = (data->imageWidth>>(5-zoomLevel))/data->tileWidth+(((data->imageWidth>>(5-zoomLevel))%data->tileWidth) != 0);
+		*rows = (data->imageHeight>>(5-zoomLevel))/data->tileHeight+(((data->imageHeight>>(5-zoomLevel))%data->tileHeight) != 0);
+	}
+}
+
+static void gsv_sequence_step_destroy(gsvSequenceStep* step)
+{
+	for(int i=0;i<step->numFrames;i++)
+	{
+		if(step->mapsX != NULL && step->mapsX[i] != NULL)
+			cvReleaseMat(&step->mapsX[i]);
+		if(step->mapsY != NULL && step->mapsY[i] != NULL)
+			cvReleaseMat(&step->mapsY[i]);
+	}
+	if(step->buffers != NULL)
+	{
+		for(int i=0;i<step->numTiles;i++)
+			free(step->buffers[i].buffer);
+	}
+	if(step->ownsPanorama)
+		gsv_close(&step->panorama);
+	free(step->headings);
+	free(step->mapsX);
+	free(step->mapsY);
+	free(step->tiles);
+	free(step->buffers);
+	free(step);
+}
+
+// Shifts the traced rays to heading, and marks every tile the bilinear remap reads in needed
+static void gsv_sequence_maps(const gsvSequence* sequence,const gsvSequenceStep* step,double sphereWidth,double sphereHeight,double heading,CvMat* mapX,CvMat* mapY,unsigned char* needed)
+{
+	const gsvSequenceConfig* config = &sequence->config;
+	float shift = (float)(gsv_sequence_turn(step->panorama->projectionProperties.panoramaYaw,heading)/360.0+0.5);
+	float width = (float)sphereWidth;
+	float height = (float)sphereHeight;
+	for(int y=0;y<config->height;y++)
+	{
+		float* rowX = (float*)(mapX->data.ptr+y*mapX->step);
+		float* rowY = (float*)(mapY->data.ptr+y*mapY->step);
+		const float* rayColumns = &sequence->rayColumns[(size_t)y*config->width];
+		const float* rayRows = &sequence->rayRows[(size_t)y*config->width];
+		for(int x=0;x<config->width;x++)
+		{
+			float u = rayColumns[x]+shift;
+			u -= floorf(u);
+			// Pixel centres, clamped so the wrap at the back of the panorama does not read outside it
+			rowX[x] = fminf(fmaxf(u*width-0.5f,0.0f),width-1.0f);
+			rowY[x] = fminf(fmaxf(rayRows[x]*height-0.5f,0.0f),height-1.0f);
+		}
+		for(int x=0;x<config->width;x++)
+		{
+			int left = (int)rowX[x];
+			int top = (int)rowY[x];
+			int right = (left+1 < width) ? left+1 : left;
+			int bottom = (top+1 < height) ? top+1 : top;
+			needed[(top/step->tileHeight)*step->columns+left/step->tileWidth] = 1;
+			needed[(top/step->tileHeight)*step->columns+right/step->tileWidth] = 1;
+			needed[(bottom/step->tileHeight)*step->columns+left/step->tileWidth] = 1;
+			needed[(bottom/step->tileHeight)*step->columns+right/step->tileWidth] = 1;
+		}
+	}
+}
+
+// Maps every frame of the step and fetches the tiles they need beyond fetched
+static gsvSequenceStep* gsv_sequence_step_create(gsvSequence* sequence,GSV* panorama,double heading,double nextHeading,unsigned char** fetched,int* numFetched)
+{
+	const gsvSequenceConfig* config = &sequence->config;
+	gsvSequenceStep* step = (gsvSequenceStep*) calloc(1,sizeof(gsvSequenceStep));
+	if(step == NULL)
+		return NULL;
+	step->panorama = panorama;
+	step->tileWidth = panorama->dataProperties.tileWidth;
+	step->tileHeight = panorama->dataProperties.tileHeight;
+	double sphereWidth = 0.0;
+	double sphereHeight = 0.0;
+	gsv_sequence_geometry(panorama,config->zoomLevel,&step->columns,&step->rows,&sphereWidth,&sphereHeight);
+	int numCells = step->columns*step->rows;
+	if(*fetched == NULL || *numFetched != numCells)
+	{
+		free(*fetched);
+		*fetched = (unsigned char*) calloc(numCells,1);
+		*numFetched = numCells;
+	}
+
+	step->numFrames = config->framesPerStep;
+	step->headings = (double*) malloc(sizeof(double)*step->numFrames);
+	step->mapsX = (CvMat**) calloc(step->numFrames,sizeof(CvMat*));
+	step->mapsY = (CvMat**) calloc(step->numFrames,sizeof(CvMat*));
+	unsigned char* needed = (unsigned char*) calloc(numCells,1);
+	step->tiles = (int*) malloc(sizeof(int)*numCells);
+	step->buffers = (CURLBuffer*) calloc(numCells,sizeof(CURLBuffer));
+	if(*fetched == NULL || step->headings == NULL || step->mapsX == NULL || step->mapsY == NULL || needed == NULL || step->tiles == NULL || step->buffers == NULL)
+	{
+		free(needed);
+		step->numFrames = 0;
+		gsv_sequence_step_destroy(step);
+		return NULL;
+	}
+
+	GSV_TRACE_BEGIN(mapTrace);
+	double turn = gsv_sequence_turn(heading,nextHeading);
+	for(int i=0;i<step->numFrames;i++)
+	{
+		step->headings[i] = fmod(heading+turn*i/step->numFrames+360.0,360.0);
+		step->mapsX[i] = cvCreateMat(config->height,config->width,CV_32FC1);
+		step->mapsY[i] = cvCreateMat(config->height,config->width,CV_32FC1);
+		if(step->mapsX[i] == NULL || step->mapsY[i] == NULL)
+		{
+			free(needed);
+			gsv_sequence_step_destroy(step);
+			return NULL;
+		}
+		gsv_sequence_maps(sequence,step,sphereWidth,sphereHeight,step->headings[i],step->mapsX[i],step->mapsY[i],needed);
+	}
+	GSV_TRACE_END(mapTrace,"map","sequence","%s",panorama->dataProperties.panoramaId);
+
+	for(int cell=0;cell<numCells;cell++)
+	{
+		if(needed[cell] && (*fetched)[cell] == 0)
+		{
+			step->tiles[step->numTiles++] = cell;
+			(*fetched)[cell] = 1;
+		}
+	}
+	free(needed);
+	if(step->numTiles == 0)
+		return step;
+
+	char (*urlStrings)[GSV_MAX_URL_LENGTH] = (char (*)[GSV_MAX_URL_LENGTH]) malloc(sizeof(*urlStrings)*step->numTiles);
+	const char** urls = (const char**) malloc(sizeof(const char*)*step->numTiles);
+	if(urlStrings == NULL || urls == NULL)
+	{
+		free(urlStrings);
+		free(urls);
+		gsv_sequence_fail(sequence,GSV_ERROR_MEMORY);
+		return step;
+	}
+	for(int i=0;i<step->numTiles;i++)
+	{
+		gsv_tile_url(panorama->dataProperties.panoramaId,config->zoomLevel,step->tiles[i]%step->columns,step->tiles[i]/step->columns,urlStrings[i],GSV_MAX_URL_LENGTH);
+		urls[i] = urlStrings[i];
+	}
+	GSV_TRACE_BEGIN(downloadTrace);
+	gsvStatus status = gsv_fetch_many(urls,step->numTiles,step->buffers,NULL);
+	GSV_TRACE_END(downloadTrace,"download","tile","%s z%d %d tiles",panorama->dataProperties.panoramaId,config->zoomLevel,step->numTiles);
+	if(status != GSV_OK)
+		gsv_sequence_fail(sequence,status);
+	free(urlStrings);
+	free(urls);
+	return step;
+}
+
+// Blocks while lookahead steps are waiting, 0 once the step is queued and -1 when the sequence was stopped
+static int gsv_sequence_push(gsvSequence* sequence,gsvSequenceStep* step)
+{
+	pthread_mutex_lock(&sequence->mutex);
+	while(sequence->numQueued >= sequence->config.lookahead && sequence->stopped == 0)
+		pthread_cond_wait(&sequence->changed,&sequence->mutex);
+	int stopped = sequence->stopped;
+	if(stopped == 0)
+	{
+		if(sequence->tail != NULL)
+			sequence->tail->next = step;
+		else
+			sequence->head = step;
+		sequence->tail = step;
+		sequence->numQueued++;
+		pthread_cond_broadcast(&sequence->changed);
+	}
+	pthread_mutex_unlock(&sequence->mutex);
+	return stopped ? -1 : 0;
+}
+
+// NULL once the producer has finished and everything it queued was taken
+static gsvSequenceStep* gsv_sequence_pop(gsvSequence* sequence)
+{
+	pthread_mutex_lock(&sequence->mutex);
+	while(sequence->head == NULL && sequence->finished == 0)
+		pthread_cond_wait(&sequence->changed,&sequence->mutex);
+	gsvSequenceStep* step = sequence->head;
+	if(step != NULL)
+	{
+		sequence->head = step->next;
+		if(sequence->head == NULL)
+			sequence->tail = NULL;
+		sequence->numQueued--;
+		pthread_cond_broadcast(&sequence->changed);
+	}
+	pthread_mutex_unlock(&sequence->mutex);
+	return step;
+}
+
+static void* gsv_sequence_produce(void* data)
+{
+	gsvSequence* sequence = (gsvSequence*)data;
+	gsv_trace_name_thread("sequence");
+	unsigned char* fetched = NULL;
+	int numFetched = 0;
+	// The panorama fetched was filled for, by id since a closed one's address can come back
+	char previousId[GSV_PANORAMA_ID_LENGTH] = "";
+
+	GSV* panorama = sequence->start;
+	// Whether panorama was opened here rather than handed in
+	int owned = 0;
+	double bearing = gsv_sequence_bearing(sequence,0,panorama);
+	int link = gsv_sequence_link(panorama,bearing);
+	double heading = (link >= 0) ? panorama->annotationProperties.links[link].yaw : bearing;
+	for(int i=0;i<sequence->numSteps;i++)
+	{
+		// The next step is resolved first, this step's frames turn towards its heading
+		GSV* next = NULL;
+		int nextLink = -1;
+		double nextHeading = heading;
+		if(i+1 < sequence->numSteps)
+		{
+			next = panorama;
+			if(link >= 0)
+			{
+				next = gsv_open(panorama->annotationProperties.links[link].panoramaId);
+				if(next == NULL)
+					gsv_sequence_fail(sequence,GSV_ERROR_NETWORK);
+				// Its tiles could not be laid out, the route ends at this step
+				else if(next->dataProperties.tileWidth <= 0 || next->dataProperties.tileHeight <= 0)
+				{
+					gsv_close(&next);
+					gsv_sequence_fail(sequence,GSV_ERROR_INVALID);
+				}
+			}
+			if(next != NULL)
+			{
+				double nextBearing = gsv_sequence_bearing(sequence,i+1,next);
+				nextLink = gsv_sequence_link(next,nextBearing);
+				nextHeading = (nextLink >= 0) ? next->annotationProperties.links[nextLink].yaw : nextBearing;
+			}
+		}
+
+		if(strncmp(panorama->dataProperties.panoramaId,previousId,GSV_PANORAMA_ID_LENGTH) != 0)
+		{
+			free(fetched);
+			fetched = NULL;
+			strncpy(previousId,panorama->dataProperties.panoramaId,GSV_PANORAMA_ID_LENGTH-1);
+			previousId[GSV_PANORAMA_ID_LENGTH-1] = '\0';
+		}
+		gsvSequenceStep* step = gsv_sequence_step_create(sequence,panorama,heading,nextHeading,&fetched,&numFetched);
+		int pushed = -1;
+		// Whether the step took over closing panorama, even if it is destroyed here
+		int handedOver = 0;
+		if(step != NULL)
+		{
+			step->ownsPanorama = owned && next != panorama;
+			handedOver = step->ownsPanorama;
+			pushed = gsv_sequence_push(sequence,step);
+			if(pushed != 0)
+				gsv_sequence_step_destroy(step);
+		}
+		else
+			gsv_sequence_fail(sequence,GSV_ERROR_MEMORY);
+
+		if(pushed != 0 || next == NULL)
+		{
+			if(next != NULL && next != panorama)
+				gsv_close(&next);
+			if(owned && handedOver == 0)
+				gsv_close(&panorama);
+			break;
+		}
+		if(next != panorama)
+			owned = 1;
+		panorama = next;
+		link = nextLink;
+		heading = nextHeading;
+	}
+
+	free(fetched);
+	pthread_mutex_lock(&sequence->mutex);
+	sequence->finished = 1;
+	pthread_cond_broadcast(&sequence->changed);
+	pthread_mutex_unlock(&sequence->mutex);
+	return NULL;
+}
+
+/*
+ * Rendering
+ */
+
+// The camera of gsv_depth_view facing the panorama's centre column, see gsvSequence
+static int gsv_sequence_trace(gsvSequence* sequence)
+{
+	const gsvSequenceConfig* config = &sequence->config;
+	size_t numPixels = (size_t)config->width*config->height;
+	sequence->rayColumns = (float*) malloc(sizeof(float)*numPixels);
+	sequence->rayRows = (float*) malloc(sizeof(float)*numPixels);
+	if(sequence->rayColumns == NULL || sequence->rayRows == NULL)
+		return -1;
+
+	double pitch = config->pitch*M_PI/180.0;
+	float forward[3] = { 0.0f, (float)cos(pitch), (float)sin(pitch) };
+	float up[3] = { 0.0f, (float)-sin(pitch), (float)cos(pitch) };
+	float focalLength = (float)((config->width/2.0)/tan(config->fieldOfView*M_PI/360.0));
+	for(int y=0;y<config->height;y++)
+	{
+		float offsetY = config->height/2.0f-(y+0.5f);
+		for(int x=0;x<config->width;x++)
+		{
+			float rayX = (x+0.5f)-config->width/2.0f;
+			float rayY = up[1]*offsetY+forward[1]*focalLength;
+			float rayZ = up[2]*offsetY+forward[2]*focalLength;
+			size_t pixel = (size_t)y*config->width+x;
+			sequence->rayColumns[pixel] = atan2f(rayX,rayY)/(float)(2.0*M_PI);
+			sequence->rayRows[pixel] = 0.5f-atan2f(rayZ,sqrtf(rayX*rayX+rayY*rayY))/(float)M_PI;
+		}
+	}
+	return 0;
+}
+
+static void gsv_canvas_clear(IplImage* canvas,int left,int top,int width,int height)
+{
+	for(int row=top;row<top+height;row++)
+		memset(&canvas->imageData[row*canvas->widthStep+left*3],0,width*3);
+}
+
+static gsvStatus gsv_sequence_run(gsvSequence* sequence,gsvFrameCallback callback,void* userData)
+{
+	const gsvSequenceConfig* config = &sequence->config;
+	if(gsv_sequence_trace(sequence) != 0)
+		return GSV_ERROR_MEMORY;
+	IplImage* frame = cvCreateImage(cvSize(config->width,config->height),IPL_DEPTH_8U,3);
+	if(frame == NULL)
+		return GSV_ERROR_MEMORY;
+
+	pthread_t producer;
+	if(pthread_create(&producer,NULL,gsv_sequence_produce,sequence) != 0)
+	{
+		cvReleaseImage(&frame);
+		return GSV_ERROR_MEMORY;
+	}
+
+	// Only ever holds what the producer fetched for the current panorama, it does not fetch a tile twice there
+	IplImage* canvas = NULL;
+	gsvStatus status = GSV_OK;
+	int frameNumber = 0;
+	int stopped = 0;
+	gsvSequenceStep* step = NULL;
+	while((step = gsv_sequence_pop(sequence)) != NULL)
+	{
+		int canvasWidth = step->columns*step->tileWidth;
+		int canvasHeight = step->rows*step->tileHeight;
+		if(stopped == 0 && (canvas == NULL || canvas->width != canvasWidth || canvas->height != canvasHeight))
+		{
+			if(canvas != NULL)
+				cvReleaseImage(&canvas);
+			canvas = cvCreateImage(cvSize(canvasWidth,canvasHeight),IPL_DEPTH_8U,3);
+			if(canvas == NULL)
+			{
+				status = GSV_ERROR_MEMORY;
+				stopped = 1;
+			}
+		}
+		if(stopped == 0)
+		{
+			GSV_TRACE_BEGIN(stepTrace);
+			for(int i=0;i<step->numTiles;i++)
+			{
+				int left = (step->tiles[i]%step->columns)*step->tileWidth;
+				int top = (step->tiles[i]/step->columns)*step->tileHeight;
+				if(step->buffers[i].buffer == NULL || gsv_decode_tile_into(canvas,left,top,step->buffers[i].buffer,step->buffers[i].bufferSize) != 0)
+				{
+					if(step->buffers[i].buffer != NULL && status == GSV_OK)
+						status = GSV_ERROR_DECODE;
+					gsv_canvas_clear(canvas,left,top,step->tileWidth,step->tileHeight);
+				}
+			}
+
+			for(int i=0;i<step->numFrames && stopped == 0;i++)
+			{
+				GSV_STATS_BEGIN(remapTimer);
+				cvRemap(canvas,frame,step->mapsX[i],step->mapsY[i],CV_INTER_LINEAR+CV_WARP_FILL_OUTLIERS,cvScalarAll(0));
+				GSV_STATS_END(GSV_STAGE_STITCH,remapTimer);
+				if(callback(frameNumber++,step->panorama,step->headings[i],frame,userData) != 0)
+					stopped = 1;
+			}
+			GSV_TRACE_END(stepTrace,"render","sequence","%s %d tiles",step->panorama->dataProperties.panoramaId,step->numTiles);
+		}
+		if(stopped)
+		{
+			pthread_mutex_lock(&sequence->mutex);
+			sequence->stopped = 1;
+			pthread_cond_broadcast(&sequence->changed);
+			pthread_mutex_unlock(&sequence->mutex);
+		}
+		gsv_sequence_step_destroy(step);
+	}
+	pthread_join(producer,NULL);
+
+	if(canvas != NULL)
+		cvReleaseImage(&canvas);
+	cvReleaseImage(&frame);
+	return (sequence->status != GSV_OK) ? sequence->status : status;
+}
+
+static gsvStatus gsv_sequence_route(GSV* start,const double* yaws,const double* latitudes,const double* longitudes,int numSteps,const gsvSequenceConfig* config,gsvFrameCallback callback,void* userData)
+{
+	gsvSequence sequence;
+	memset(&sequence,0,sizeof(sequence));
+	sequence.config = (config != NULL) ? *config : gsvSequenceConfigDefault;
+	if(sequence.config.framesPerStep <= 0)
+		sequence.config.framesPerStep = 1;
+	if(sequence.config.lookahead <= 0)
+		sequence.config.lookahead = 1;
+	if(start == NULL || callback == NULL || numSteps <= 0 || sequence.config.width <= 0 || sequence.config.height <= 0 || sequence.config.fieldOfView <= 0.0 || sequence.config.fieldOfView >= 180.0 || sequence.config.zoomLevel < 0 || sequence.config.zoomLevel > 5 || start->dataProperties.tileWidth <= 0 || start->dataProperties.tileHeight <= 0)
+		return GSV_ERROR_INVALID;
+
+	sequence.start = start;
+	sequence.yaws = yaws;
+	sequence.latitudes = latitudes;
+	sequence.longitudes = longitudes;
+	sequence.numSteps = numSteps;
+	sequence.status = GSV_OK;
+	pthread_mutex_init(&sequence.mutex,NULL);
+	pthread_cond_init(&sequence.changed,NULL);
+
+	GSV_TRACE_BEGIN(sequenceTrace);
+	gsvStatus status = gsv_sequence_run(&sequence,callback,userData);
+	GSV_TRACE_END(sequenceTrace,"sequence","sequence","%s %d steps",start->dataProperties.panoramaId,numSteps);
+
+	pthread_cond_destroy(&sequence.changed);
+	pthread_mutex_destroy(&sequence.mutex);
+	free(sequence.rayColumns);
+	free(sequence.rayRows);
+	return status;
+}
+
+/*
+ * Public methods
+ */
+
+gsvStatus gsv_sequence_render(GSV* start,const double* yaws,int numSteps,const gsvSequenceConfig* config,gsvFrameCallback callback,void* userData)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_sequence_render(%p,%p,%d,%p,%p,%p)\n",start,yaws,numSteps,config,callback,userData);
+#endif
+	if(yaws == NULL)
+		return GSV_ERROR_INVALID;
+	return gsv_sequence_route(start,yaws,NULL,NULL,numSteps,config,callback,userData);
+}
+
+gsvStatus gsv_sequence_render(GSV* start,const double* latitudes,const double* longitudes,int numSteps,const gsvSequenceConfig* config,gsvFrameCallback callback,void* userData)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_sequence_render(%p,%p,%p,%d,%p,%p,%p)\n",start,latitudes,longitudes,numSteps,config,callback,userData);
+#endif
+	if(latitudes == NULL || longitudes == NULL)
+		return GSV_ERROR_INVALID;
+	return gsv_sequence_route(start,NULL,latitudes,longitudes,numSteps,config,callback,userData);
+}
+
+int gsv_frame_write(int frameNumber,const GSV* panorama,double heading,IplImage* frame,void* userData)
+{
+	const char* pattern = (const char*)userData;
+	if(pattern == NULL)
+		return -1;
+	char path[4096];
+	snprintf(path,sizeof(path),pattern,frameNumber);
+	return (gsv_write_image(frame,path,0) == GSV_OK) ? 0 : -1;
+}
@@ -0,0 +1,647 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cstreetview_private.h"
+
+/*
+ * Panorama ids are placed on a consistent hash ring. Links another shard owns go
+ * through the spool,
+ *
+ * 	directory/inbox-<shard>/<from>-<sequence>.ids	one panorama id per line
+ * 	directory/status-<shard>			"busy|idle|done|failed sent received"
+ *
+ * both written under a dotted name and renamed into place.
+ */
+
+#define GSV_SHARD_DEFAULT_VIRTUAL_NODES 64
+#define GSV_SPOOL_BATCH_SIZE 64
+#define GSV_SHARD_OPEN_BATCH 16
+// Poll interval of an idle worker waiting on its inbox
+#define GSV_SHARD_IDLE_US 5000
+
+typedef enum gsvShardState_E {
+	GSV_SHARD_BUSY = 0,
+	GSV_SHARD_IDLE,
+	// Left after the crawl ended, its counts are final
+	GSV_SHARD_DONE,
+	GSV_SHARD_FAILED
+} gsvShardState;
+
+static const char* gsvShardStateNames[] = { "busy", "idle", "done", "failed" };
+
+typedef struct gsvRingNode_S {
+	unsigned int hash;
+	int shard;
+} gsvRingNode;
+
+struct gsvShardRing_S {
+	gsvRingNode* nodes;
+	int numNodes;
+	int numShards;
+};
+
+struct gsvSpool_S {
+	char* directory;
+	int shard;
+	int numShards;
+	// Ids waiting to be written, per destination shard
+	char (**outgoing)[GSV_PANORAMA_ID_LENGTH];
+	int* numOutgoing;
+	unsigned long long sequence;
+	// Batches written to other shards and read from this one's inbox
+	unsigned long long sent;
+	unsigned long long received;
+	// What was last published, so an unchanged status is not rewritten
+	int publishedState;
+	unsigned long long publishedSent;
+	unsigned long long publishedReceived;
+	// Totals from the previous quiescence look, valid only while every shard stayed idle
+	int lookValid;
+	unsigned long long lookSent;
+	unsigned long long lookReceived;
+};
+
+// Visited and queued ids of one worker
+typedef struct gsvIdSet_S {
+	char (*ids)[GSV_PANORAMA_ID_LENGTH];
+	int capacity;
+	int size;
+} gsvIdSet;
+
+/*
+ * Hashing
+ */
+
+static unsigned int gsv_shard_hash(const char* key)
+{
+	// FNV-1a with a final avalanche, plain FNV leaves the ring lopsided for ids that differ only at the end
+	unsigned int hash = 2166136261u;
+	for(const char* c=key;*c!='\0';c++)
+		hash = (hash^(unsigned char)*c)*16777619u;
+	hash ^= hash>>16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash>>13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash>>16;
+	return hash;
+}
+
+static int gsv_ring_compare(const void* a,const void* b)
+{
+	unsigned int hashA = ((const gsvRingNode*)a)->hash;
+	unsigned int hashB = ((const gsvRingNode*)b)->hash;
+	return (hashA > hashB)-(hashA < hashB);
+}
+
+/*
+ * Id sets
+ */
+
+static int gsv_id_set_slot(const gsvIdSet* set,const char* panoramaId)
+{
+	int slot = (int)(gsv_shard_hash(panoramaId)&(set->capacity-1));
+	while(set->ids[slot][0] != '\0' && strncmp(set->ids[slot],panoramaId,GSV_PANORAMA_ID_LENGTH) != 0)
+		slot = (slot+1)&(set->capacity-1);
+	return slot;
+}
+
+// 1 when panoramaId was added, 0 when it was already there, -1 when out of memory
+static int gsv_id_set_add(gsvIdSet* set,const char* panoramaId)
+{
+	if((set->size+1)*2 > set->capacity)
+	{
+		gsvIdSet grown = { NULL, (set->capacity > 0) ? set->capacity*2 : 256, 0 };
+		grown.ids = (char (*)[GSV_PANORAMA_ID_LENGTH]) calloc(grown.capacity,GSV_PANORAMA_ID_LENGTH);
+		if(grown.ids == NULL)
+			return -1;
+		for(int i=0;i<set->capacity;i++)
+		{
+			if(set->ids[i][0] != '\0')
+				memcpy(grown.ids[gsv_id_set_slot(&grown,set->ids[i])],set->ids[i],GSV_PANORAMA_ID_LENGTH);
+		}
+		grown.size = set->size;
+		free(set->ids);
+		*set = grown;
+	}
+
+	int slot = gsv_id_set_slot(set,panoramaId);
+	if(set->ids[slot][0] != '\0')
+		return 0;
+	snprintf(set->ids[slot],GSV_PANORAMA_ID_LENGTH,"%s",panoramaId);
+	set->size++;
+	return 1;
+}
+
+// A worker's breadth first queue, ids enter it at most once
+typedef struct gsvShardQueue_S {
+	gsvIdSet seen;
+	char (*ids)[GSV_PANORAMA_ID_LENGTH];
+	int head;
+	int tail;
+	int capacity;
+} gsvShardQueue;
+
+static gsvStatus gsv_shard_enqueue(gsvShardQueue* queue,const char* panoramaId)
+{
+	int added = gsv_id_set_add(&queue->seen,panoramaId);
+	if(added <= 0)
+		return (added == 0) ? GSV_OK : GSV_ERROR_MEMORY;
+
+	if(queue->tail == queue->capacity && queue->head > 0)
+	{
+		memmove(queue->ids,&queue->ids[queue->head],sizeof(*queue->ids)*(queue->tail-queue->head));
+		queue->tail -= queue->head;
+		queue->head = 0;
+	}
+	if(queue->tail == queue->capacity)
+	{
+		int capacity = (queue->capacity > 0) ? queue->capacity*2 : GSV_SPOOL_BATCH_SIZE;
+		char (*ids)[GSV_PANORAMA_ID_LENGTH] = (char (*)[GSV_PANORAMA_ID_LENGTH]) realloc(queue->ids,sizeof(*ids)*capacity);
+		if(ids == NULL)
+			return GSV_ERROR_MEMORY;
+		queue->ids = ids;
+		queue->capacity = capacity;
+	}
+	memcpy(queue->ids[queue->tail++],panoramaId,GSV_PANORAMA_ID_LENGTH);
+	return GSV_OK;
+}
+
+/*
+ * Spool files
+ */
+
+static char* gsv_spool_path(const gsvSpool* spool,const char* format,int shard,const char* name)
+{
+	size_t length = strlen(spool->directory)+strlen(format)+(name != NULL ? strlen(name) : 0)+32;
+	char* path = (char*) malloc(length);
+	if(path == NULL)
+		return NULL;
+	int used = snprintf(path,length,"%s/",spool->directory);
+	snprintf(&path[used],length-used,format,shard,name);
+	return path;
+}
+
+// Written under a dotted name in the same directory and renamed, readers never see part of a file
+static int gsv_spool_write_file(const char* directory,const char* name,const char* contents,size_t length)
+{
+	size_t pathLength = strlen(directory)+strlen(name)+3;
+	char* temporaryPath = (char*) malloc(pathLength);
+	char* path = (char*) malloc(pathLength);
+	if(temporaryPath == NULL || path == NULL)
+	{
+		free(temporaryPath);
+		free(path);
+		return -1;
+	}
+	snprintf(temporaryPath,pathLength,"%s/.%s",directory,name);
+	snprintf(path,pathLength,"%s/%s",directory,name);
+
+	FILE* file = fopen(temporaryPath,"w");
+	int failed = (file == NULL);
+	if(file != NULL)
+	{
+		failed |= (fwrite(contents,1,length,file) != length);
+		failed |= (fclose(file) != 0);
+	}
+	if(failed == 0)
+		failed = (rename(temporaryPath,path) != 0);
+	if(failed)
+		unlink(temporaryPath);
+	free(temporaryPath);
+	free(path);
+	return failed ? -1 : 0;
+}
+
+static int gsv_spool_write_status(const char* directory,int shard,gsvShardState state,unsigned long long sent,unsigned long long received)
+{
+	char name[32];
+	char status[64];
+	snprintf(name,sizeof(name),"status-%d",shard);
+	int length = snprintf(status,sizeof(status),"%s %llu %llu\n",gsvShardStateNames[state],sent,received);
+	return gsv_spool_write_file(directory,name,status,length);
+}
+
+static int gsv_spool_publish(gsvSpool* spool,gsvShardState state)
+{
+	if((int)state == spool->publishedState && spool->sent == spool->publishedSent && spool->received == spool->publishedReceived)
+		return 0;
+	if(gsv_spool_write_status(spool->directory,spool->shard,state,spool->sent,spool->received) != 0)
+		return -1;
+
+	spool->publishedState = state;
+	spool->publishedSent = spool->sent;
+	spool->publishedReceived = spool->received;
+	return 0;
+}
+
+static gsvStatus gsv_spool_flush_shard(gsvSpool* spool,int shard)
+{
+	int numIds = spool->numOutgoing[shard];
+	if(numIds == 0)
+		return GSV_OK;
+
+	// An id and newline per line, plus the terminator of the last one
+	char* contents = (char*) malloc((size_t)numIds*(GSV_PANORAMA_ID_LENGTH+1)+1);
+	if(contents == NULL)
+		return GSV_ERROR_MEMORY;
+	size_t length = 0;
+	for(int i=0;i<numIds;i++)
+		length += snprintf(&contents[length],GSV_PANORAMA_ID_LENGTH+1,"%s\n",spool->outgoing[shard][i]);
+
+	char* inbox = gsv_spool_path(spool,"inbox-%d",shard,NULL);
+	char name[64];
+	snprintf(name,sizeof(name),"%d-%llu.ids",spool->shard,spool->sequence++);
+	int failed = (inbox == NULL || gsv_spool_write_file(inbox,name,contents,length) != 0);
+	free(inbox);
+	free(contents);
+	if(failed)
+		return GSV_ERROR_IO;
+
+	spool->numOutgoing[shard] = 0;
+	spool->sent++;
+	return GSV_OK;
+}
+
+/*
+ * Public methods
+ */
+
+gsvShardRing* gsv_shard_ring_create(int numShards,int virtualNodes)
+{
+	if(numShards <= 0)
+		return NULL;
+	if(virtualNodes <= 0)
+		virtualNodes = GSV_SHARD_DEFAULT_VIRTUAL_NODES;
+
+	gsvShardRing* ring = (gsvShardRing*) malloc(sizeof(gsvShardRing));
+	if(ring == NULL)
+		return NULL;
+	ring->numShards = numShards;
+	ring->numNodes = numShards*virtualNodes;
+	ring->nodes = (gsvRingNode*) malloc(sizeof(gsvRingNode)*ring->numNodes);
+	if(ring->nodes == NULL)
+	{
+		free(ring);
+		return NULL;
+	}
+
+	for(int shard=0;shard<numShards;shard++)
+	{
+		for(int node=0;node<virtualNodes;node++)
+		{
+			char key[32];
+			snprintf(key,sizeof(key),"shard-%d#%d",shard,node);
+			ring->nodes[shard*virtualNodes+node].hash = gsv_shard_hash(key);
+			ring->nodes[shard*virtualNodes+node].shard = shard;
+		}
+	}
+	qsort(ring->nodes,ring->numNodes,sizeof(gsvRingNode),gsv_ring_compare);
+	return ring;
+}
+
+void gsv_shard_ring_destroy(gsvShardRing** ring)
+{
+	if(ring == NULL || *ring == NULL)
+		return;
+	free((*ring)->nodes);
+	free(*ring);
+	*ring = NULL;
+}
+
+int gsv_shard_of(const gsvShardRing* ring,const char* panoramaId)
+{
+	// The first node clockwise of the id's hash, wrapping past the top
+	unsigned int hash = gsv_shard_hash(panoramaId);
+	int low = 0;
+	int high = ring->numNodes;
+	while(low < high)
+	{
+		int middle = low+(high-low)/2;
+		if(ring->nodes[middle].hash < hash)
+			low = middle+1;
+		else
+			high = middle;
+	}
+	return ring->nodes[(low == ring->numNodes) ? 0 : low].shard;
+}
+
+gsvStatus gsv_spool_reset(const char* directory,int numShards)
+{
+	if(directory == NULL || numShards <= 0)
+		return GSV_ERROR_INVALID;
+	if(mkdir(directory,0755) != 0 && errno != EEXIST)
+		return GSV_ERROR_IO;
+
+	size_t pathLength = strlen(directory)+NAME_MAX+32;
+	char* path = (char*) malloc(pathLength);
+	if(path == NULL)
+		return GSV_ERROR_MEMORY;
+	gsvStatus status = GSV_OK;
+	for(int shard=0;shard<numShards && status==GSV_OK;shard++)
+	{
+		snprintf(path,pathLength,"%s/status-%d",directory,shard);
+		unlink(path);
+		snprintf(path,pathLength,"%s/inbox-%d",directory,shard);
+		if(mkdir(path,0755) != 0 && errno != EEXIST)
+		{
+			status = GSV_ERROR_IO;
+			break;
+		}
+
+		DIR* inbox = opendir(path);
+		if(inbox == NULL)
+		{
+			status = GSV_ERROR_IO;
+			break;
+		}
+		struct dirent* entry = NULL;
+		while((entry = readdir(inbox)) != NULL)
+		{
+			if(strcmp(entry->d_name,".") == 0 || strcmp(entry->d_name,"..") == 0)
+				continue;
+			char* file = (char*) malloc(pathLength+NAME_MAX+2);
+			if(file == NULL)
+				continue;
+			snprintf(file,pathLength+NAME_MAX+2,"%s/%s",path,entry->d_name);
+			unlink(file);
+			free(file);
+		}
+		closedir(inbox);
+	}
+	free(path);
+	return status;
+}
+
+gsvSpool* gsv_spool_open(const char* directory,int shard,int numShards)
+{
+	if(directory == NULL || shard < 0 || shard >= numShards)
+		return NULL;
+
+	gsvSpool* spool = (gsvSpool*) calloc(1,sizeof(gsvSpool));
+	if(spool == NULL)
+		return NULL;
+	spool->directory = strdup(directory);
+	spool->shard = shard;
+	spool->numShards = numShards;
+	spool->outgoing = (char (**)[GSV_PANORAMA_ID_LENGTH]) calloc(numShards,sizeof(*spool->outgoing));
+	spool->numOutgoing = (int*) calloc(numShards,sizeof(int));
+	spool->publishedState = -1;
+	int failed = (spool->directory == NULL || spool->outgoing == NULL || spool->numOutgoing == NULL);
+	for(int i=0;i<numShards && failed==0;i++)
+	{
+		spool->outgoing[i] = (char (*)[GSV_PANORAMA_ID_LENGTH]) malloc(sizeof(*spool->outgoing[i])*GSV_SPOOL_BATCH_SIZE);
+		failed = (spool->outgoing[i] == NULL);
+	}
+
+	char* inbox = failed ? NULL : gsv_spool_path(spool,"inbox-%d",shard,NULL);
+	if(inbox == NULL || (mkdir(inbox,0755) != 0 && errno != EEXIST) || gsv_spool_publish(spool,GSV_SHARD_BUSY) != 0)
+		failed = 1;
+	free(inbox);
+
+	if(failed)
+		gsv_spool_close(&spool);
+	return spool;
+}
+
+void gsv_spool_close(gsvSpool** spool)
+{
+	if(spool == NULL || *spool == NULL)
+		return;
+	if((*spool)->outgoing != NULL)
+	{
+		for(int i=0;i<(*spool)->numShards;i++)
+			free((*spool)->outgoing[i]);
+	}
+	free((*spool)->outgoing);
+	free((*spool)->numOutgoing);
+	free((*spool)->directory);
+	free(*spool);
+	*spool = NULL;
+}
+
+gsvStatus gsv_spool_send(gsvSpool* spool,int shard,const char* panoramaId)
+{
+	if(spool == NULL || shard < 0 || shard >= spool->numShards || panoramaId == NULL)
+		return GSV_ERROR_INVALID;
+
+	// A full batch whose flush failed before is retried here, the id is only taken once there is room for it
+	if(spool->numOutgoing[shard] == GSV_SPOOL_BATCH_SIZE)
+	{
+		gsvStatus status = gsv_spool_flush_shard(spool,shard);
+		if(status != GSV_OK)
+			return status;
+	}
+	snprintf(spool->outgoing[shard][spool->numOutgoing[shard]++],GSV_PANORAMA_ID_LENGTH,"%s",panoramaId);
+	if(spool->numOutgoing[shard] == GSV_SPOOL_BATCH_SIZE)
+		return gsv_spool_flush_shard(spool,shard);
+	return GSV_OK;
+}
+
+gsvStatus gsv_spool_flush(gsvSpool* spool)
+{
+	gsvStatus status = GSV_OK;
+	for(int shard=0;shard<spool->numShards;shard++)
+	{
+		gsvStatus shardStatus = gsv_spool_flush_shard(spool,shard);
+		if(status == GSV_OK)
+			status = shardStatus;
+	}
+	return status;
+}
+
+int gsv_spool_receive(gsvSpool* spool,char (**panoramaIds)[GSV_PANORAMA_ID_LENGTH])
+{
+	*panoramaIds = NULL;
+	char* inboxPath = gsv_spool_path(spool,"inbox-%d",spool->shard,NULL);
+	DIR* inbox = (inboxPath != NULL) ? opendir(inboxPath) : NULL;
+	if(inbox == NULL)
+	{
+		free(inboxPath);
+		return -1;
+	}
+
+	int numIds = 0;
+	int capacity = 0;
+	struct dirent* entry = NULL;
+	while((entry = readdir(inbox)) != NULL)
+	{
+		// Dotted names are still being written
+		if(entry->d_name[0] == '.')
+			continue;
+
+		size_t pathLength = strlen(inboxPath)+strlen(entry->d_name)+2;
+		char* path = (char*) malloc(pathLength);
+		if(path == NULL)
+			break;
+		snprintf(path,pathLength,"%s/%s",inboxPath,entry->d_name);
+		FILE* file = fopen(path,"r");
+		if(file == NULL)
+		{
+			free(path);
+			continue;
+		}
+
+		char line[GSV_PANORAMA_ID_LENGTH+2];
+		while(fgets(line,sizeof(line),file) != NULL)
+		{
+			line[strcspn(line,"\r\n")] = '\0';
+			if(line[0] == '\0')
+				continue;
+			if(numIds == capacity)
+			{
+				capacity = (capacity > 0) ? capacity*2 : GSV_SPOOL_BATCH_SIZE;
+				char (*grown)[GSV_PANORAMA_ID_LENGTH] = (char (*)[GSV_PANORAMA_ID_LENGTH]) realloc(*panoramaIds,sizeof(*grown)*capacity);
+				if(grown == NULL)
+					break;
+				*panoramaIds = grown;
+			}
+			snprintf((*panoramaIds)[numIds++],GSV_PANORAMA_ID_LENGTH,"%s",line);
+		}
+		fclose(file);
+		unlink(path);
+		free(path);
+		spool->received++;
+	}
+	closedir(inbox);
+	free(inboxPath);
+	return numIds;
+}
+
+int gsv_spool_quiescent(gsvSpool* spool,int idle)
+{
+	if(idle && gsv_spool_flush(spool) != GSV_OK)
+		idle = 0;
+	gsv_spool_publish(spool,idle ? GSV_SHARD_IDLE : GSV_SHARD_BUSY);
+
+	// Every status is read even while busy, a failed shard has to stop this one either way
+	int allIdle = idle;
+	int failed = 0;
+	unsigned long long totalSent = 0;
+	unsigned long long totalReceived = 0;
+	for(int shard=0;shard<spool->numShards && failed==0;shard++)
+	{
+		char* path = gsv_spool_path(spool,"status-%d",shard,NULL);
+		FILE* file = (path != NULL) ? fopen(path,"r") : NULL;
+		free(path);
+		char state[8] = "";
+		unsigned long long sent = 0;
+		unsigned long long received = 0;
+		// A shard that has not started yet has no status and holds everyone up
+		int read = (file != NULL && fscanf(file,"%7s %llu %llu",state,&sent,&received) == 3);
+		if(file != NULL)
+			fclose(file);
+		failed = (read && strcmp(state,gsvShardStateNames[GSV_SHARD_FAILED]) == 0);
+		allIdle &= (read && (strcmp(state,gsvShardStateNames[GSV_SHARD_IDLE]) == 0 || strcmp(state,gsvShardStateNames[GSV_SHARD_DONE]) == 0));
+		totalSent += sent;
+		totalReceived += received;
+	}
+	if(failed)
+		return -1;
+	if(allIdle == 0)
+	{
+		spool->lookValid = 0;
+		return 0;
+	}
+
+	int quiescent = (allIdle && totalSent == totalReceived && spool->lookValid && spool->lookSent == totalSent && spool->lookReceived == totalReceived);
+	spool->lookValid = allIdle;
+	spool->lookSent = totalSent;
+	spool->lookReceived = totalReceived;
+	return quiescent;
+}
+
+gsvStatus gsv_spool_abort(const char* directory,int shard)
+{
+	if(directory == NULL || shard < 0)
+		return GSV_ERROR_INVALID;
+	return (gsv_spool_write_status(directory,shard,GSV_SHARD_FAILED,0,0) == 0) ? GSV_OK : GSV_ERROR_IO;
+}
+
+gsvStatus gsv_shard_crawl(gsvSpool* spool,const gsvShardRing* ring,const char* seedPanoramaId,int maxCount,gsvShardCallback callback,void* userData,int* numCrawled)
+{
+	if(spool == NULL || ring == NULL || callback == NULL || ring->numShards != spool->numShards)
+		return GSV_ERROR_INVALID;
+
+	gsvShardQueue queue = { { NULL, 0, 0 }, NULL, 0, 0, 0 };
+	int crawled = 0;
+	gsvStatus status = GSV_OK;
+	// Every worker is handed the same seed, only its owner starts from it
+	if(seedPanoramaId != NULL && gsv_shard_of(ring,seedPanoramaId) == spool->shard)
+		status = gsv_shard_enqueue(&queue,seedPanoramaId);
+
+	while(status == GSV_OK)
+	{
+		char (*received)[GSV_PANORAMA_ID_LENGTH] = NULL;
+		int numReceived = gsv_spool_receive(spool,&received);
+		// Past the limit ids are still read so their senders' batches are accounted for
+		for(int i=0;i<numReceived && crawled<maxCount && status==GSV_OK;i++)
+			status = gsv_shard_enqueue(&queue,received[i]);
+		free(received);
+		if(status != GSV_OK)
+			break;
+
+		if(queue.head == queue.tail || crawled >= maxCount)
+		{
+			int quiescent = gsv_spool_quiescent(spool,1);
+			if(quiescent < 0)
+				status = GSV_ERROR_ABORTED;
+			if(quiescent != 0)
+				break;
+			usleep(GSV_SHARD_IDLE_US);
+			continue;
+		}
+		if(gsv_spool_quiescent(spool,0) < 0)
+		{
+			status = GSV_ERROR_ABORTED;
+			break;
+		}
+
+		int numOpened = queue.tail-queue.head;
+		if(numOpened > GSV_SHARD_OPEN_BATCH)
+			numOpened = GSV_SHARD_OPEN_BATCH;
+		if(numOpened > maxCount-crawled)
+			numOpened = maxCount-crawled;
+		const char* panoramaIds[GSV_SHARD_OPEN_BATCH];
+		GSV* panoramas[GSV_SHARD_OPEN_BATCH];
+		for(int i=0;i<numOpened;i++)
+			panoramaIds[i] = queue.ids[queue.head+i];
+		gsv_open_many(panoramaIds,numOpened,panoramas);
+		queue.head += numOpened;
+
+		for(int i=0;i<numOpened;i++)
+		{
+			if(panoramas[i] == NULL)
+				continue;
+			crawled++;
+			// This shard's links join its own queue, every other link goes to its owner
+			for(int j=0;j<panoramas[i]->annotationProperties.numLinks && status==GSV_OK;j++)
+			{
+				const char* linkPanoramaId = panoramas[i]->annotationProperties.links[j].panoramaId;
+				int owner = gsv_shard_of(ring,linkPanoramaId);
+				status = (owner == spool->shard) ? gsv_shard_enqueue(&queue,linkPanoramaId) : gsv_spool_send(spool,owner,linkPanoramaId);
+			}
+			callback(panoramas[i],userData);
+			gsv_close(&panoramas[i]);
+		}
+		if(status == GSV_OK)
+			status = gsv_spool_flush(spool);
+	}
+
+	// Terminal, so the other shards neither wait on this one nor carry on without it
+	gsv_spool_publish(spool,(status == GSV_OK) ? GSV_SHARD_DONE : GSV_SHARD_FAILED);
+	free(queue.seen.ids);
+	free(queue.ids);
+	if(numCrawled != NULL)
+		*numCrawled = crawled;
+	return status;
+}
@@ -0,0 +1,163 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <time.h>
+#include "cstreetview_private.h"
+
+/*
+ * Relaxed atomics, a sample is two clock reads and a few uncontended adds
+ */
+
+static gsvStats gsvStatsCounters;
+static int gsvStatsEnabled = 1;
+
+static const char* gsvStageNames[GSV_NUM_STAGES] = { "dns", "connect", "first_byte", "transfer", "parse", "decode", "stitch", "encode" };
+
+static inline unsigned long long gsv_stats_load(const unsigned long long* counter)
+{
+	return __atomic_load_n(counter,__ATOMIC_RELAXED);
+}
+
+static inline void gsv_stats_add(unsigned long long* counter,unsigned long long value)
+{
+	__atomic_fetch_add(counter,value,__ATOMIC_RELAXED);
+}
+
+/*
+ * Public methods
+ */
+
+void gsv_stats_enable(int enabled)
+{
+	__atomic_store_n(&gsvStatsEnabled,enabled,__ATOMIC_RELAXED);
+}
+
+void gsv_stats_reset()
+{
+	unsigned long long* counters = (unsigned long long*)&gsvStatsCounters;
+	for(size_t i=0;i<sizeof(gsvStats)/sizeof(unsigned long long);i++)
+		__atomic_store_n(&counters[i],0,__ATOMIC_RELAXED);
+}
+
+unsigned long long gsv_stats_clock()
+{
+	if(__atomic_load_n(&gsvStatsEnabled,__ATOMIC_RELAXED) == 0)
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (unsigned long long)now.tv_sec*1000000000ULL+now.tv_nsec;
+}
+
+void gsv_stats_record(gsvStage stage,unsigned long long nanoseconds)
+{
+	if(stage < 0 || stage >= GSV_NUM_STAGES || __atomic_load_n(&gsvStatsEnabled,__ATOMIC_RELAXED) == 0)
+		return;
+
+	gsvStageStats* stageStats = &gsvStatsCounters.stages[stage];
+
+	unsigned long long microseconds = nanoseconds/1000;
+	int bucket = (microseconds == 0) ? 0 : 64-__builtin_clzll(microseconds);
+	if(bucket >= GSV_STATS_BUCKETS)
+		bucket = GSV_STATS_BUCKETS-1;
+
+	gsv_stats_add(&stageStats->count,1);
+	gsv_stats_add(&stageStats->totalNanoseconds,nanoseconds);
+	gsv_stats_add(&stageStats->buckets[bucket],1);
+
+	unsigned long long maxNanoseconds = gsv_stats_load(&stageStats->maxNanoseconds);
+	while(nanoseconds > maxNanoseconds && !__atomic_compare_exchange_n(&stageStats->maxNanoseconds,&maxNanoseconds,nanoseconds,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+void gsv_stats_record_transfer(CURL* curl,CURLcode result,size_t bytes)
+{
+	if(__atomic_load_n(&gsvStatsEnabled,__ATOMIC_RELAXED) == 0)
+		return;
+
+	gsv_stats_add(&gsvStatsCounters.requests,1);
+	gsv_stats_add(&gsvStatsCounters.bytesDownloaded,bytes);
+	if(result != CURLE_OK)
+	{
+		gsv_stats_add(&gsvStatsCounters.failedRequests,1);
+		return;
+	}
+
+	// Each of these is cumulative from the start of the transfer, in microseconds
+	curl_off_t nameLookup = 0;
+	curl_off_t connect = 0;
+	curl_off_t startTransfer = 0;
+	curl_off_t total = 0;
+	curl_easy_getinfo(curl,CURLINFO_NAMELOOKUP_TIME_T,&nameLookup);
+	curl_easy_getinfo(curl,CURLINFO_CONNECT_TIME_T,&connect);
+	curl_easy_getinfo(curl,CURLINFO_STARTTRANSFER_TIME_T,&startTransfer);
+	curl_easy_getinfo(curl,CURLINFO_TOTAL_TIME_T,&total);
+
+	// A reused connection reports zero for the stages it skipped
+	if(connect < nameLookup)
+		connect = nameLookup;
+	if(startTransfer < connect)
+		startTransfer = connect;
+	if(total < startTransfer)
+		total = startTransfer;
+
+	gsv_stats_record(GSV_STAGE_DNS,nameLookup*1000ULL);
+	gsv_stats_record(GSV_STAGE_CONNECT,(connect-nameLookup)*1000ULL);
+	gsv_stats_record(GSV_STAGE_FIRST_BYTE,(startTransfer-connect)*1000ULL);
+	gsv_stats_record(GSV_STAGE_TRANSFER,(total-startTransfer)*1000ULL);
+}
+
+void gsv_stats_snapshot(gsvStats* stats)
+{
+	if(stats == NULL)
+		return;
+
+	const unsigned long long* counters = (const unsigned long long*)&gsvStatsCounters;
+	unsigned long long* snapshot = (unsigned long long*)stats;
+	for(size_t i=0;i<sizeof(gsvStats)/sizeof(unsigned long long);i++)
+		snapshot[i] = gsv_stats_load(&counters[i]);
+}
+
+const char* gsv_stage_name(gsvStage stage)
+{
+	if(stage < 0 || stage >= GSV_NUM_STAGES)
+		return "unknown";
+	return gsvStageNames[stage];
+}
+
+void gsv_stats_prometheus(const gsvStats* stats,FILE* output)
+{
+	if(stats == NULL || output == NULL)
+		return;
+
+	fprintf(output,"# HELP gsv_stage_seconds Time spent in each stage of fetching and assembling panoramas.\n");
+	fprintf(output,"# TYPE gsv_stage_seconds histogram\n");
+	for(int stage=0;stage<GSV_NUM_STAGES;stage++)
+	{
+		const gsvStageStats* stageStats = &stats->stages[stage];
+		unsigned long long cumulative = 0;
+		for(int bucket=0;bucket<GSV_STATS_BUCKETS-1;bucket++)
+		{
+			cumulative += stageStats->buckets[bucket];
+			fprintf(output,"gsv_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",gsvStageNames[stage],(double)(1ULL<<bucket)/1000000.0,cumulative);
+		}
+		fprintf(output,"gsv_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",gsvStageNames[stage],stageStats->count);
+		fprintf(output,"gsv_stage_seconds_sum{stage=\"%s\"} %.9f\n",gsvStageNames[stage],stageStats->totalNanoseconds/1000000000.0);
+		fprintf(output,"gsv_stage_seconds_count{stage=\"%s\"} %llu\n",gsvStageNames[stage],stageStats->count);
+	}
+
+	fprintf(output,"# HELP gsv_requests_total HTTP requests made to the web service.\n");
+	fprintf(output,"# TYPE gsv_requests_total counter\n");
+	fprintf(output,"gsv_requests_total %llu\n",stats->requests);
+	fprintf(output,"# HELP gsv_request_failures_total HTTP requests that failed or returned an error status.\n");
+	fprintf(output,"# TYPE gsv_request_failures_total counter\n");
+	fprintf(output,"gsv_request_failures_total %llu\n",stats->failedRequests);
+	fprintf(output,"# HELP gsv_downloaded_bytes_total Response bytes received from the web service.\n");
+	fprintf(output,"# TYPE gsv_downloaded_bytes_total counter\n");
+	fprintf(output,"gsv_downloaded_bytes_total %llu\n",stats->bytesDownloaded);
+}
@@ -0,0 +1,253 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <time.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "cstreetview_private.h"
+
+/*
+ * Each thread records into its own ring. Rings stay listed for the flush, and a
+ * finished thread's ring is reused by the next thread that records.
+ */
+
+#define GSV_TRACE_DETAIL_LENGTH 48
+#define GSV_TRACE_THREAD_NAME_LENGTH 32
+
+typedef struct gsvTraceEvent_S {
+	const char* name;
+	const char* category;
+	unsigned long long start;
+	unsigned long long end;
+	char detail[GSV_TRACE_DETAIL_LENGTH];
+} gsvTraceEvent;
+
+typedef struct gsvTraceRing_S {
+	gsvTraceEvent* events;
+	unsigned long long capacity;
+	// Total events ever written, the newest is at (head-1)%capacity
+	unsigned long long head;
+	// Events before first were written by a thread that had the ring before this one
+	unsigned long long first;
+	long threadId;
+	char threadName[GSV_TRACE_THREAD_NAME_LENGTH];
+	struct gsvTraceRing_S* next;
+	struct gsvTraceRing_S* nextFree;
+} gsvTraceRing;
+
+static gsvTraceRing* gsvTraceRings = NULL;
+static unsigned long long gsvTraceCapacity = 16384;
+static unsigned long long gsvTraceStart = 0;
+static int gsvTraceEnabled = 0;
+
+// Rings of finished threads, handed back by the key's destructor
+static pthread_once_t gsvTraceKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gsvTraceKey;
+static pthread_mutex_t gsvTraceFreeMutex = PTHREAD_MUTEX_INITIALIZER;
+static gsvTraceRing* gsvTraceFreeRings = NULL;
+
+static __thread gsvTraceRing* gsvTraceThreadRing = NULL;
+// Kept apart from the ring, naming a thread costs nothing while tracing is off
+static __thread char gsvTraceThreadName[GSV_TRACE_THREAD_NAME_LENGTH] = "";
+
+static unsigned long long gsv_trace_monotonic()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (unsigned long long)now.tv_sec*1000000000ULL+now.tv_nsec;
+}
+
+static void gsv_trace_ring_release(void* data)
+{
+	gsvTraceRing* ring = (gsvTraceRing*)data;
+	pthread_mutex_lock(&gsvTraceFreeMutex);
+	ring->nextFree = gsvTraceFreeRings;
+	gsvTraceFreeRings = ring;
+	pthread_mutex_unlock(&gsvTraceFreeMutex);
+}
+
+static void gsv_trace_key_create()
+{
+	pthread_key_create(&gsvTraceKey,gsv_trace_ring_release);
+}
+
+static gsvTraceRing* gsv_trace_thread_ring()
+{
+	if(gsvTraceThreadRing != NULL)
+		return gsvTraceThreadRing;
+	pthread_once(&gsvTraceKeyOnce,gsv_trace_key_create);
+
+	pthread_mutex_lock(&gsvTraceFreeMutex);
+	gsvTraceRing* ring = gsvTraceFreeRings;
+	if(ring != NULL)
+		gsvTraceFreeRings = ring->nextFree;
+	pthread_mutex_unlock(&gsvTraceFreeMutex);
+
+	if(ring != NULL)
+	{
+		// Already on the list, a flush drops the previous thread's events from here on
+		__atomic_store_n(&ring->first,__atomic_load_n(&ring->head,__ATOMIC_RELAXED),__ATOMIC_RELEASE);
+		__atomic_store_n(&ring->threadId,syscall(SYS_gettid),__ATOMIC_RELAXED);
+		snprintf(ring->threadName,sizeof(ring->threadName),"%s",gsvTraceThreadName);
+	}
+	else
+	{
+		ring = (gsvTraceRing*) calloc(1,sizeof(gsvTraceRing));
+		if(ring == NULL)
+			return NULL;
+		ring->capacity = __atomic_load_n(&gsvTraceCapacity,__ATOMIC_RELAXED);
+		ring->events = (gsvTraceEvent*) malloc(sizeof(gsvTraceEvent)*ring->capacity);
+		if(ring->events == NULL)
+		{
+			free(ring);
+			return NULL;
+		}
+		ring->threadId = syscall(SYS_gettid);
+		snprintf(ring->threadName,sizeof(ring->threadName),"%s",gsvTraceThreadName);
+
+		ring->next = __atomic_load_n(&gsvTraceRings,__ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&gsvTraceRings,&ring->next,ring,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+	}
+
+	pthread_setspecific(gsvTraceKey,ring);
+	gsvTraceThreadRing = ring;
+	return ring;
+}
+
+static void gsv_trace_json_string(FILE* output,const char* string)
+{
+	fputc('"',output);
+	for(const char* character=string;*character!='\0';character++)
+	{
+		if(*character == '"' || *character == '\\')
+			fputc('\\',output);
+		if((unsigned char)*character >= 0x20)
+			fputc(*character,output);
+	}
+	fputc('"',output);
+}
+
+/*
+ * Public methods
+ */
+
+void gsv_trace_start(int eventsPerThread)
+{
+	if(eventsPerThread > 0)
+		__atomic_store_n(&gsvTraceCapacity,(unsigned long long)eventsPerThread,__ATOMIC_RELAXED);
+	__atomic_store_n(&gsvTraceStart,gsv_trace_monotonic(),__ATOMIC_RELAXED);
+	__atomic_store_n(&gsvTraceEnabled,1,__ATOMIC_RELEASE);
+}
+
+void gsv_trace_stop()
+{
+	__atomic_store_n(&gsvTraceEnabled,0,__ATOMIC_RELEASE);
+}
+
+unsigned long long gsv_trace_clock()
+{
+	if(__atomic_load_n(&gsvTraceEnabled,__ATOMIC_RELAXED) == 0)
+		return 0;
+	return gsv_trace_monotonic();
+}
+
+void gsv_trace_name_thread(const char* name)
+{
+	if(name == NULL)
+		return;
+	snprintf(gsvTraceThreadName,sizeof(gsvTraceThreadName),"%s",name);
+	if(gsvTraceThreadRing != NULL)
+		snprintf(gsvTraceThreadRing->threadName,sizeof(gsvTraceThreadRing->threadName),"%s",name);
+}
+
+void gsv_trace_span(const char* name,const char* category,unsigned long long start,unsigned long long end,const char* format,...)
+{
+	if(start == 0 || __atomic_load_n(&gsvTraceEnabled,__ATOMIC_RELAXED) == 0)
+		return;
+
+	gsvTraceRing* ring = gsv_trace_thread_ring();
+	if(ring == NULL)
+		return;
+
+	unsigned long long head = __atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+	gsvTraceEvent* event = &ring->events[head%ring->capacity];
+	event->name = name;
+	event->category = category;
+	event->start = start;
+	event->end = (end < start) ? start : end;
+	event->detail[0] = '\0';
+	if(format != NULL)
+	{
+		va_list arguments;
+		va_start(arguments,format);
+		vsnprintf(event->detail,sizeof(event->detail),format,arguments);
+		va_end(arguments);
+	}
+	__atomic_store_n(&ring->head,head+1,__ATOMIC_RELEASE);
+}
+
+int gsv_trace_flush(const char* path)
+{
+	FILE* output = fopen(path,"w");
+	if(output == NULL)
+		return -1;
+
+	int processId = getpid();
+	unsigned long long traceStart = __atomic_load_n(&gsvTraceStart,__ATOMIC_RELAXED);
+	int first = 1;
+
+	fprintf(output,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for(gsvTraceRing* ring=__atomic_load_n(&gsvTraceRings,__ATOMIC_ACQUIRE);ring!=NULL;ring=ring->next)
+	{
+		long threadId = __atomic_load_n(&ring->threadId,__ATOMIC_RELAXED);
+		if(ring->threadName[0] != '\0')
+		{
+			fprintf(output,"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":",first ? "" : ",",processId,threadId);
+			gsv_trace_json_string(output,ring->threadName);
+			fprintf(output,"}}");
+			first = 0;
+		}
+
+		unsigned long long head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+		unsigned long long tail = (head > ring->capacity) ? head-ring->capacity : 0;
+		unsigned long long ringFirst = __atomic_load_n(&ring->first,__ATOMIC_ACQUIRE);
+		if(tail < ringFirst)
+			tail = ringFirst;
+		for(unsigned long long i=tail;i<head;i++)
+		{
+			gsvTraceEvent event = ring->events[i%ring->capacity];
+
+			// The owner may have lapped us while we copied, drop anything it could have overwritten
+			unsigned long long newHead = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+			if(newHead > ring->capacity && i < newHead-ring->capacity)
+				continue;
+			if(event.start < traceStart)
+				continue;
+
+			fprintf(output,"%s\n{\"name\":",first ? "" : ",");
+			gsv_trace_json_string(output,event.name);
+			fprintf(output,",\"cat\":");
+			gsv_trace_json_string(output,event.category);
+			fprintf(output,",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld",(event.start-traceStart)/1000.0,(event.end-event.start)/1000.0,processId,threadId);
+			if(event.detail[0] != '\0')
+			{
+				fprintf(output,",\"args\":{\"detail\":");
+				gsv_trace_json_string(output,event.detail);
+				fprintf(output,"}");
+			}
+			fprintf(output,"}");
+			first = 0;
+		}
+	}
+	fprintf(output,"\n]}\n");
+
+	return (fclose(output) == 0) ? 0 : -1;
+}
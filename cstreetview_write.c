@@ -0,0 +1,345 @@
+/*
+ Copyright (c) 2012 Will Sackfield
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cstreetview_private.h"
+// After the private header, jpeglib.h expects FILE to be declared
+#include <jpeglib.h>
+
+/*
+ * One tile row at a time, decoded into a strip that libjpeg compresses to the file
+ * while the next row downloads.
+ */
+
+#define GSV_WRITE_DEFAULT_QUALITY 90
+
+typedef struct gsvJPEGError_S {
+	struct jpeg_error_mgr manager;
+	jmp_buf jump;
+} gsvJPEGError;
+
+// libjpeg's default handler exits the process
+static void gsv_jpeg_error_exit(j_common_ptr info)
+{
+	longjmp(((gsvJPEGError*)info->err)->jump,1);
+}
+
+static void gsv_jpeg_output_message(j_common_ptr info)
+{
+#ifdef GSV_DEBUG
+	char message[JMSG_LENGTH_MAX];
+	(*info->err->format_message)(info,message);
+	printf("gsv_panorama_write: %s\n",message);
+#endif
+}
+
+// One tile row's compressed tiles, fetched over the batch loop while the previous row is encoded
+typedef struct gsvWriteRow_S {
+	GSV* panorama;
+	int zoomLevel;
+	int y;
+	int maxX;
+	char (*urlStrings)[GSV_MAX_URL_LENGTH];
+	CURLBuffer* buffers;
+	// The first tile that failed to download, set by the loop's workers
+	gsvStatus* statuses;
+	int remaining;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+	unsigned long long trace;
+} gsvWriteRow;
+
+typedef struct gsvWriteTile_S {
+	gsvWriteRow* row;
+	int x;
+} gsvWriteTile;
+
+static void gsv_write_tile_fetched(gsvStatus status,CURLBuffer* buffer,void* userData)
+{
+	gsvWriteTile* tile = (gsvWriteTile*)userData;
+	gsvWriteRow* row = tile->row;
+	row->buffers[tile->x] = *buffer;
+	*buffer = CURLBufferDefault;
+	row->statuses[tile->x] = status;
+	free(tile);
+
+	pthread_mutex_lock(&row->mutex);
+	if(--row->remaining == 0)
+		pthread_cond_signal(&row->done);
+	pthread_mutex_unlock(&row->mutex);
+}
+
+static int gsv_write_row_create(gsvWriteRow* row,GSV* panorama,int zoomLevel,int maxX)
+{
+	row->panorama = panorama;
+	row->zoomLevel = zoomLevel;
+	row->y = -1;
+	row->maxX = maxX;
+	row->remaining = 0;
+	row->trace = 0;
+	row->urlStrings = (char (*)[GSV_MAX_URL_LENGTH]) malloc(sizeof(*row->urlStrings)*maxX);
+	row->buffers = (CURLBuffer*) calloc(maxX,sizeof(CURLBuffer));
+	row->statuses = (gsvStatus*) malloc(sizeof(gsvStatus)*maxX);
+	pthread_mutex_init(&row->mutex,NULL);
+	pthread_cond_init(&row->done,NULL);
+	return (row->urlStrings != NULL && row->buffers != NULL && row->statuses != NULL) ? 0 : -1;
+}
+
+// Queues the row's tiles on the loop and returns straight away, the caller's thread is never blocked by it
+static void gsv_write_row_start(gsvWriteRow* row,gsvLoop* loop,int y)
+{
+	row->y = y;
+	row->remaining = row->maxX;
+	row->trace = gsv_trace_clock();
+	for(int x=0;x<row->maxX;x++)
+	{
+		gsv_tile_url(row->panorama->dataProperties.panoramaId,row->zoomLevel,x,y,row->urlStrings[x],GSV_MAX_URL_LENGTH);
+		row->statuses[x] = GSV_ERROR_MEMORY;
+		gsvWriteTile* tile = (gsvWriteTile*) malloc(sizeof(gsvWriteTile));
+		gsvStatus status = GSV_ERROR_MEMORY;
+		if(tile != NULL)
+		{
+			tile->row = row;
+			tile->x = x;
+			status = gsv_loop_fetch_async(loop,row->urlStrings[x],gsv_write_tile_fetched,tile);
+		}
+		if(status != GSV_OK)
+		{
+			free(tile);
+			row->statuses[x] = status;
+			pthread_mutex_lock(&row->mutex);
+			row->remaining--;
+			pthread_mutex_unlock(&row->mutex);
+		}
+	}
+}
+
+static void gsv_write_row_finish(gsvWriteRow* row)
+{
+	if(row->y < 0)
+		return;
+	pthread_mutex_lock(&row->mutex);
+	while(row->remaining > 0)
+		pthread_cond_wait(&row->done,&row->mutex);
+	pthread_mutex_unlock(&row->mutex);
+	GSV_TRACE_END(row->trace,"download","tile","%s z%d row %d",row->panorama->dataProperties.panoramaId,row->zoomLevel,row->y);
+	row->y = -1;
+}
+
+static void gsv_write_row_destroy(gsvWriteRow* row)
+{
+	gsv_write_row_finish(row);
+	if(row->buffers != NULL)
+	{
+		for(int x=0;x<row->maxX;x++)
+			free(row->buffers[x].buffer);
+	}
+	free(row->urlStrings);
+	free(row->buffers);
+	free(row->statuses);
+	pthread_mutex_destroy(&row->mutex);
+	pthread_cond_destroy(&row->done);
+}
+
+// Decodes a fetched row into strip, the first tile that failed to download or decode fails the row
+static gsvStatus gsv_write_fill_strip(gsvWriteRow* row,IplImage* strip)
+{
+	int tileWidth = row->panorama->dataProperties.tileWidth;
+	gsvStatus status = GSV_OK;
+	memset(strip->imageData,0,strip->imageSize);
+	for(int x=0;x<row->maxX;x++)
+	{
+		if(status == GSV_OK)
+			status = row->statuses[x];
+		if(status == GSV_OK && row->buffers[x].buffer == NULL)
+			status = GSV_ERROR_NETWORK;
+		if(status == GSV_OK && gsv_decode_tile_into(strip,x*tileWidth,0,row->buffers[x].buffer,row->buffers[x].bufferSize) != 0)
+			status = GSV_ERROR_DECODE;
+		free(row->buffers[x].buffer);
+		row->buffers[x] = CURLBufferDefault;
+	}
+	return status;
+}
+
+/*
+ * Private methods
+ */
+
+gsvStatus gsv_write_image(const IplImage* image,const char* path,int quality)
+{
+	if(image == NULL || path == NULL || image->nChannels != 3 || quality < 0 || quality > 100)
+		return GSV_ERROR_INVALID;
+	if(quality == 0)
+		quality = GSV_WRITE_DEFAULT_QUALITY;
+	FILE* file = fopen(path,"wb");
+	if(file == NULL)
+		return GSV_ERROR_IO;
+
+	GSV_STATS_BEGIN(encodeTimer);
+	struct jpeg_compress_struct compress;
+	gsvJPEGError error;
+	compress.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = gsv_jpeg_error_exit;
+	error.manager.output_message = gsv_jpeg_output_message;
+	if(setjmp(error.jump) != 0)
+	{
+		jpeg_destroy_compress(&compress);
+		fclose(file);
+		unlink(path);
+		return GSV_ERROR_IO;
+	}
+
+	jpeg_create_compress(&compress);
+	jpeg_stdio_dest(&compress,file);
+	compress.image_width = image->width;
+	compress.image_height = image->height;
+	compress.input_components = 3;
+	compress.in_color_space = JCS_EXT_BGR;
+	jpeg_set_defaults(&compress);
+	jpeg_set_quality(&compress,quality,TRUE);
+	jpeg_start_compress(&compress,TRUE);
+	while(compress.next_scanline < compress.image_height)
+	{
+		JSAMPROW scanline = (JSAMPROW)&image->imageData[compress.next_scanline*image->widthStep];
+		jpeg_write_scanlines(&compress,&scanline,1);
+	}
+	jpeg_finish_compress(&compress);
+	jpeg_destroy_compress(&compress);
+	GSV_STATS_END(GSV_STAGE_ENCODE,encodeTimer);
+
+	if(fclose(file) != 0)
+	{
+		unlink(path);
+		return GSV_ERROR_IO;
+	}
+	return GSV_OK;
+}
+
+gsvStatus gsv_panorama_encode(GSV* panorama,int zoomLevel,FILE* file,int quality)
+{
+	if(panorama == NULL || file == NULL || zoomLevel < 0 || zoomLevel > 5 || quality < 0 || quality > 100)
+		return GSV_ERROR_INVALID;
+	if(quality == 0)
+		quality = GSV_WRITE_DEFAULT_QUALITY;
+
+	int maxX = 1;
+	int maxY = 1;
+	gsv_tile_grid(zoomLevel,&maxX,&maxY);
+	int tileWidth = panorama->dataProperties.tileWidth;
+	int tileHeight = panorama->dataProperties.tileHeight;
+	if(tileWidth <= 0 || tileHeight <= 0)
+		return GSV_ERROR_INVALID;
+
+	gsvLoop* loop = gsv_batch_loop();
+	if(loop == NULL)
+		return GSV_ERROR_MEMORY;
+	IplImage* strip = cvCreateImage(cvSize(tileWidth*maxX,tileHeight),IPL_DEPTH_8U,3);
+	gsvWriteRow rows[2];
+	int rowsFailed = gsv_write_row_create(&rows[0],panorama,zoomLevel,maxX) | gsv_write_row_create(&rows[1],panorama,zoomLevel,maxX);
+	JSAMPROW* scanlines = (JSAMPROW*) malloc(sizeof(JSAMPROW)*tileHeight);
+	if(strip == NULL || rowsFailed != 0 || scanlines == NULL)
+	{
+		if(strip != NULL)
+			cvReleaseImage(&strip);
+		gsv_write_row_destroy(&rows[0]);
+		gsv_write_row_destroy(&rows[1]);
+		free(scanlines);
+		return GSV_ERROR_MEMORY;
+	}
+	for(int line=0;line<tileHeight;line++)
+		scanlines[line] = (JSAMPROW)&strip->imageData[line*strip->widthStep];
+
+	GSV_TRACE_BEGIN(panoramaTrace);
+	struct jpeg_compress_struct compress;
+	gsvJPEGError error;
+	compress.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = gsv_jpeg_error_exit;
+	error.manager.output_message = gsv_jpeg_output_message;
+	// Only the rows are read after a longjmp, and workers write them under their mutex
+	if(setjmp(error.jump) != 0)
+	{
+		jpeg_destroy_compress(&compress);
+		cvReleaseImage(&strip);
+		gsv_write_row_destroy(&rows[0]);
+		gsv_write_row_destroy(&rows[1]);
+		free(scanlines);
+		return GSV_ERROR_IO;
+	}
+
+	jpeg_create_compress(&compress);
+	jpeg_stdio_dest(&compress,file);
+	compress.image_width = tileWidth*maxX;
+	compress.image_height = tileHeight*maxY;
+	compress.input_components = 3;
+	compress.in_color_space = JCS_EXT_BGR;
+	jpeg_set_defaults(&compress);
+	jpeg_set_quality(&compress,quality,TRUE);
+	jpeg_start_compress(&compress,TRUE);
+
+	gsvStatus status = GSV_OK;
+	gsv_write_row_start(&rows[0],loop,0);
+	for(int y=0;y<maxY && status == GSV_OK;y++)
+	{
+		gsvWriteRow* row = &rows[y%2];
+		gsv_write_row_finish(row);
+		// The next row downloads while this one is decoded and compressed
+		if(y+1 < maxY)
+			gsv_write_row_start(&rows[(y+1)%2],loop,y+1);
+		status = gsv_write_fill_strip(row,strip);
+		if(status != GSV_OK)
+			break;
+
+		GSV_TRACE_BEGIN(encodeTrace);
+		GSV_STATS_BEGIN(encodeTimer);
+		JDIMENSION written = 0;
+		while(written < (JDIMENSION)tileHeight)
+			written += jpeg_write_scanlines(&compress,scanlines+written,tileHeight-written);
+		GSV_STATS_END(GSV_STAGE_ENCODE,encodeTimer);
+		GSV_TRACE_END(encodeTrace,"encode","panorama","%s row %d",panorama->dataProperties.panoramaId,y);
+	}
+
+	// A panorama with a missing tile is not written at all rather than with a hole in it
+	if(status == GSV_OK)
+		jpeg_finish_compress(&compress);
+	jpeg_destroy_compress(&compress);
+	GSV_TRACE_END(panoramaTrace,"panorama_write","panorama","%s z%d",panorama->dataProperties.panoramaId,zoomLevel);
+
+	cvReleaseImage(&strip);
+	gsv_write_row_destroy(&rows[0]);
+	gsv_write_row_destroy(&rows[1]);
+	free(scanlines);
+	if(status == GSV_OK && ferror(file))
+		status = GSV_ERROR_IO;
+	return status;
+}
+
+/*
+ * Public methods
+ */
+
+gsvStatus gsv_panorama_write(GSV* panorama,int zoomLevel,const char* path,int quality)
+{
+#ifdef GSV_DEBUG
+	printf("gsv_panorama_write(%p,%d,%s,%d)\n",panorama,zoomLevel,path,quality);
+#endif
+	if(panorama == NULL || path == NULL || zoomLevel < 0 || zoomLevel > 5 || quality < 0 || quality > 100)
+		return GSV_ERROR_INVALID;
+
+	FILE* file = fopen(path,"wb");
+	if(file == NULL)
+		return GSV_ERROR_IO;
+	gsvStatus status = gsv_panorama_encode(panorama,zoomLevel,file,quality);
+	if(fclose(file) != 0 && status == GSV_OK)
+		status = GSV_ERROR_IO;
+	if(status != GSV_OK)
+		unlink(path);
+	return status;
+}
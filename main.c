@@ -8,9 +8,31 @@
  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <sys/wait.h>
 #include "cstreetview.h"
 
-void breadthFirstSearch(double latitude,double longitude,const char* city,const char* country,int maxCount)
+// 1 for a near duplicate of a panorama already written, 0 leaves its fingerprint, -1 for none
+int isNearDuplicate(gsvDuplicateIndex* duplicates,GSV* panorama,gsvFingerprint* fingerprint)
+{
+	gsvFingerprint duplicate;
+	if(duplicates == NULL || gsv_fingerprint(panorama,fingerprint) != GSV_OK)
+		return -1;
+	if(gsv_duplicate_find(duplicates,fingerprint,&duplicate) == 0)
+		return 0;
+	
+	printf("Skipping %s, a near duplicate of %s\n",fingerprint->panoramaId,duplicate.panoramaId);
+	return 1;
+}
+
+// Only once the panorama is written, a failed one must not make its recaptures look like duplicates
+void indexWritten(gsvDuplicateIndex* duplicates,int duplicate,const gsvFingerprint* fingerprint,gsvStatus writeStatus)
+{
+	if(duplicate == 0 && writeStatus == GSV_OK)
+		gsv_duplicate_add(duplicates,fingerprint);
+}
+
+// With a manifest only new or changed panoramas are written, into archive when it is set
+void breadthFirstSearch(double latitude,double longitude,const char* city,const char* country,int maxCount,gsvManifest* manifest,gsvArchive* archive,gsvDuplicateIndex* duplicates)
 {
 	GSV* panorama = gsv_open(latitude,longitude);
 	if(panorama == NULL)
@@ -24,33 +46,78 @@ void breadthFirstSearch(double latitude,double longitude,const char* city,const
 	panoramaIds[0] = (char*) malloc(sizeof(char)*GSV_PANORAMA_ID_LENGTH);
 	memcpy(panoramaIds[0],panorama->dataProperties.panoramaId,sizeof(char)*GSV_PANORAMA_ID_LENGTH);
 	int numPanoramaIds = 1;
+	// When each id was queued, for the crawler's queue_wait spans
+	unsigned long long* queuedTimes = (unsigned long long*) malloc(sizeof(unsigned long long));
+	queuedTimes[0] = gsv_trace_clock();
 	
 	gsv_close(&panorama);
 	
-	while(maxCount > 0)
+	while(maxCount > 0 && numPanoramaIds > 0)
 	{
 		char** tmpPanoramaIds = panoramaIds;
+		unsigned long long* tmpQueuedTimes = queuedTimes;
 		int tmpNumPanoramaIds = numPanoramaIds;
 		
 		panoramaIds = NULL;
+		queuedTimes = NULL;
 		numPanoramaIds = 0;
 		
-		for(int i=0;i<tmpNumPanoramaIds;i++)
+		// The whole level is fetched at once, only as much of it as the remaining count can use
+		int numOpened = (tmpNumPanoramaIds < maxCount) ? tmpNumPanoramaIds : maxCount;
+		GSV** openedPanoramas = (GSV**) malloc(sizeof(GSV*)*numOpened);
+		gsvChange* changes = (gsvChange*) malloc(sizeof(gsvChange)*numOpened);
+		gsvStatus* statuses = (gsvStatus*) malloc(sizeof(gsvStatus)*numOpened);
+		for(int i=0;i<numOpened;i++)
+			gsv_trace_span("queue_wait","crawler",tmpQueuedTimes[i],gsv_trace_clock(),"%s",tmpPanoramaIds[i]);
+		if(manifest != NULL)
+			gsv_refresh_many(manifest,tmpPanoramaIds,numOpened,openedPanoramas,changes,statuses);
+		else
 		{
-			panorama = gsv_open(tmpPanoramaIds[i]);
-			free(tmpPanoramaIds[i]);
+			gsv_open_many(tmpPanoramaIds,numOpened,openedPanoramas,statuses);
+			for(int i=0;i<numOpened;i++)
+				changes[i] = GSV_NEW;
+		}
+		
+		for(int i=0;i<numOpened;i++)
+		{
+			if(statuses[i] != GSV_OK)
+				continue;
+			panorama = openedPanoramas[i];
+			const char* panoramaId = (panorama != NULL) ? panorama->dataProperties.panoramaId : tmpPanoramaIds[i];
 			
-			char panoramaFileName[GSV_PANORAMA_ID_LENGTH+1+2+1+64+4+1+3+1+18];
-			IplImage* panoramaImage = gsv_panorama(panorama,5);
-			snprintf(panoramaFileName,sizeof(panoramaFileName),"example_panoramas/%s-%s-%d-%s.jpg",country,city,100-maxCount,panorama->dataProperties.panoramaId);
-			cvSaveImage(panoramaFileName,panoramaImage);
-			cvReleaseImage(&panoramaImage);
-			memcpy(completedPanoramaIds[numberCompleted],panorama->dataProperties.panoramaId,sizeof(char)*GSV_PANORAMA_ID_LENGTH);
+			gsvFingerprint fingerprint;
+			int duplicate = (changes[i] != GSV_UNCHANGED) ? isNearDuplicate(duplicates,panorama,&fingerprint) : 1;
+			int write = (duplicate != 1);
+			gsvStatus writeStatus = GSV_OK;
+			if(write && archive != NULL)
+			{
+				writeStatus = gsv_archive_append_panorama(archive,panorama,5,0);
+				if(writeStatus != GSV_OK)
+					printf("Unable to archive %s: %s\n",panoramaId,gsv_status_name(writeStatus));
+			}
+			else if(write)
+			{
+				char panoramaFileName[GSV_PANORAMA_ID_LENGTH+1+2+1+64+4+1+3+1+18];
+				snprintf(panoramaFileName,sizeof(panoramaFileName),"example_panoramas/%s-%s-%d-%s.jpg",country,city,100-maxCount,panoramaId);
+				// Streamed a tile row at a time, the full zoom 5 image is never held in memory
+				writeStatus = gsv_panorama_write(panorama,5,panoramaFileName,0);
+				if(writeStatus != GSV_OK)
+					printf("Unable to write %s: %s\n",panoramaFileName,gsv_status_name(writeStatus));
+			}
+			// Otherwise the next recrawl would take it for unchanged and never write it
+			if(writeStatus != GSV_OK && manifest != NULL)
+				gsv_manifest_invalidate(manifest,panoramaId);
+			if(write)
+				indexWritten(duplicates,duplicate,&fingerprint,writeStatus);
+			memcpy(completedPanoramaIds[numberCompleted],panoramaId,sizeof(char)*GSV_PANORAMA_ID_LENGTH);
 			numberCompleted++;
 			
-			for(int i=0;i<panorama->annotationProperties.numLinks;i++)
+			// A 304 leaves no panorama, its links come from the manifest instead
+			const gsvManifestEntry* entry = (panorama == NULL) ? gsv_manifest_find(manifest,panoramaId) : NULL;
+			int numLinks = (panorama != NULL) ? panorama->annotationProperties.numLinks : (entry != NULL) ? entry->numLinks : 0;
+			for(int i=0;i<numLinks;i++)
 			{
-				char* linkPanoramaId = panorama->annotationProperties.links[i].panoramaId;
+				const char* linkPanoramaId = (panorama != NULL) ? panorama->annotationProperties.links[i].panoramaId : entry->links[i];
 				int found=0;
 				for(int j=0;j<numberCompleted;j++)
 				{
@@ -63,32 +130,281 @@ void breadthFirstSearch(double latitude,double longitude,const char* city,const
 				if(found == 0)
 				{
 					numPanoramaIds++;
-					char* panoramaId = (char*) malloc(sizeof(char)*GSV_PANORAMA_ID_LENGTH);
-					memcpy(panoramaId,panorama->annotationProperties.links[i].panoramaId,sizeof(char)*GSV_PANORAMA_ID_LENGTH);
+					char* linkCopy = (char*) malloc(sizeof(char)*GSV_PANORAMA_ID_LENGTH);
+					memcpy(linkCopy,linkPanoramaId,sizeof(char)*GSV_PANORAMA_ID_LENGTH);
 					panoramaIds = (char**) realloc(panoramaIds,sizeof(char*)*numPanoramaIds);
-					panoramaIds[numPanoramaIds-1] = panoramaId;
+					panoramaIds[numPanoramaIds-1] = linkCopy;
+					queuedTimes = (unsigned long long*) realloc(queuedTimes,sizeof(unsigned long long)*numPanoramaIds);
+					queuedTimes[numPanoramaIds-1] = gsv_trace_clock();
 				}
 			}
 			
 			gsv_close(&panorama);
-			
-			if(--maxCount == 0)
-				break;
+			maxCount--;
 		}
 		
+		for(int i=0;i<tmpNumPanoramaIds;i++)
+			free(tmpPanoramaIds[i]);
 		free(tmpPanoramaIds);
+		free(tmpQueuedTimes);
+		free(openedPanoramas);
+		free(changes);
+		free(statuses);
 	}
+	
+	for(int i=0;i<numPanoramaIds;i++)
+		free(panoramaIds[i]);
+	free(panoramaIds);
+	free(queuedTimes);
+}
+
+typedef struct shardOutput_S {
+	const char* city;
+	const char* country;
+	int shard;
+	int numberWritten;
+	gsvArchive* archive;
+	gsvDuplicateIndex* duplicates;
+} shardOutput;
+
+void writeShardPanorama(GSV* panorama,void* userData)
+{
+	shardOutput* output = (shardOutput*)userData;
+	gsvFingerprint fingerprint;
+	int duplicate = isNearDuplicate(output->duplicates,panorama,&fingerprint);
+	if(duplicate == 1)
+		return;
+	gsvStatus status = GSV_OK;
+	if(output->archive != NULL)
+	{
+		status = gsv_archive_append_panorama(output->archive,panorama,5,0);
+		if(status != GSV_OK)
+			printf("Unable to archive %s: %s\n",panorama->dataProperties.panoramaId,gsv_status_name(status));
+	}
+	else
+	{
+		char panoramaFileName[GSV_PANORAMA_ID_LENGTH+1+2+1+64+4+1+3+1+18+12];
+		snprintf(panoramaFileName,sizeof(panoramaFileName),"example_panoramas/%s-%s-s%d-%d-%s.jpg",output->country,output->city,output->shard,output->numberWritten++,panorama->dataProperties.panoramaId);
+		status = gsv_panorama_write(panorama,5,panoramaFileName,0);
+		if(status != GSV_OK)
+			printf("Unable to write %s: %s\n",panoramaFileName,gsv_status_name(status));
+	}
+	indexWritten(output->duplicates,duplicate,&fingerprint,status);
+}
+
+// Near duplicates are only found among the shard's own panoramas
+gsvStatus shardedCrawl(const char* seedPanoramaId,const char* city,const char* country,int maxCount,int shard,int numShards,const char* spoolDirectory,gsvArchive* archive,gsvDuplicateIndex* duplicates)
+{
+	gsvShardRing* ring = gsv_shard_ring_create(numShards,0);
+	gsvSpool* spool = gsv_spool_open(spoolDirectory,shard,numShards);
+	if(ring == NULL || spool == NULL)
+	{
+		printf("Unable to open shard %d of %d in %s\n",shard,numShards,spoolDirectory);
+		gsv_shard_ring_destroy(&ring);
+		gsv_spool_close(&spool);
+		gsv_spool_abort(spoolDirectory,shard);
+		return GSV_ERROR_IO;
+	}
+	
+	shardOutput output = { city, country, shard, 0, archive, duplicates };
+	int numberCrawled = 0;
+	gsvStatus status = gsv_shard_crawl(spool,ring,seedPanoramaId,maxCount,writeShardPanorama,&output,&numberCrawled);
+	printf("Shard %d of %d: %d panoramas (%s)\n",shard,numShards,numberCrawled,gsv_status_name(status));
+	
+	gsv_spool_close(&spool);
+	gsv_shard_ring_destroy(&ring);
+	return status;
 }
 
 int main(int argc,char* argv[])
 {
-	if(argc != 5)
+	const char* tracePath = NULL;
+	const char* manifestPath = NULL;
+	const char* archivePath = NULL;
+	const char* spoolDirectory = "example_spool";
+	int numShards = 0;
+	int shard = -1;
+	int prefetch = 0;
+	int dedupe = 0;
+	int connections = 0;
+	int validArguments = (argc >= 5);
+	
+	for(int i=5;i<argc && validArguments;i++)
+	{
+		if(strcmp(argv[i],"--trace") == 0 && i+1 < argc)
+			tracePath = argv[++i];
+		else if(strcmp(argv[i],"--prefetch") == 0)
+			prefetch = 1;
+		else if(strcmp(argv[i],"--dedupe") == 0)
+			dedupe = 1;
+		else if(strcmp(argv[i],"--manifest") == 0 && i+1 < argc)
+			manifestPath = argv[++i];
+		else if(strcmp(argv[i],"--shards") == 0 && i+1 < argc)
+			numShards = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--shard") == 0 && i+1 < argc)
+			shard = atoi(argv[++i]);
+		else if(strcmp(argv[i],"--spool") == 0 && i+1 < argc)
+			spoolDirectory = argv[++i];
+		else if(strcmp(argv[i],"--archive") == 0 && i+1 < argc)
+			archivePath = argv[++i];
+		else if(strcmp(argv[i],"--connections") == 0 && i+1 < argc)
+			connections = atoi(argv[++i]);
+		else
+			validArguments = 0;
+	}
+	if(numShards < 0 || shard >= numShards || (shard >= 0 && numShards == 0) || (numShards > 0 && manifestPath != NULL) || connections < 0)
+		validArguments = 0;
+	
+	if(validArguments == 0)
 	{
-		printf("Invalid arguments: example [latitude] [longitude] [city] [country]\n");
+		printf("Invalid arguments: example [latitude] [longitude] [city] [country] [--trace file.json] [--prefetch] [--dedupe] [--archive file] [--connections n] [--manifest file | --shards n [--shard i] [--spool directory]]\n");
 		return EXIT_FAILURE;
 	}
 	
-	breadthFirstSearch(atof(argv[1]),atof(argv[2]),argv[3],argv[4],100);
+	if(gsv_global_init() != GSV_OK)
+	{
+		printf("Unable to initialise curl\n");
+		return EXIT_FAILURE;
+	}
+	gsv_set_batch_connections(connections);
+	
+	// Every shard starts from the same panorama, its owner takes it from there
+	char seedPanoramaId[GSV_PANORAMA_ID_LENGTH] = "";
+	if(numShards > 0)
+	{
+		GSV* seed = gsv_open(atof(argv[1]),atof(argv[2]));
+		if(seed == NULL)
+		{
+			printf("Unable to open a panorama at %s,%s\n",argv[1],argv[2]);
+			return EXIT_FAILURE;
+		}
+		memcpy(seedPanoramaId,seed->dataProperties.panoramaId,GSV_PANORAMA_ID_LENGTH);
+		gsv_close(&seed);
+	}
+	
+	// Without --shard every shard is a child running the rest of main
+	if(numShards > 0 && shard < 0)
+	{
+		if(gsv_spool_reset(spoolDirectory,numShards) != GSV_OK)
+		{
+			printf("Unable to prepare the spool in %s\n",spoolDirectory);
+			return EXIT_FAILURE;
+		}
+		fflush(stdout);
+		pid_t* pids = (pid_t*) calloc(numShards,sizeof(pid_t));
+		int started = 1;
+		for(int i=0;i<numShards && shard<0 && started;i++)
+		{
+			pid_t pid = (pids != NULL) ? fork() : -1;
+			if(pid == 0)
+				shard = i;
+			else if(pid > 0)
+				pids[i] = pid;
+			else
+			{
+				// The shards already running would wait for this one forever
+				printf("Unable to start shard %d\n",i);
+				gsv_spool_abort(spoolDirectory,i);
+				started = 0;
+			}
+		}
+		if(shard < 0)
+		{
+			// A shard that died without saying so is marked failed for the others
+			int failed = (started == 0);
+			int childStatus = 0;
+			pid_t pid;
+			while((pid = wait(&childStatus)) > 0)
+			{
+				if(WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == EXIT_SUCCESS)
+					continue;
+				failed = 1;
+				for(int i=0;i<numShards;i++)
+				{
+					if(pids[i] == pid)
+						gsv_spool_abort(spoolDirectory,i);
+				}
+			}
+			free(pids);
+			return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+		free(pids);
+	}
+	
+	if(tracePath != NULL)
+		gsv_trace_start(0);
+	// Warms the next level's metadata while this one is being stitched
+	if(prefetch)
+		gsv_prefetch_enable(NULL);
+	
+	// Incremental when the manifest of an earlier crawl exists, the first crawl writes it
+	gsvManifest* manifest = NULL;
+	if(manifestPath != NULL)
+	{
+		manifest = gsv_manifest_load(manifestPath);
+		if(manifest == NULL)
+			manifest = gsv_manifest_create();
+	}
+	
+	// One archive per shard, suffixed like the trace
+	gsvArchive* archive = NULL;
+	if(archivePath != NULL)
+	{
+		char shardArchivePath[4096];
+		snprintf(shardArchivePath,sizeof(shardArchivePath),(numShards > 0) ? "%s.%d" : "%s",archivePath,shard);
+		archive = gsv_archive_create(shardArchivePath);
+		if(archive == NULL)
+		{
+			printf("Unable to open archive %s\n",shardArchivePath);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	// Costs one zoom 0 tile per panorama, saves the zoom 5 ones of every recapture
+	gsvDuplicateIndex* duplicates = (dedupe) ? gsv_duplicate_index_create(NULL) : NULL;
+	
+	int exitStatus = EXIT_SUCCESS;
+	if(numShards > 0)
+	{
+		if(shardedCrawl(seedPanoramaId,argv[3],argv[4],(100+numShards-1)/numShards,shard,numShards,spoolDirectory,archive,duplicates) != GSV_OK)
+			exitStatus = EXIT_FAILURE;
+	}
+	else
+		breadthFirstSearch(atof(argv[1]),atof(argv[2]),argv[3],argv[4],100,manifest,archive,duplicates);
+	
+	gsv_duplicate_index_destroy(&duplicates);
+	
+	if(archive != NULL)
+	{
+		gsvStatus status = gsv_archive_close(&archive);
+		if(status != GSV_OK)
+			printf("Unable to write the archive's index: %s\n",gsv_status_name(status));
+	}
+	
+	if(manifest != NULL)
+	{
+		gsvStatus status = gsv_manifest_save(manifest,manifestPath);
+		if(status != GSV_OK)
+			printf("Unable to save manifest to %s: %s\n",manifestPath,gsv_status_name(status));
+		gsv_manifest_destroy(&manifest);
+	}
+	
+	// A trace per shard, suffixed with its number
+	if(tracePath != NULL)
+	{
+		char shardTracePath[4096];
+		snprintf(shardTracePath,sizeof(shardTracePath),(numShards > 0) ? "%s.%d" : "%s",tracePath,shard);
+		if(gsv_trace_flush(shardTracePath) != 0)
+			printf("Unable to write trace to %s\n",shardTracePath);
+	}
+	
+	if(prefetch)
+	{
+		gsvPrefetchStats stats;
+		gsv_prefetch_stats(&stats);
+		printf("Prefetch: %llu issued, %llu hits, %llu wasted\n",stats.issued,stats.hits,stats.wasted);
+	}
 	
-	return EXIT_SUCCESS;
+	gsv_global_cleanup();
+	return exitStatus;
 }